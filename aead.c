@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include "aead.h"
+#include "util.h"
+
+#if defined(__x86_64__)
+#define CHACHA_AVX2 1
+#endif
+
+#define CHACHA_BLOCK_LEN 64
+#define CHACHA_MAX_LANES 8
+#define POLY1305_BLOCK_LEN 16
+
+/* Lane i of each vector is a word of the state of block counter + i */
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+#define ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(x, a, b, c, d) do { \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTATE(x[d], 16); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTATE(x[b], 12); \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTATE(x[d], 8); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTATE(x[b], 7); \
+} while (0)
+
+/* Writes the key stream of as many consecutive blocks as there are lanes
+ * in type, for any vector type */
+#define CHACHA_BLOCKS(type, lanes, state, stream) do { \
+	type x[16]; \
+	type initial[16]; \
+	for (int i = 0; i < 16; i++) { \
+		x[i] = initial[i] = (type){ 0 } + state[i]; \
+		if (i == 12) \
+			for (int lane = 0; lane < lanes; lane++) \
+				x[i][lane] = initial[i][lane] += lane; \
+	} \
+	for (int round = 0; round < 10; round++) { \
+		QUARTER_ROUND(x, 0, 4, 8, 12); \
+		QUARTER_ROUND(x, 1, 5, 9, 13); \
+		QUARTER_ROUND(x, 2, 6, 10, 14); \
+		QUARTER_ROUND(x, 3, 7, 11, 15); \
+		QUARTER_ROUND(x, 0, 5, 10, 15); \
+		QUARTER_ROUND(x, 1, 6, 11, 12); \
+		QUARTER_ROUND(x, 2, 7, 8, 13); \
+		QUARTER_ROUND(x, 3, 4, 9, 14); \
+	} \
+	uint32_t words[16][lanes]; \
+	for (int i = 0; i < 16; i++) \
+		x[i] += initial[i]; \
+	memcpy(words, x, sizeof(words)); \
+	for (int lane = 0; lane < lanes; lane++) \
+		for (int i = 0; i < 16; i++) \
+			put_le32(stream + lane * CHACHA_BLOCK_LEN + 4 * i, \
+				words[i][lane]); \
+} while (0)
+
+static size_t chacha20_blocks4(const uint32_t *state, uint8_t *stream)
+{
+	CHACHA_BLOCKS(u32x4, 4, state, stream);
+	return 4;
+}
+
+#ifdef CHACHA_AVX2
+__attribute__((target("avx2")))
+static size_t chacha20_blocks8(const uint32_t *state, uint8_t *stream)
+{
+	CHACHA_BLOCKS(u32x8, 8, state, stream);
+	return 8;
+}
+#endif
+
+/* XORs in with the key stream starting at block counter */
+static void chacha20_xor(const uint8_t *key, const uint8_t *nonce,
+	uint32_t counter, const uint8_t *in, uint8_t *out, size_t len)
+{
+	uint32_t state[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	for (int i = 0; i < 8; i++)
+		state[4 + i] = get_le32(key + 4 * i);
+	state[12] = counter;
+	for (int i = 0; i < 3; i++)
+		state[13 + i] = get_le32(nonce + 4 * i);
+	size_t (*blocks)(const uint32_t *, uint8_t *) = &chacha20_blocks4;
+#ifdef CHACHA_AVX2
+	if (len > 4 * CHACHA_BLOCK_LEN && __builtin_cpu_supports("avx2"))
+		blocks = &chacha20_blocks8;
+#endif
+
+	uint8_t stream[CHACHA_MAX_LANES * CHACHA_BLOCK_LEN];
+	while (len > 0) {
+		size_t count = blocks(state, stream);
+		size_t n = count * CHACHA_BLOCK_LEN;
+		state[12] += count;
+		if (n > len)
+			n = len;
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			uint64_t a, b;
+			memcpy(&a, in + i, 8);
+			memcpy(&b, stream + i, 8);
+			a ^= b;
+			memcpy(out + i, &a, 8);
+		}
+		for (; i < n; i++)
+			out[i] = in[i] ^ stream[i];
+		in += n;
+		out += n;
+		len -= n;
+	}
+}
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 uint128_t;
+
+/* 130-bit arithmetic on 44-bit limbs, with 128-bit products */
+struct poly1305 {
+	uint64_t r[3];
+	uint64_t h[3];
+	uint64_t pad[2];
+};
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+static void poly1305_init(struct poly1305 *p, const uint8_t *key)
+{
+	uint64_t t0 = get_le64(key);
+	uint64_t t1 = get_le64(key + 8);
+	p->r[0] = t0 & 0xffc0fffffffULL;
+	p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	p->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+	memset(p->h, 0, sizeof(p->h));
+	p->pad[0] = get_le64(key + 16);
+	p->pad[1] = get_le64(key + 24);
+}
+
+/* len is a multiple of POLY1305_BLOCK_LEN */
+static void poly1305_blocks(struct poly1305 *p, const uint8_t *m, size_t len)
+{
+	const uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+	const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+	uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+	for (; len >= POLY1305_BLOCK_LEN; m += POLY1305_BLOCK_LEN,
+		len -= POLY1305_BLOCK_LEN) {
+		uint64_t t0 = get_le64(m);
+		uint64_t t1 = get_le64(m + 8);
+		h0 += t0 & MASK44;
+		h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+		h2 += ((t1 >> 24) & MASK42) | (1ULL << 40);
+
+		uint128_t d0 = (uint128_t)h0 * r0 + (uint128_t)h1 * s2 +
+			(uint128_t)h2 * s1;
+		uint128_t d1 = (uint128_t)h0 * r1 + (uint128_t)h1 * r0 +
+			(uint128_t)h2 * s2;
+		uint128_t d2 = (uint128_t)h0 * r2 + (uint128_t)h1 * r1 +
+			(uint128_t)h2 * r0;
+
+		uint64_t c = (uint64_t)(d0 >> 44);
+		h0 = (uint64_t)d0 & MASK44;
+		d1 += c;
+		c = (uint64_t)(d1 >> 44);
+		h1 = (uint64_t)d1 & MASK44;
+		d2 += c;
+		c = (uint64_t)(d2 >> 42);
+		h2 = (uint64_t)d2 & MASK42;
+		h0 += c * 5;
+		c = h0 >> 44;
+		h0 &= MASK44;
+		h1 += c;
+	}
+	p->h[0] = h0;
+	p->h[1] = h1;
+	p->h[2] = h2;
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t *tag)
+{
+	uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+	uint64_t c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += c;
+	c = h2 >> 42;
+	h2 &= MASK42;
+	h0 += c * 5;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += c;
+	c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += c;
+	c = h2 >> 42;
+	h2 &= MASK42;
+	h0 += c * 5;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += c;
+
+	/* h - (2^130 - 5), kept if it does not underflow, in constant time */
+	uint64_t g0 = h0 + 5;
+	c = g0 >> 44;
+	g0 &= MASK44;
+	uint64_t g1 = h1 + c;
+	c = g1 >> 44;
+	g1 &= MASK44;
+	uint64_t g2 = h2 + c - (1ULL << 42);
+	uint64_t mask = (g2 >> 63) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+
+	uint64_t t0 = p->pad[0];
+	uint64_t t1 = p->pad[1];
+	h0 += t0 & MASK44;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+	c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += ((t1 >> 24) & MASK42) + c;
+	h2 &= MASK42;
+	put_le64(tag, h0 | (h1 << 44));
+	put_le64(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+#else
+/* 130-bit arithmetic on 26-bit limbs */
+struct poly1305 {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+};
+
+static void poly1305_init(struct poly1305 *p, const uint8_t *key)
+{
+	p->r[0] = get_le32(key) & 0x3ffffff;
+	p->r[1] = (get_le32(key + 3) >> 2) & 0x3ffff03;
+	p->r[2] = (get_le32(key + 6) >> 4) & 0x3ffc0ff;
+	p->r[3] = (get_le32(key + 9) >> 6) & 0x3f03fff;
+	p->r[4] = (get_le32(key + 12) >> 8) & 0x00fffff;
+	memset(p->h, 0, sizeof(p->h));
+	for (int i = 0; i < 4; i++)
+		p->pad[i] = get_le32(key + 16 + 4 * i);
+}
+
+/* len is a multiple of POLY1305_BLOCK_LEN */
+static void poly1305_blocks(struct poly1305 *p, const uint8_t *m, size_t len)
+{
+	const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3],
+		r4 = p->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3],
+		h4 = p->h[4];
+
+	for (; len >= POLY1305_BLOCK_LEN; m += POLY1305_BLOCK_LEN,
+		len -= POLY1305_BLOCK_LEN) {
+		h0 += get_le32(m) & 0x3ffffff;
+		h1 += (get_le32(m + 3) >> 2) & 0x3ffffff;
+		h2 += (get_le32(m + 6) >> 4) & 0x3ffffff;
+		h3 += (get_le32(m + 9) >> 6) & 0x3ffffff;
+		h4 += (get_le32(m + 12) >> 8) | (1 << 24);
+
+		uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 +
+			(uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+		uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 +
+			(uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+		uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 +
+			(uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+		uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 +
+			(uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+		uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 +
+			(uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+		uint32_t c = d0 >> 26;
+		h0 = d0 & 0x3ffffff;
+		d1 += c;
+		c = d1 >> 26;
+		h1 = d1 & 0x3ffffff;
+		d2 += c;
+		c = d2 >> 26;
+		h2 = d2 & 0x3ffffff;
+		d3 += c;
+		c = d3 >> 26;
+		h3 = d3 & 0x3ffffff;
+		d4 += c;
+		c = d4 >> 26;
+		h4 = d4 & 0x3ffffff;
+		h0 += c * 5;
+		c = h0 >> 26;
+		h0 &= 0x3ffffff;
+		h1 += c;
+	}
+	p->h[0] = h0;
+	p->h[1] = h1;
+	p->h[2] = h2;
+	p->h[3] = h3;
+	p->h[4] = h4;
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t *tag)
+{
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3],
+		h4 = p->h[4];
+	uint32_t c = h1 >> 26;
+	h1 &= 0x3ffffff;
+	h2 += c;
+	c = h2 >> 26;
+	h2 &= 0x3ffffff;
+	h3 += c;
+	c = h3 >> 26;
+	h3 &= 0x3ffffff;
+	h4 += c;
+	c = h4 >> 26;
+	h4 &= 0x3ffffff;
+	h0 += c * 5;
+	c = h0 >> 26;
+	h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* h - (2^130 - 5), kept if it does not underflow, in constant time */
+	uint32_t g0 = h0 + 5;
+	c = g0 >> 26;
+	g0 &= 0x3ffffff;
+	uint32_t g1 = h1 + c;
+	c = g1 >> 26;
+	g1 &= 0x3ffffff;
+	uint32_t g2 = h2 + c;
+	c = g2 >> 26;
+	g2 &= 0x3ffffff;
+	uint32_t g3 = h3 + c;
+	c = g3 >> 26;
+	g3 &= 0x3ffffff;
+	uint32_t g4 = h4 + c - (1 << 26);
+	uint32_t mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	uint32_t words[4] = {
+		h0 | (h1 << 26),
+		(h1 >> 6) | (h2 << 20),
+		(h2 >> 12) | (h3 << 14),
+		(h3 >> 18) | (h4 << 8),
+	};
+	uint64_t f = 0;
+	for (int i = 0; i < 4; i++) {
+		f += (uint64_t)words[i] + p->pad[i];
+		put_le32(tag + 4 * i, (uint32_t)f);
+		f >>= 32;
+	}
+}
+
+#endif
+
+/* Data padded with zeroes to a whole number of blocks, as in RFC 8439 */
+static void poly1305_padded(struct poly1305 *p, const uint8_t *data,
+	size_t len)
+{
+	size_t full = len - len % POLY1305_BLOCK_LEN;
+	poly1305_blocks(p, data, full);
+	if (full < len) {
+		uint8_t block[POLY1305_BLOCK_LEN] = { 0 };
+		memcpy(block, data + full, len - full);
+		poly1305_blocks(p, block, sizeof(block));
+	}
+}
+
+static void compute_tag(const uint8_t *key, const uint8_t *nonce,
+	const uint8_t *aad, size_t aad_len, const uint8_t *ciphertext,
+	size_t len, uint8_t *tag)
+{
+	/* The Poly1305 key is the start of the key stream for counter 0 */
+	uint8_t one_time_key[32] = { 0 };
+	chacha20_xor(key, nonce, 0, one_time_key, one_time_key,
+		sizeof(one_time_key));
+	struct poly1305 p;
+	poly1305_init(&p, one_time_key);
+	poly1305_padded(&p, aad, aad_len);
+	poly1305_padded(&p, ciphertext, len);
+	uint8_t lengths[POLY1305_BLOCK_LEN];
+	put_le64(lengths, aad_len);
+	put_le64(lengths + 8, len);
+	poly1305_blocks(&p, lengths, sizeof(lengths));
+	poly1305_finish(&p, tag);
+}
+
+void aead_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+	size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+	uint8_t *tag)
+{
+	chacha20_xor(key, nonce, 1, in, out, len);
+	compute_tag(key, nonce, aad, aad_len, out, len, tag);
+}
+
+int aead_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+	size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+	const uint8_t *tag)
+{
+	uint8_t expected[AEAD_TAG_LEN];
+	compute_tag(key, nonce, aad, aad_len, in, len, expected);
+	uint8_t diff = 0;
+	for (int i = 0; i < AEAD_TAG_LEN; i++)
+		diff |= expected[i] ^ tag[i];
+	if (diff != 0)
+		return EBADMSG;
+	chacha20_xor(key, nonce, 1, in, out, len);
+	return 0;
+}
+
+void aead_derive(const uint8_t *key, const uint8_t *nonce, uint8_t *out,
+	size_t len)
+{
+	memset(out, 0, len);
+	chacha20_xor(key, nonce, 0, out, out, len);
+}
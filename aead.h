@@ -0,0 +1,34 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ChaCha20-Poly1305 authenticated encryption (RFC 8439), so that streams
+ * can be encrypted without piping them through another process. Four
+ * ChaCha20 blocks are computed at a time, with vector extensions which
+ * the compiler maps to SSE2/NEON, or eight with AVX2 on x86-64 CPUs which
+ * have it, for messages longer than four blocks. */
+
+#define AEAD_KEY_LEN 32
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+
+/* Encrypts len bytes from in to out, which may be the same buffer, and
+ * writes the tag of the result and of aad */
+void aead_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+	size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+	uint8_t *tag);
+
+/* Checks the tag, then decrypts len bytes from in to out, which may be the
+ * same buffer. Returns EBADMSG, with out untouched, if the tag is wrong. */
+int aead_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+	size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+	const uint8_t *tag);
+
+/* Writes len bytes of the ChaCha20 key stream of key and nonce, to derive
+ * other keys from it */
+void aead_derive(const uint8_t *key, const uint8_t *nonce, uint8_t *out,
+	size_t len);
+
+#endif
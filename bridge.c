@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "bridge.h"
+#include "util.h"
+
+static unsigned slot_of(const uint8_t *addr)
+{
+	uint64_t h = 0;
+	for (int i = 0; i < BRIDGE_ADDR_LEN; i++)
+		h = (h << 8) | addr[i];
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h & (BRIDGE_TABLE_LEN - 1);
+}
+
+static int expired(const struct bridge_entry *entry, uint64_t now)
+{
+	return (entry->seen == 0 || entry->seen + BRIDGE_AGEING_NS < now);
+}
+
+void bridge_init(struct bridge *bridge)
+{
+	memset(bridge, 0, sizeof(*bridge));
+}
+
+void bridge_learn(struct bridge *bridge, const uint8_t *addr, uint16_t port,
+	uint64_t now)
+{
+	/* Group addresses are never sources of valid frames */
+	if (addr[0] & 1)
+		return;
+	unsigned slot = slot_of(addr);
+	struct bridge_entry *reuse = NULL;
+	unsigned reuse_probe = 0;
+	for (unsigned probe = 0; probe < BRIDGE_TABLE_LEN; probe++) {
+		struct bridge_entry *entry =
+			&bridge->entries[(slot + probe) & (BRIDGE_TABLE_LEN - 1)];
+		if (entry->seen != 0 &&
+			memcmp(entry->addr, addr, BRIDGE_ADDR_LEN) == 0) {
+			if (entry->port != port && !expired(entry, now))
+				bridge->moves++;
+			entry->port = port;
+			entry->seen = now;
+			return;
+		}
+		if (reuse == NULL && expired(entry, now)) {
+			reuse = entry;
+			reuse_probe = probe;
+		}
+		/* The address cannot be further than the first free slot, nor
+		 * than the longest probe sequence */
+		if (entry->seen == 0 || (reuse != NULL && probe >= bridge->max_probe))
+			break;
+	}
+	if (reuse == NULL) {
+		bridge->full++;
+		return;
+	}
+	memcpy(reuse->addr, addr, BRIDGE_ADDR_LEN);
+	reuse->port = port;
+	reuse->seen = now;
+	if (reuse_probe > bridge->max_probe)
+		bridge->max_probe = reuse_probe;
+}
+
+void bridge_lookup_batch(const struct bridge *bridge,
+	const uint8_t *const *addrs, size_t count, uint16_t *ports, uint64_t now)
+{
+	for (size_t i = 0; i < count; i++)
+		__builtin_prefetch(&bridge->entries[slot_of(addrs[i])]);
+	for (size_t i = 0; i < count; i++) {
+		ports[i] = BRIDGE_PORT_NONE;
+		if (addrs[i][0] & 1)
+			continue;
+		unsigned slot = slot_of(addrs[i]);
+		for (unsigned probe = 0; probe <= bridge->max_probe; probe++) {
+			const struct bridge_entry *entry = &bridge->entries[
+				(slot + probe) & (BRIDGE_TABLE_LEN - 1)];
+			if (entry->seen == 0)
+				break;
+			if (memcmp(entry->addr, addrs[i], BRIDGE_ADDR_LEN) == 0) {
+				if (!expired(entry, now))
+					ports[i] = entry->port;
+				break;
+			}
+		}
+	}
+}
+
+void bridge_print(FILE *f, const struct bridge *bridge)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	unsigned live = 0;
+	for (unsigned i = 0; i < BRIDGE_TABLE_LEN; i++)
+		live += !expired(&bridge->entries[i], now);
+	fprintf(f, "fdb: %u addresses, %llu moved, %llu not learned (table"
+		" full)\n", live, bridge->moves, bridge->full);
+}
@@ -0,0 +1,54 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Forwarding database of a learning switch between tap devices and the
+ * peer: the port each MAC address was last seen as the source of a frame
+ * on, for frames to it to only go there. Entries not refreshed for the
+ * ageing time are forgotten, so that frames to stations which left are
+ * flooded again. Addresses are kept in an open addressing table with
+ * linear probing, expired entries being reused in place. Times are
+ * CLOCK_MONOTONIC nanoseconds, which clock changes do not move. */
+
+#ifndef BRIDGE_TABLE_LEN
+#define BRIDGE_TABLE_LEN 4096      /* a power of 2 */
+#endif
+#ifndef BRIDGE_AGEING_NS
+#define BRIDGE_AGEING_NS 300000000000ULL
+#endif
+
+/* Ports: a device by its channel number, or the peer */
+#define BRIDGE_PORT_PEER 0xfffe
+#define BRIDGE_PORT_NONE 0xffff   /* unknown address, to flood */
+
+#define BRIDGE_ADDR_LEN 6
+#define BRIDGE_HEADER_LEN 14       /* destination, source, ethertype */
+
+struct bridge_entry {
+	uint8_t addr[BRIDGE_ADDR_LEN];
+	uint16_t port;
+	uint64_t seen;             /* 0 if the slot was never used */
+};
+
+struct bridge {
+	struct bridge_entry entries[BRIDGE_TABLE_LEN];
+	/* Longest probe sequence of any entry, where lookups give up */
+	unsigned max_probe;
+	unsigned long long moves;
+	unsigned long long full;   /* addresses not learned */
+};
+
+void bridge_init(struct bridge *bridge);
+/* Records that addr was seen on port at now */
+void bridge_learn(struct bridge *bridge, const uint8_t *addr, uint16_t port,
+	uint64_t now);
+/* Ports of count addresses, BRIDGE_PORT_NONE for those unknown or
+ * multicast, with the slots of all of them fetched before any is read */
+void bridge_lookup_batch(const struct bridge *bridge,
+	const uint8_t *const *addrs, size_t count, uint16_t *ports, uint64_t now);
+void bridge_print(FILE *f, const struct bridge *bridge);
+
+#endif
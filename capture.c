@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "lz4.h"
+#include "util.h"
+
+#define CAPTURE_MAGIC "TUNCAP\r\n"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BLOCK_MAGIC 0x4b424354 /* "TCBK" */
+#define CAPTURE_INDEX_MAGIC 0x58494354 /* "TCIX" */
+
+#define FILE_HEADER_LEN 16
+#define BLOCK_HEADER_LEN 40
+#define INDEX_ENTRY_LEN 32
+#define FOOTER_LEN 24
+#define RECORD_HEADER_LEN 12
+
+struct capture_block {
+	uint8_t *raw;
+	size_t raw_len;
+	uint32_t count;
+	uint64_t first_ts;
+	uint64_t last_ts;
+};
+
+struct capture_index_entry {
+	uint64_t offset;
+	uint64_t first_ts;
+	uint64_t last_ts;
+	uint32_t count;
+};
+
+struct capture_writer {
+	int fd;
+	size_t block_cap;
+	uint64_t last_ts;
+	/* Blocks [consumed, produced) are waiting for the compression thread,
+	 * the producer fills blocks[produced % CAPTURE_QUEUE_LEN] */
+	struct capture_block blocks[CAPTURE_QUEUE_LEN];
+	unsigned long produced;
+	unsigned long consumed;
+	int closing;
+	int error;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Owned by the compression thread */
+	uint8_t *stored;
+	size_t stored_cap;
+	uint64_t offset;
+	struct capture_index_entry *index;
+	size_t index_len;
+	size_t index_cap;
+};
+
+struct capture_reader {
+	const uint8_t *map;
+	size_t map_len;
+	uint16_t link_type;
+	uint16_t flags;
+	struct capture_index_entry *index;
+	size_t index_len;
+	size_t next_block;
+	uint8_t *raw;
+	size_t raw_cap;
+	size_t raw_len;
+	size_t raw_pos;
+};
+
+static int index_append(struct capture_index_entry **index, size_t *len,
+	size_t *cap, const struct capture_index_entry *entry)
+{
+	if (*len == *cap) {
+		size_t new_cap = (*cap == 0 ? 64 : *cap * 2);
+		void *tmp = realloc(*index, new_cap * sizeof(**index));
+		if (tmp == NULL)
+			return ENOMEM;
+		*index = tmp;
+		*cap = new_cap;
+	}
+	(*index)[(*len)++] = *entry;
+	return 0;
+}
+
+static int write_block(struct capture_writer *writer,
+	const struct capture_block *block)
+{
+	uint8_t header[BLOCK_HEADER_LEN];
+	const uint8_t *payload = writer->stored;
+	size_t stored_len = lz4_compress_block(block->raw, block->raw_len,
+		writer->stored, writer->stored_cap);
+	uint8_t codec = CAPTURE_CODEC_LZ4;
+
+	/* Incompressible blocks (e.g. encrypted traffic) are stored as-is */
+	if (stored_len == 0 || stored_len >= block->raw_len) {
+		payload = block->raw;
+		stored_len = block->raw_len;
+		codec = CAPTURE_CODEC_NONE;
+	}
+
+	memset(header, 0, sizeof(header));
+	put_le32(header, CAPTURE_BLOCK_MAGIC);
+	header[4] = codec;
+	put_le32(header + 8, block->raw_len);
+	put_le32(header + 12, stored_len);
+	put_le32(header + 16, block->count);
+	put_le64(header + 24, block->first_ts);
+	put_le64(header + 32, block->last_ts);
+
+	struct capture_index_entry entry = {
+		.offset = writer->offset,
+		.first_ts = block->first_ts,
+		.last_ts = block->last_ts,
+		.count = block->count,
+	};
+	int res = index_append(&writer->index, &writer->index_len,
+		&writer->index_cap, &entry);
+	if (res == 0)
+		res = write_all(writer->fd, header, sizeof(header));
+	if (res == 0)
+		res = write_all(writer->fd, payload, stored_len);
+	writer->offset += sizeof(header) + stored_len;
+	return res;
+}
+
+static void *compression_thread(void *arg)
+{
+	struct capture_writer *writer = arg;
+
+	pthread_mutex_lock(&writer->lock);
+	while (1) {
+		while (writer->consumed == writer->produced && !writer->closing)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		if (writer->consumed == writer->produced)
+			break;
+		struct capture_block *block =
+			&writer->blocks[writer->consumed % CAPTURE_QUEUE_LEN];
+		pthread_mutex_unlock(&writer->lock);
+
+		int res = 0;
+		if (writer->error == 0)
+			res = write_block(writer, block);
+
+		pthread_mutex_lock(&writer->lock);
+		if (res != 0)
+			writer->error = res;
+		writer->consumed++;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+/* Hands the block being filled to the compression thread, and waits until
+ * there is a free one to fill next */
+static int submit_block(struct capture_writer *writer)
+{
+	struct capture_block *block =
+		&writer->blocks[writer->produced % CAPTURE_QUEUE_LEN];
+	if (block->count == 0)
+		return 0;
+
+	pthread_mutex_lock(&writer->lock);
+	writer->produced++;
+	pthread_cond_broadcast(&writer->cond);
+	while (writer->produced - writer->consumed >= CAPTURE_QUEUE_LEN)
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	int res = writer->error;
+	pthread_mutex_unlock(&writer->lock);
+
+	block = &writer->blocks[writer->produced % CAPTURE_QUEUE_LEN];
+	block->raw_len = 0;
+	block->count = 0;
+	return res;
+}
+
+static void free_writer(struct capture_writer *writer)
+{
+	for (int i = 0; i < CAPTURE_QUEUE_LEN; i++)
+		free(writer->blocks[i].raw);
+	free(writer->stored);
+	free(writer->index);
+	if (writer->fd >= 0)
+		close(writer->fd);
+	free(writer);
+}
+
+int capture_writer_open(struct capture_writer **writer, const char *path,
+	uint16_t link_type, uint16_t flags, size_t max_packet_len)
+{
+	if (writer == NULL || path == NULL)
+		return EINVAL;
+
+	struct capture_writer *w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return ENOMEM;
+	w->fd = -1;
+	w->block_cap = CAPTURE_BLOCK_LEN;
+	if (w->block_cap < max_packet_len + RECORD_HEADER_LEN)
+		w->block_cap = max_packet_len + RECORD_HEADER_LEN;
+	w->stored_cap = LZ4_BOUND(w->block_cap);
+	w->stored = malloc(w->stored_cap);
+	int res = (w->stored == NULL ? ENOMEM : 0);
+	for (int i = 0; res == 0 && i < CAPTURE_QUEUE_LEN; i++) {
+		w->blocks[i].raw = malloc(w->block_cap);
+		if (w->blocks[i].raw == NULL)
+			res = ENOMEM;
+	}
+	if (res != 0) {
+		free_writer(w);
+		return res;
+	}
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		res = errno;
+		fprintf(stderr, "Error: unable to open capture file %s\n", path);
+		perror("open()");
+		free_writer(w);
+		return res;
+	}
+
+	uint8_t header[FILE_HEADER_LEN];
+	memcpy(header, CAPTURE_MAGIC, 8);
+	put_le32(header + 8, CAPTURE_VERSION);
+	put_le16(header + 12, link_type);
+	put_le16(header + 14, flags);
+	res = write_all(w->fd, header, sizeof(header));
+	if (res != 0) {
+		free_writer(w);
+		return res;
+	}
+	w->offset = sizeof(header);
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	res = pthread_create(&w->thread, NULL, &compression_thread, w);
+	if (res != 0) {
+		fprintf(stderr, "Error: unable to start compression thread\n");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free_writer(w);
+		return res;
+	}
+	*writer = w;
+	return 0;
+}
+
+int capture_writer_append(struct capture_writer *writer, uint64_t ts_ns,
+	const uint8_t *data, size_t len)
+{
+	if (writer == NULL || len + RECORD_HEADER_LEN > writer->block_cap)
+		return EINVAL;
+
+	/* Keep timestamps monotonic so that the index can be bisected even if
+	 * the wall clock steps backwards */
+	if (ts_ns < writer->last_ts)
+		ts_ns = writer->last_ts;
+	writer->last_ts = ts_ns;
+
+	struct capture_block *block =
+		&writer->blocks[writer->produced % CAPTURE_QUEUE_LEN];
+	if (block->count > 0 &&
+		(block->raw_len + RECORD_HEADER_LEN + len > writer->block_cap ||
+		ts_ns - block->first_ts > CAPTURE_BLOCK_NS)) {
+		int res = submit_block(writer);
+		if (res != 0)
+			return res;
+		block = &writer->blocks[writer->produced % CAPTURE_QUEUE_LEN];
+	}
+
+	uint8_t *record = block->raw + block->raw_len;
+	put_le64(record, ts_ns);
+	put_le32(record + 8, len);
+	memcpy(record + RECORD_HEADER_LEN, data, len);
+	block->raw_len += RECORD_HEADER_LEN + len;
+	if (block->count++ == 0)
+		block->first_ts = ts_ns;
+	block->last_ts = ts_ns;
+	return 0;
+}
+
+int capture_writer_close(struct capture_writer *writer)
+{
+	if (writer == NULL)
+		return EINVAL;
+
+	int res = submit_block(writer);
+	pthread_mutex_lock(&writer->lock);
+	writer->closing = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+	if (res == 0)
+		res = writer->error;
+
+	uint64_t index_offset = writer->offset;
+	for (size_t i = 0; res == 0 && i < writer->index_len; i++) {
+		uint8_t entry[INDEX_ENTRY_LEN];
+		memset(entry, 0, sizeof(entry));
+		put_le64(entry, writer->index[i].offset);
+		put_le64(entry + 8, writer->index[i].first_ts);
+		put_le64(entry + 16, writer->index[i].last_ts);
+		put_le32(entry + 24, writer->index[i].count);
+		res = write_all(writer->fd, entry, sizeof(entry));
+	}
+	if (res == 0) {
+		uint8_t footer[FOOTER_LEN];
+		put_le64(footer, index_offset);
+		put_le64(footer + 8, writer->index_len);
+		put_le32(footer + 16, CAPTURE_INDEX_MAGIC);
+		put_le32(footer + 20, CAPTURE_VERSION);
+		res = write_all(writer->fd, footer, sizeof(footer));
+	}
+	if (res != 0)
+		fprintf(stderr, "Error: unable to write capture file: %s\n",
+			strerror(res));
+	free_writer(writer);
+	return res;
+}
+
+static int parse_block_header(const struct capture_reader *reader,
+	uint64_t offset, uint32_t *raw_len, uint32_t *stored_len,
+	struct capture_index_entry *entry)
+{
+	if (offset > reader->map_len ||
+		reader->map_len - offset < BLOCK_HEADER_LEN)
+		return EINVAL;
+	const uint8_t *header = reader->map + offset;
+	if (get_le32(header) != CAPTURE_BLOCK_MAGIC || header[4] > CAPTURE_CODEC_LZ4)
+		return EINVAL;
+	*raw_len = get_le32(header + 8);
+	*stored_len = get_le32(header + 12);
+	if (reader->map_len - offset - BLOCK_HEADER_LEN < *stored_len)
+		return EINVAL;
+	entry->offset = offset;
+	entry->count = get_le32(header + 16);
+	entry->first_ts = get_le64(header + 24);
+	entry->last_ts = get_le64(header + 32);
+	return 0;
+}
+
+static int load_index(struct capture_reader *reader)
+{
+	size_t cap = 0;
+	uint32_t raw_len = 0;
+	uint32_t stored_len = 0;
+	struct capture_index_entry entry;
+
+	if (reader->map_len >= FILE_HEADER_LEN + FOOTER_LEN) {
+		const uint8_t *footer = reader->map + reader->map_len - FOOTER_LEN;
+		uint64_t index_offset = get_le64(footer);
+		uint64_t count = get_le64(footer + 8);
+		if (get_le32(footer + 16) == CAPTURE_INDEX_MAGIC &&
+			index_offset <= reader->map_len - FOOTER_LEN &&
+			count == (reader->map_len - FOOTER_LEN - index_offset) /
+				INDEX_ENTRY_LEN) {
+			reader->index = calloc(count + 1, sizeof(*reader->index));
+			if (reader->index == NULL)
+				return ENOMEM;
+			for (uint64_t i = 0; i < count; i++) {
+				const uint8_t *p = reader->map + index_offset +
+					i * INDEX_ENTRY_LEN;
+				reader->index[i].offset = get_le64(p);
+				reader->index[i].first_ts = get_le64(p + 8);
+				reader->index[i].last_ts = get_le64(p + 16);
+				reader->index[i].count = get_le32(p + 24);
+			}
+			reader->index_len = count;
+			return 0;
+		}
+	}
+
+	/* No valid index, rebuild it from the blocks which made it to disk */
+	fprintf(stderr, "Warning: capture file has no index (interrupted?),"
+		" scanning it\n");
+	uint64_t offset = FILE_HEADER_LEN;
+	while (parse_block_header(reader, offset, &raw_len, &stored_len,
+		&entry) == 0) {
+		int res = index_append(&reader->index, &reader->index_len, &cap,
+			&entry);
+		if (res != 0)
+			return res;
+		offset += BLOCK_HEADER_LEN + stored_len;
+	}
+	return 0;
+}
+
+int capture_reader_open(struct capture_reader **reader, const char *path)
+{
+	if (reader == NULL || path == NULL)
+		return EINVAL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int res = errno;
+		fprintf(stderr, "Error: unable to open capture file %s\n", path);
+		perror("open()");
+		return res;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int res = errno;
+		close(fd);
+		return res;
+	}
+	if ((size_t)st.st_size < FILE_HEADER_LEN) {
+		fprintf(stderr, "Error: %s is not a capture file\n", path);
+		close(fd);
+		return EINVAL;
+	}
+
+	struct capture_reader *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+	r->map_len = st.st_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		int res = errno;
+		perror("mmap()");
+		free(r);
+		return res;
+	}
+
+	if (memcmp(r->map, CAPTURE_MAGIC, 8) != 0 ||
+		get_le32(r->map + 8) != CAPTURE_VERSION) {
+		fprintf(stderr, "Error: %s is not a capture file\n", path);
+		capture_reader_close(r);
+		return EINVAL;
+	}
+	r->link_type = get_le16(r->map + 12);
+	r->flags = get_le16(r->map + 14);
+	int res = load_index(r);
+	if (res != 0) {
+		capture_reader_close(r);
+		return res;
+	}
+	madvise((void*)r->map, r->map_len, MADV_SEQUENTIAL);
+	*reader = r;
+	return 0;
+}
+
+uint16_t capture_reader_link_type(const struct capture_reader *reader)
+{
+	return reader->link_type;
+}
+
+uint16_t capture_reader_flags(const struct capture_reader *reader)
+{
+	return reader->flags;
+}
+
+size_t capture_reader_block_count(const struct capture_reader *reader)
+{
+	return reader->index_len;
+}
+
+int capture_reader_block_range(const struct capture_reader *reader, size_t i,
+	uint64_t *first_ts, uint64_t *last_ts)
+{
+	if (reader == NULL || i >= reader->index_len)
+		return EINVAL;
+	*first_ts = reader->index[i].first_ts;
+	*last_ts = reader->index[i].last_ts;
+	return 0;
+}
+
+int capture_reader_read_block(const struct capture_reader *reader, size_t i,
+	uint8_t **buf, size_t *cap, size_t *len)
+{
+	uint32_t raw_len = 0;
+	uint32_t stored_len = 0;
+	struct capture_index_entry entry;
+	if (reader == NULL || i >= reader->index_len || buf == NULL ||
+		cap == NULL || len == NULL)
+		return EINVAL;
+	int res = parse_block_header(reader, reader->index[i].offset, &raw_len,
+		&stored_len, &entry);
+	if (res != 0)
+		return res;
+
+	if (*cap < raw_len) {
+		void *tmp = realloc(*buf, raw_len);
+		if (tmp == NULL)
+			return ENOMEM;
+		*buf = tmp;
+		*cap = raw_len;
+	}
+	const uint8_t *stored = reader->map + entry.offset + BLOCK_HEADER_LEN;
+	*len = stored_len;
+	if (reader->map[entry.offset + 4] == CAPTURE_CODEC_LZ4) {
+		res = lz4_decompress_block(stored, stored_len, *buf, raw_len, len);
+	} else if (stored_len <= raw_len) {
+		memcpy(*buf, stored, stored_len);
+	} else {
+		res = EINVAL;
+	}
+	if (res != 0 || *len != raw_len) {
+		fprintf(stderr, "Error: corrupted capture block at offset %llu\n",
+			(unsigned long long)entry.offset);
+		return EINVAL;
+	}
+	return 0;
+}
+
+int capture_block_next(const uint8_t *block, size_t len, size_t *pos,
+	uint64_t *ts_ns, const uint8_t **data, size_t *data_len)
+{
+	if (*pos >= len)
+		return ENODATA;
+	const uint8_t *record = block + *pos;
+	size_t left = len - *pos;
+	if (left < RECORD_HEADER_LEN ||
+		left - RECORD_HEADER_LEN < get_le32(record + 8)) {
+		fprintf(stderr, "Error: truncated record in capture block\n");
+		return EINVAL;
+	}
+	*ts_ns = get_le64(record);
+	*data_len = get_le32(record + 8);
+	*data = record + RECORD_HEADER_LEN;
+	*pos += RECORD_HEADER_LEN + *data_len;
+	return 0;
+}
+
+static int load_block(struct capture_reader *reader, size_t i)
+{
+	int res = capture_reader_read_block(reader, i, &reader->raw,
+		&reader->raw_cap, &reader->raw_len);
+	if (res != 0)
+		return res;
+	reader->raw_pos = 0;
+	reader->next_block = i + 1;
+	return 0;
+}
+
+int capture_reader_seek(struct capture_reader *reader, uint64_t ts_ns)
+{
+	if (reader == NULL)
+		return EINVAL;
+
+	/* First block which ends at or after ts_ns */
+	size_t lo = 0;
+	size_t hi = reader->index_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (reader->index[mid].last_ts < ts_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	reader->raw_len = 0;
+	reader->raw_pos = 0;
+	reader->next_block = lo;
+	if (lo == reader->index_len)
+		return 0;
+
+	int res = load_block(reader, lo);
+	if (res != 0)
+		return res;
+	/* Skips the records before ts_ns, checking their lengths like reads */
+	while (reader->raw_pos < reader->raw_len) {
+		size_t pos = reader->raw_pos;
+		uint64_t record_ts = 0;
+		const uint8_t *data = NULL;
+		size_t len = 0;
+		res = capture_block_next(reader->raw, reader->raw_len, &pos,
+			&record_ts, &data, &len);
+		if (res != 0)
+			return res;
+		if (record_ts >= ts_ns)
+			break;
+		reader->raw_pos = pos;
+	}
+	return 0;
+}
+
+int capture_reader_next(struct capture_reader *reader, uint64_t *ts_ns,
+	const uint8_t **data, size_t *len)
+{
+	if (reader == NULL || ts_ns == NULL || data == NULL || len == NULL)
+		return EINVAL;
+
+	while (reader->raw_pos >= reader->raw_len) {
+		if (reader->next_block >= reader->index_len)
+			return ENODATA;
+		int res = load_block(reader, reader->next_block);
+		if (res != 0)
+			return res;
+	}
+	return capture_block_next(reader->raw, reader->raw_len,
+		&reader->raw_pos, ts_ns, data, len);
+}
+
+void capture_reader_close(struct capture_reader *reader)
+{
+	if (reader == NULL)
+		return;
+	if (reader->map != NULL && reader->map != MAP_FAILED)
+		munmap((void*)reader->map, reader->map_len);
+	free(reader->index);
+	free(reader->raw);
+	free(reader);
+}
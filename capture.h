@@ -0,0 +1,84 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Seekable capture files. Packets are grouped into blocks which are
+ * compressed independently, and a trailing index records the offset and
+ * time range of each block, so that readers can start at any timestamp
+ * without decompressing what comes before it.
+ *
+ *   file header   magic "TUNCAP\r\n", u32 version, u16 link type, u16 flags
+ *   block*        u32 magic, u8 codec, u8[3] 0, u32 raw length,
+ *                 u32 stored length, u32 packet count, u32 0,
+ *                 u64 first timestamp, u64 last timestamp, stored data
+ *   index         one (u64 offset, u64 first, u64 last, u32 count, u32 0)
+ *                 entry per block
+ *   footer        u64 index offset, u64 block count, u32 magic, u32 version
+ *
+ * Once decompressed, a block is a sequence of (u64 timestamp, u32 length,
+ * data) records. Timestamps are nanoseconds since the epoch and never
+ * decrease across a file. All integers are little-endian. Files which were
+ * not closed properly have no index: readers rebuild it from block headers.
+ */
+
+#ifndef CAPTURE_BLOCK_LEN
+#define CAPTURE_BLOCK_LEN (1024 * 1024)
+#endif
+
+/* Blocks are also cut when they span more than this, which bounds how far
+ * a seek has to read past its target */
+#ifndef CAPTURE_BLOCK_NS
+#define CAPTURE_BLOCK_NS 1000000000ULL
+#endif
+
+/* Number of blocks which can be waiting for the compression thread */
+#ifndef CAPTURE_QUEUE_LEN
+#define CAPTURE_QUEUE_LEN 4
+#endif
+
+/* Same values as pcap link types, so that exports need no translation */
+#define CAPTURE_LINK_ETHERNET 1
+#define CAPTURE_LINK_RAW 101
+
+/* Packets start with a struct tun_pi (tuncat -f) */
+#define CAPTURE_FLAG_PI 0x0001
+
+#define CAPTURE_CODEC_NONE 0
+#define CAPTURE_CODEC_LZ4 1
+
+struct capture_writer;
+struct capture_reader;
+
+int capture_writer_open(struct capture_writer **writer, const char *path,
+	uint16_t link_type, uint16_t flags, size_t max_packet_len);
+int capture_writer_append(struct capture_writer *writer, uint64_t ts_ns,
+	const uint8_t *data, size_t len);
+int capture_writer_close(struct capture_writer *writer);
+
+int capture_reader_open(struct capture_reader **reader, const char *path);
+uint16_t capture_reader_link_type(const struct capture_reader *reader);
+uint16_t capture_reader_flags(const struct capture_reader *reader);
+/* Positions the reader on the first packet at or after ts_ns */
+int capture_reader_seek(struct capture_reader *reader, uint64_t ts_ns);
+/* Returns ENODATA once all packets have been read. The packet data remains
+ * valid until the next call. */
+int capture_reader_next(struct capture_reader *reader, uint64_t *ts_ns,
+	const uint8_t **data, size_t *len);
+void capture_reader_close(struct capture_reader *reader);
+
+/* Random access to blocks, for parallel readers. Blocks are decompressed
+ * into a caller-owned buffer, grown as needed, so that several threads can
+ * share a reader. */
+size_t capture_reader_block_count(const struct capture_reader *reader);
+int capture_reader_block_range(const struct capture_reader *reader, size_t i,
+	uint64_t *first_ts, uint64_t *last_ts);
+int capture_reader_read_block(const struct capture_reader *reader, size_t i,
+	uint8_t **buf, size_t *cap, size_t *len);
+/* Iterates over the records of a decompressed block, starting at *pos = 0.
+ * Returns ENODATA at the end of the block. */
+int capture_block_next(const uint8_t *block, size_t len, size_t *pos,
+	uint64_t *ts_ns, const uint8_t **data, size_t *data_len);
+
+#endif
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+static uint32_t table[8][256];
+static int table_ready = 0;
+
+static void init_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^
+				table[0][table[k - 1][i] & 0xff];
+	}
+	table_ready = 1;
+}
+
+/* Slicing-by-8 */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	if (!table_ready)
+		init_table();
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+			(uint32_t)p[3] << 24);
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^
+			table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+	crc = ~crc;
+#ifdef CRC32C_HW
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(crc, data, len);
+#endif
+	return ~crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has
+ * it. Chained like zlib's crc32(): start from 0, pass the previous result
+ * to continue. */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "fanout.h"
+#include "frame.h"
+
+/* Packets written per system call */
+#define FANOUT_WRITE_BATCH 64
+
+static int open_udp(struct fanout_output *output, const char *spec)
+{
+	char host[256];
+	const char *port = strrchr(spec, ':');
+	if (port == NULL || (size_t)(port - spec) >= sizeof(host)) {
+		fprintf(stderr, "Error: invalid output, expected udp:HOST:PORT\n");
+		return EINVAL;
+	}
+	memcpy(host, spec, port - spec);
+	host[port - spec] = '\0';
+	port++;
+
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	int err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "Error: unable to resolve output %s: %s\n", spec,
+			gai_strerror(err));
+		return EINVAL;
+	}
+	output->fd = socket(res->ai_family,
+		SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (output->fd < 0 || connect(output->fd, res->ai_addr, res->ai_addrlen)) {
+		err = errno;
+		perror("output socket");
+		freeaddrinfo(res);
+		return err;
+	}
+	freeaddrinfo(res);
+	output->datagrams = 1;
+	return 0;
+}
+
+static int open_unix(struct fanout_output *output, const char *path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: output socket path too long\n");
+		return EINVAL;
+	}
+	strcpy(addr.sun_path, path);
+	output->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (output->fd < 0 ||
+		connect(output->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		fcntl(output->fd, F_SETFL, O_NONBLOCK) != 0) {
+		int res = errno;
+		fprintf(stderr, "Error: unable to connect to output %s\n", path);
+		perror("connect()");
+		return res;
+	}
+	return 0;
+}
+
+/* Parses dest[,queue=N][,drop=newest|oldest] and opens dest */
+static int open_output(struct fanout_output *output, const char *spec)
+{
+	output->fd = -1;
+	output->queue_len = FANOUT_QUEUE_LEN;
+	output->dest = strdup(spec);
+	if (output->dest == NULL)
+		return ENOMEM;
+	char *option = strchr(output->dest, ',');
+	if (option != NULL)
+		*option++ = '\0';
+	while (option != NULL) {
+		char *next = strchr(option, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		char *end = NULL;
+		if (strncmp(option, "queue=", 6) == 0) {
+			unsigned long len = strtoul(option + 6, &end, 10);
+			if (*end != '\0' || len == 0 || len > 1000000) {
+				fprintf(stderr, "Error: invalid output queue length '%s'\n",
+					option + 6);
+				return EINVAL;
+			}
+			output->queue_len = len;
+		} else if (strcmp(option, "drop=oldest") == 0) {
+			output->drop_oldest = 1;
+		} else if (strcmp(option, "drop=newest") == 0) {
+			output->drop_oldest = 0;
+		} else {
+			fprintf(stderr, "Error: unknown output option '%s'\n", option);
+			return EINVAL;
+		}
+		option = next;
+	}
+	output->queue = calloc(output->queue_len, sizeof(*output->queue));
+	if (output->queue == NULL)
+		return ENOMEM;
+
+	if (strncmp(output->dest, "udp:", 4) == 0)
+		return open_udp(output, output->dest + 4);
+	if (strncmp(output->dest, "unix:", 5) == 0)
+		return open_unix(output, output->dest + 5);
+	/* A pipe blocks here until its reader opens it, like a capture */
+	output->fd = open(output->dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+	int flags = (output->fd < 0 ? -1 : fcntl(output->fd, F_GETFL));
+	if (flags < 0 || fcntl(output->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		int res = errno;
+		fprintf(stderr, "Error: unable to open output %s\n", output->dest);
+		perror("open()");
+		return res;
+	}
+	return 0;
+}
+
+int fanout_open(struct fanout **fanout, const char *const *specs,
+	unsigned count, size_t max_packet)
+{
+	if (fanout == NULL || count == 0 || count > FANOUT_MAX_OUTPUTS)
+		return EINVAL;
+	struct fanout *f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return ENOMEM;
+	int res = 0;
+	size_t buffers = 1;
+	for (unsigned i = 0; res == 0 && i < count; i++) {
+		f->count++;
+		res = open_output(&f->outputs[i], specs[i]);
+		buffers += f->outputs[i].queue_len;
+	}
+	/* Enough buffers for all queues to be full of different packets */
+	if (res == 0)
+		res = pool_init(&f->pool, buffers, FRAME_HEADER_LEN + max_packet,
+			FRAME_HEADER_LEN);
+	if (res != 0) {
+		fanout_close(f);
+		return res;
+	}
+	*fanout = f;
+	return 0;
+}
+
+static void drop_first(struct fanout *fanout, struct fanout_output *output)
+{
+	pool_unref(&fanout->pool, output->queue[output->first]);
+	output->first = (output->first + 1) % output->queue_len;
+	output->count--;
+	output->offset = 0;
+}
+
+/* Copies a packet to a buffer, after its frame header */
+static struct pool_buffer *fill_buffer(struct fanout *fanout,
+	const uint8_t *data, size_t len)
+{
+	struct pool_buffer *buffer = pool_get(&fanout->pool);
+	if (buffer == NULL)
+		return NULL;
+	memcpy(buffer->data, data, len);
+	buffer->len = len;
+	struct frame frame = {
+		.type = FRAME_TYPE_PACKET,
+		.len = len,
+	};
+	frame_put_header(buffer->data - FRAME_HEADER_LEN, &frame);
+	return buffer;
+}
+
+/* Adds a reference to a buffer to the queue of an output */
+static void enqueue(struct fanout *fanout, struct fanout_output *output,
+	struct pool_buffer *buffer)
+{
+	if (output->count == output->queue_len) {
+		output->dropped++;
+		/* Not the first packet if it is partly written, which would
+		 * break the framing: the next one goes in its place */
+		if (!output->drop_oldest || output->queue_len == 1)
+			return;
+		if (output->offset == 0) {
+			drop_first(fanout, output);
+		} else {
+			unsigned second = (output->first + 1) % output->queue_len;
+			pool_unref(&fanout->pool, output->queue[second]);
+			output->queue[second] = output->queue[output->first];
+			output->first = second;
+			output->count--;
+		}
+	}
+	pool_ref(buffer);
+	output->queue[(output->first + output->count) % output->queue_len] =
+		buffer;
+	output->count++;
+}
+
+void fanout_tee(struct fanout *fanout, const uint8_t *data, size_t len)
+{
+	struct pool_buffer *buffer = fill_buffer(fanout, data, len);
+	if (buffer == NULL)
+		return;
+	for (unsigned i = 0; i < fanout->count; i++) {
+		if (fanout->outputs[i].fd >= 0)
+			enqueue(fanout, &fanout->outputs[i], buffer);
+	}
+	pool_unref(&fanout->pool, buffer);
+}
+
+/* Weight of an output for a flow, the final mix of MurmurHash3 */
+static uint32_t weight(uint32_t hash, unsigned output)
+{
+	uint32_t h = hash ^ (output + 1) * 0x9e3779b9;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+void fanout_balance(struct fanout *fanout, const uint8_t *data, size_t len,
+	uint32_t hash)
+{
+	/* Rendezvous hashing: the flow goes to the open output which weighs
+	 * the most for it, so that only the flows of an output which closes
+	 * move, each to the next heaviest output */
+	struct fanout_output *best = NULL;
+	uint32_t best_weight = 0;
+	for (unsigned i = 0; i < fanout->count; i++) {
+		uint32_t w = weight(hash, i);
+		if (fanout->outputs[i].fd >= 0 && (best == NULL || w > best_weight)) {
+			best = &fanout->outputs[i];
+			best_weight = w;
+		}
+	}
+	if (best == NULL)
+		return;
+	struct pool_buffer *buffer = fill_buffer(fanout, data, len);
+	if (buffer == NULL)
+		return;
+	enqueue(fanout, best, buffer);
+	pool_unref(&fanout->pool, buffer);
+}
+
+static void close_output(struct fanout *fanout, struct fanout_output *output,
+	int err)
+{
+	if (err == EPIPE)
+		fprintf(stderr, "Output %s closed\n", output->dest);
+	else
+		fprintf(stderr, "Error: unable to write to output %s, closing it:"
+			" %s\n", output->dest, strerror(err));
+	close(output->fd);
+	output->fd = -1;
+	output->dropped += output->count;
+	while (output->count > 0)
+		drop_first(fanout, output);
+}
+
+/* Returns EAGAIN once the output is full, or an error */
+static int flush_one(struct fanout *fanout, struct fanout_output *output)
+{
+	struct iovec iovs[FANOUT_WRITE_BATCH];
+	struct mmsghdr msgs[FANOUT_WRITE_BATCH];
+	while (output->count > 0) {
+		unsigned count = (output->count < FANOUT_WRITE_BATCH ?
+			output->count : FANOUT_WRITE_BATCH);
+		for (unsigned i = 0; i < count; i++) {
+			struct pool_buffer *buffer =
+				output->queue[(output->first + i) % output->queue_len];
+			iovs[i].iov_base = buffer->data;
+			iovs[i].iov_len = buffer->len;
+			if (!output->datagrams) {
+				iovs[i].iov_base = buffer->data - FRAME_HEADER_LEN;
+				iovs[i].iov_len += FRAME_HEADER_LEN;
+			}
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		iovs[0].iov_base = (uint8_t *)iovs[0].iov_base + output->offset;
+		iovs[0].iov_len -= output->offset;
+
+		if (output->datagrams) {
+			int res = sendmmsg(output->fd, msgs, count, 0);
+			/* The collector may not be there yet, which drops datagrams. A
+			 * full socket buffer gives EAGAIN, keeping the rest queued. */
+			if (res < 0 && (errno == EINTR || errno == ECONNREFUSED))
+				continue;
+			if (res < 0)
+				return errno;
+			for (int i = 0; i < res; i++) {
+				output->packets++;
+				output->bytes += iovs[i].iov_len;
+				drop_first(fanout, output);
+			}
+			continue;
+		}
+		ssize_t res = writev(output->fd, iovs, count);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return errno;
+		output->bytes += res;
+		for (unsigned i = 0; res > 0; i++) {
+			if ((size_t)res < iovs[i].iov_len) {
+				output->offset += res;
+				break;
+			}
+			res -= iovs[i].iov_len;
+			output->packets++;
+			drop_first(fanout, output);
+		}
+	}
+	return 0;
+}
+
+int fanout_select(const struct fanout *fanout, fd_set *write_set, int nfds)
+{
+	for (unsigned i = 0; i < fanout->count; i++) {
+		const struct fanout_output *output = &fanout->outputs[i];
+		if (output->fd < 0 || output->count == 0)
+			continue;
+		FD_SET(output->fd, write_set);
+		if (output->fd >= nfds)
+			nfds = output->fd + 1;
+	}
+	return nfds;
+}
+
+void fanout_flush(struct fanout *fanout, const fd_set *write_set)
+{
+	for (unsigned i = 0; i < fanout->count; i++) {
+		struct fanout_output *output = &fanout->outputs[i];
+		if (output->fd < 0 || output->count == 0 ||
+			(write_set != NULL && !FD_ISSET(output->fd, write_set)))
+			continue;
+		int res = flush_one(fanout, output);
+		if (res != 0 && res != EAGAIN)
+			close_output(fanout, output, res);
+	}
+}
+
+void fanout_print(FILE *f, const struct fanout *fanout)
+{
+	for (unsigned i = 0; i < fanout->count; i++) {
+		const struct fanout_output *output = &fanout->outputs[i];
+		fprintf(f, "output %s: %llu packets (%llu bytes), %llu dropped,"
+			" %u queued%s\n", output->dest, output->packets, output->bytes,
+			output->dropped, output->count, output->fd < 0 ? ", closed" : "");
+	}
+}
+
+void fanout_close(struct fanout *fanout)
+{
+	if (fanout == NULL)
+		return;
+	for (unsigned i = 0; i < fanout->count; i++) {
+		struct fanout_output *output = &fanout->outputs[i];
+		if (output->fd >= 0)
+			close(output->fd);
+		free(output->queue);
+		free(output->dest);
+	}
+	pool_destroy(&fanout->pool);
+	free(fanout);
+}
@@ -0,0 +1,71 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include "pool.h"
+
+/* Packets read from the device, sent to other outputs than the peer:
+ * either copies of all of them (a capture pipe, an IDS...), or each flow
+ * to one of the outputs (a farm of consumers). Each packet is copied once
+ * into a pool buffer, which is shared by the queues of all outputs.
+ * Outputs are written to without blocking, and each of them drops packets
+ * once its queue is full, so that a slow one never holds back the others
+ * nor the tunnel. Outputs are specified as:
+ *
+ *   dest[,queue=N][,drop=newest|oldest]
+ *
+ * dest being a file or pipe, or unix:PATH for a stream socket, which get
+ * a FRAME_TYPE_PACKET frame per packet (without flags, as read by tuncat
+ * -F), or udp:HOST:PORT, which gets a datagram per packet. The queue
+ * holds up to N packets (default FANOUT_QUEUE_LEN), and drops the newest
+ * ones (default) or the oldest ones when full. */
+
+#define FANOUT_MAX_OUTPUTS 8
+#ifndef FANOUT_QUEUE_LEN
+#define FANOUT_QUEUE_LEN 256
+#endif
+
+struct fanout_output {
+	char *dest;
+	int fd;                    /* -1 once closed */
+	int datagrams;
+	int drop_oldest;
+	/* Ring of the packets waiting to be written, the first one of which
+	 * may have been written up to offset */
+	struct pool_buffer **queue;
+	unsigned queue_len;
+	unsigned first;
+	unsigned count;
+	size_t offset;
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long dropped;
+};
+
+struct fanout {
+	struct pool pool;
+	struct fanout_output outputs[FANOUT_MAX_OUTPUTS];
+	unsigned count;
+};
+
+/* Opens count outputs, for packets of up to max_packet bytes */
+int fanout_open(struct fanout **fanout, const char *const *specs,
+	unsigned count, size_t max_packet);
+/* Queues a packet on all outputs, to be written by fanout_flush() */
+void fanout_tee(struct fanout *fanout, const uint8_t *data, size_t len);
+/* Queues a packet on one output, picked from the hash of its flow so that
+ * a flow only moves if its output closes */
+void fanout_balance(struct fanout *fanout, const uint8_t *data, size_t len,
+	uint32_t hash);
+/* Adds outputs with packets waiting to write_set, returns the new nfds */
+int fanout_select(const struct fanout *fanout, fd_set *write_set, int nfds);
+/* Writes what outputs in write_set take without blocking, or what all of
+ * them take if it is NULL */
+void fanout_flush(struct fanout *fanout, const fd_set *write_set);
+void fanout_print(FILE *f, const struct fanout *fanout);
+void fanout_close(struct fanout *fanout);
+
+#endif
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fec.h"
+#include "frame.h"
+#include "util.h"
+
+#if defined(__x86_64__)
+#define FEC_X86 1
+#include <immintrin.h>
+#endif
+
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[2 * 255];
+static uint8_t gf_log[256];
+/* Products of each coefficient with the 16 values of the low nibble of a
+ * byte, then with those of its high nibble: a product is the XOR of two
+ * lookups, done 16 or 32 bytes at a time by vector shuffles */
+static uint8_t gf_nibbles[256][32];
+static void (*muladd)(uint8_t *dst, const uint8_t *src, size_t len,
+	uint8_t c);
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (a == 0 || b == 0)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* Coefficient of frame i of a group in its parity frame j, from a Cauchy
+ * matrix, whose square submatrices are all invertible */
+static uint8_t cauchy(unsigned j, unsigned i)
+{
+	return gf_inv((FEC_MAX_GROUP + j) ^ i);
+}
+
+/* dst += c * src */
+static void muladd_scalar(uint8_t *dst, const uint8_t *src, size_t len,
+	uint8_t c)
+{
+	const uint8_t *lo = gf_nibbles[c];
+	const uint8_t *hi = gf_nibbles[c] + 16;
+	for (size_t i = 0; i < len; i++)
+		dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+#ifdef FEC_X86
+__attribute__((target("ssse3")))
+static void muladd_ssse3(uint8_t *dst, const uint8_t *src, size_t len,
+	uint8_t c)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)gf_nibbles[c]);
+	const __m128i hi = _mm_loadu_si128((const __m128i *)(gf_nibbles[c] + 16));
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i p = _mm_xor_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+			_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+	}
+	muladd_scalar(dst + i, src + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static void muladd_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+	uint8_t c)
+{
+	/* Shuffles only look up within each 128-bit lane */
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)gf_nibbles[c]));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)(gf_nibbles[c] + 16)));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i p = _mm256_xor_si256(
+			_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+			_mm256_shuffle_epi8(hi,
+			_mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+	}
+	muladd_scalar(dst + i, src + i, len - i, c);
+}
+#endif
+
+static void gf_init(void)
+{
+	if (muladd != NULL)
+		return;
+	unsigned x = 1;
+	for (int i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF_POLY;
+	}
+	for (unsigned c = 0; c < 256; c++) {
+		for (unsigned n = 0; n < 16; n++) {
+			gf_nibbles[c][n] = gf_mul(c, n);
+			gf_nibbles[c][16 + n] = gf_mul(c, n << 4);
+		}
+	}
+	muladd = &muladd_scalar;
+#ifdef FEC_X86
+	if (__builtin_cpu_supports("avx2"))
+		muladd = &muladd_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		muladd = &muladd_ssse3;
+#endif
+}
+
+int fec_encoder_init(struct fec_encoder *encoder, unsigned k, unsigned r,
+	size_t max_frame)
+{
+	if (k == 0 || k > FEC_MAX_GROUP || r > k)
+		return EINVAL;
+	gf_init();
+	memset(encoder, 0, sizeof(*encoder));
+	encoder->k = k;
+	encoder->fixed = (r > 0);
+	encoder->r = encoder->next_r = (r > 0 ? r : 1);
+	encoder->max_len = 2 + max_frame;
+	for (unsigned j = 0; j < k; j++) {
+		encoder->parity[j] = malloc(encoder->max_len);
+		if (encoder->parity[j] == NULL) {
+			fec_encoder_free(encoder);
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void fec_encoder_free(struct fec_encoder *encoder)
+{
+	for (unsigned j = 0; j < FEC_MAX_GROUP; j++) {
+		free(encoder->parity[j]);
+		encoder->parity[j] = NULL;
+	}
+}
+
+int fec_encoder_add(struct fec_encoder *encoder, uint32_t sequence,
+	const uint8_t *frame, size_t len)
+{
+	if (encoder->count == 0)
+		encoder->first = sequence;
+	/* Parity past the longest block so far is still that of zeroes */
+	if (2 + len > encoder->len) {
+		for (unsigned j = 0; j < encoder->r; j++)
+			memset(encoder->parity[j] + encoder->len, 0,
+				2 + len - encoder->len);
+		encoder->len = 2 + len;
+	}
+	uint8_t prefix[2];
+	put_le16(prefix, len);
+	for (unsigned j = 0; j < encoder->r; j++) {
+		uint8_t c = cauchy(j, encoder->count);
+		muladd(encoder->parity[j], prefix, sizeof(prefix), c);
+		muladd(encoder->parity[j] + 2, frame, len, c);
+	}
+	encoder->count++;
+	return (encoder->count == encoder->k);
+}
+
+size_t fec_encoder_flush(struct fec_encoder *encoder, uint8_t *out,
+	uint8_t flags, unsigned *count)
+{
+	/* Parity frames beyond the number of frames would be useless */
+	unsigned r = (encoder->r < encoder->count ? encoder->r : encoder->count);
+	struct frame frame = {
+		.type = FRAME_TYPE_FEC,
+		.flags = flags,
+		.len = FEC_HEADER_LEN + encoder->len,
+	};
+	uint8_t *p = out;
+	for (unsigned j = 0; j < r; j++) {
+		p += frame_put_header(p, &frame);
+		uint8_t *payload = p;
+		put_le32(p, encoder->first);
+		p[4] = encoder->count;
+		p[5] = r;
+		p[6] = j;
+		p[7] = 0;
+		memcpy(p + FEC_HEADER_LEN, encoder->parity[j], encoder->len);
+		p += frame.len;
+		if (flags & FRAME_FLAG_CRC)
+			p += frame_put_crc(payload, p);
+	}
+	*count = r;
+	encoder->count = 0;
+	encoder->len = 0;
+	encoder->r = encoder->next_r;
+	return p - out;
+}
+
+size_t fec_encoder_room(const struct fec_encoder *encoder, unsigned count)
+{
+	return count * (frame_header_len(FRAME_FLAG_CRC) + FEC_HEADER_LEN +
+		encoder->max_len + FRAME_CRC_LEN);
+}
+
+void fec_encoder_report(struct fec_encoder *encoder, const uint8_t *payload,
+	size_t len)
+{
+	if (len < FEC_LOSS_LEN)
+		return;
+	uint32_t frames = get_le32(payload);
+	uint32_t lost = get_le32(payload + 4);
+	if (frames == 0 || lost > frames)
+		return;
+	uint64_t ppm = (uint64_t)lost * 1000000 / frames;
+	encoder->loss_ppm = (3 * (uint64_t)encoder->loss_ppm + ppm) / 4;
+	if (encoder->fixed)
+		return;
+	/* Twice the expected losses of a full group, rounded up, plus one */
+	uint64_t r = 1 + (2 * (uint64_t)encoder->loss_ppm * encoder->k +
+		999999) / 1000000;
+	encoder->next_r = (r > encoder->k ? encoder->k : r);
+}
+
+int fec_decoder_init(struct fec_decoder *decoder, size_t max_frame)
+{
+	gf_init();
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->max_len = 2 + max_frame;
+	return 0;
+}
+
+void fec_decoder_free(struct fec_decoder *decoder)
+{
+	for (unsigned i = 0; i < FEC_WINDOW; i++) {
+		free(decoder->frames[i].data);
+		decoder->frames[i].data = NULL;
+	}
+	for (unsigned j = 0; j < FEC_MAX_GROUP; j++) {
+		free(decoder->parity[j].data);
+		decoder->parity[j].data = NULL;
+	}
+}
+
+static int block_reserve(struct fec_block *block, size_t len)
+{
+	if (len <= block->cap)
+		return 0;
+	uint8_t *data = realloc(block->data, len);
+	if (data == NULL)
+		return ENOMEM;
+	block->data = data;
+	block->cap = len;
+	return 0;
+}
+
+int fec_decoder_add(struct fec_decoder *decoder, uint32_t sequence,
+	const uint8_t *frame, size_t len)
+{
+	if (2 + len > decoder->max_len)
+		return 0;
+	struct fec_block *block = &decoder->frames[sequence % FEC_WINDOW];
+	int res = block_reserve(block, 2 + len);
+	if (res != 0)
+		return res;
+	put_le16(block->data, len);
+	memcpy(block->data + 2, frame, len);
+	block->sequence = sequence;
+	block->len = 2 + len;
+	block->valid = 1;
+	return 0;
+}
+
+/* Returns frame i of the current group, NULL if it is missing */
+static const struct fec_block *group_frame(const struct fec_decoder *decoder,
+	unsigned i)
+{
+	uint32_t sequence = decoder->first + i;
+	const struct fec_block *block = &decoder->frames[sequence % FEC_WINDOW];
+	return (block->valid && block->sequence == sequence ? block : NULL);
+}
+
+static unsigned group_missing(const struct fec_decoder *decoder)
+{
+	unsigned missing = 0;
+	for (unsigned i = 0; i < decoder->k; i++)
+		missing += (group_frame(decoder, i) == NULL);
+	return missing;
+}
+
+/* Gauss-Jordan elimination over GF(256), a is destroyed */
+static void invert(uint8_t a[][FEC_MAX_GROUP], uint8_t inv[][FEC_MAX_GROUP],
+	unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		memset(inv[i], 0, n);
+		inv[i][i] = 1;
+	}
+	for (unsigned col = 0; col < n; col++) {
+		/* Submatrices of a Cauchy matrix are invertible: there is one */
+		unsigned pivot = col;
+		while (a[pivot][col] == 0)
+			pivot++;
+		for (unsigned i = 0; i < n; i++) {
+			uint8_t tmp = a[col][i];
+			a[col][i] = a[pivot][i];
+			a[pivot][i] = tmp;
+			tmp = inv[col][i];
+			inv[col][i] = inv[pivot][i];
+			inv[pivot][i] = tmp;
+		}
+		uint8_t scale = gf_inv(a[col][col]);
+		for (unsigned i = 0; i < n; i++) {
+			a[col][i] = gf_mul(a[col][i], scale);
+			inv[col][i] = gf_mul(inv[col][i], scale);
+		}
+		for (unsigned row = 0; row < n; row++) {
+			uint8_t f = a[row][col];
+			if (row == col || f == 0)
+				continue;
+			for (unsigned i = 0; i < n; i++) {
+				a[row][i] ^= gf_mul(f, a[col][i]);
+				inv[row][i] ^= gf_mul(f, inv[col][i]);
+			}
+		}
+	}
+}
+
+static int recover(struct fec_decoder *decoder, size_t len)
+{
+	unsigned missing[FEC_MAX_GROUP];
+	unsigned rows[FEC_MAX_GROUP];
+	unsigned m = 0;
+	for (unsigned i = 0; i < decoder->k; i++) {
+		if (group_frame(decoder, i) == NULL)
+			missing[m++] = i;
+	}
+	for (unsigned j = 0, n = 0; n < m; j++) {
+		if (decoder->received & (1U << j))
+			rows[n++] = j;
+	}
+
+	/* What is left of the parity without the frames received is that of
+	 * the missing ones */
+	for (unsigned x = 0; x < m; x++) {
+		uint8_t *syndrome = decoder->parity[rows[x]].data;
+		for (unsigned i = 0; i < decoder->k; i++) {
+			const struct fec_block *block = group_frame(decoder, i);
+			if (block == NULL)
+				continue;
+			if (block->len > len) {
+				decoder->unrecovered += m;
+				return 0;
+			}
+			muladd(syndrome, block->data, block->len, cauchy(rows[x], i));
+		}
+	}
+	uint8_t a[FEC_MAX_GROUP][FEC_MAX_GROUP];
+	uint8_t inv[FEC_MAX_GROUP][FEC_MAX_GROUP];
+	for (unsigned x = 0; x < m; x++) {
+		for (unsigned y = 0; y < m; y++)
+			a[x][y] = cauchy(rows[x], missing[y]);
+	}
+	invert(a, inv, m);
+
+	for (unsigned y = 0; y < m; y++) {
+		uint32_t sequence = decoder->first + missing[y];
+		struct fec_block *block = &decoder->frames[sequence % FEC_WINDOW];
+		/* Its slot went to a later frame, which arrived first */
+		if (block->valid && (int32_t)(block->sequence - sequence) > 0) {
+			decoder->unrecovered++;
+			continue;
+		}
+		int res = block_reserve(block, len);
+		if (res != 0)
+			return res;
+		memset(block->data, 0, len);
+		for (unsigned x = 0; x < m; x++)
+			muladd(block->data, decoder->parity[rows[x]].data, len, inv[y][x]);
+		block->valid = 0;
+		if (2 + (size_t)get_le16(block->data) > len) {
+			decoder->unrecovered++;
+			continue;
+		}
+		block->sequence = sequence;
+		block->len = 2 + get_le16(block->data);
+		block->valid = 1;
+		decoder->recovered[decoder->recovered_count++] = sequence % FEC_WINDOW;
+	}
+	return 0;
+}
+
+int fec_decoder_parity(struct fec_decoder *decoder, const uint8_t *payload,
+	size_t len)
+{
+	decoder->recovered_count = 0;
+	if (len < FEC_HEADER_LEN + 2 || len - FEC_HEADER_LEN > decoder->max_len)
+		return EINVAL;
+	uint32_t first = get_le32(payload);
+	unsigned k = payload[4];
+	unsigned r = payload[5];
+	unsigned index = payload[6];
+	size_t block_len = len - FEC_HEADER_LEN;
+	if (k == 0 || k > FEC_MAX_GROUP || r == 0 || r > k || index >= r ||
+		payload[7] != 0)
+		return EINVAL;
+
+	if (!decoder->started || first != decoder->first || k != decoder->k ||
+		r != decoder->r) {
+		/* What the previous group still misses will not come back */
+		if (decoder->started && !decoder->done)
+			decoder->unrecovered += group_missing(decoder);
+		decoder->first = first;
+		decoder->k = k;
+		decoder->r = r;
+		decoder->received = 0;
+		/* Frames before the first parity frame were not kept */
+		decoder->done = !decoder->started;
+		decoder->started = 1;
+		if (!decoder->done) {
+			unsigned missing = group_missing(decoder);
+			decoder->report_frames += k;
+			decoder->report_lost += missing;
+			decoder->done = (missing == 0);
+		}
+	}
+	if (decoder->done || (decoder->received & (1U << index)))
+		return 0;
+	for (unsigned j = 0; j < r; j++) {
+		if ((decoder->received & (1U << j)) &&
+			decoder->parity[j].len != block_len)
+			return EINVAL;
+	}
+	struct fec_block *parity = &decoder->parity[index];
+	int res = block_reserve(parity, block_len);
+	if (res != 0)
+		return res;
+	memcpy(parity->data, payload + FEC_HEADER_LEN, block_len);
+	parity->len = block_len;
+	decoder->received |= 1U << index;
+
+	unsigned missing = group_missing(decoder);
+	if (missing > (unsigned)__builtin_popcount(decoder->received))
+		return 0;
+	decoder->done = 1;
+	return (missing > 0 ? recover(decoder, block_len) : 0);
+}
+
+void fec_decoder_get(struct fec_decoder *decoder, unsigned i,
+	uint8_t **frame, size_t *len)
+{
+	struct fec_block *block = &decoder->frames[decoder->recovered[i]];
+	*frame = block->data + 2;
+	*len = block->len - 2;
+}
+
+size_t fec_decoder_report(struct fec_decoder *decoder, uint8_t *payload)
+{
+	if (decoder->report_frames < FEC_REPORT_FRAMES)
+		return 0;
+	put_le32(payload, decoder->report_frames);
+	put_le32(payload + 4, decoder->report_lost);
+	decoder->report_frames = 0;
+	decoder->report_lost = 0;
+	return FEC_LOSS_LEN;
+}
@@ -0,0 +1,116 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Forward error correction of datagram transports, so that lost frames
+ * are rebuilt by the receiver instead of waiting for whatever runs inside
+ * the tunnel to retransmit them. Numbered frames are protected in groups
+ * of up to k consecutive ones, each followed by r FRAME_TYPE_FEC frames:
+ *
+ *   u32 sequence number of the first frame of the group, u8 k, u8 r,
+ *   u8 index of this parity frame, u8 0, parity blocks
+ *
+ * Each frame of the group is a block made of its u16 length and its bytes
+ * as sent (header and CRC included), zero padded to the longest one. The
+ * parity blocks are a Cauchy Reed-Solomon code of them over GF(256), so
+ * that any r frames lost out of the group can be rebuilt. A group ends
+ * after k frames, or with the batch of packets read from the device, so
+ * that parity never waits for traffic.
+ *
+ * Receivers report what they lost before recovery in FRAME_TYPE_FEC_LOSS
+ * frames, every FEC_REPORT_FRAMES frames:
+ *
+ *   u32 frames in groups, u32 frames missing from them
+ *
+ * which senders use to keep r above twice the expected losses of a group,
+ * unless it was set by the user. Integers are little-endian. */
+
+#define FEC_MAX_GROUP 32
+#define FEC_HEADER_LEN 8
+#define FEC_LOSS_LEN 8
+/* Frames kept by receivers, enough for two groups and some reordering */
+#define FEC_WINDOW 128
+
+#ifndef FEC_REPORT_FRAMES
+#define FEC_REPORT_FRAMES 256
+#endif
+
+struct fec_encoder {
+	unsigned k;
+	unsigned r;                /* of the current group */
+	unsigned next_r;           /* from the next group on */
+	int fixed;                 /* r was set by the user */
+	uint32_t loss_ppm;         /* smoothed from reports of the peer */
+	uint32_t first;
+	unsigned count;
+	size_t len;                /* of the longest block so far */
+	size_t max_len;
+	uint8_t *parity[FEC_MAX_GROUP];
+};
+
+struct fec_block {
+	uint32_t sequence;
+	int valid;
+	size_t len;
+	size_t cap;
+	uint8_t *data;             /* u16 length, frame */
+};
+
+struct fec_decoder {
+	size_t max_len;
+	struct fec_block frames[FEC_WINDOW];
+	/* Parity of the group being received */
+	int started;
+	int done;
+	uint32_t first;
+	unsigned k;
+	unsigned r;
+	uint32_t received;         /* bit i is set once parity i is */
+	struct fec_block parity[FEC_MAX_GROUP];
+	/* Frames rebuilt by the last fec_decoder_parity() */
+	unsigned recovered[FEC_MAX_GROUP];
+	unsigned recovered_count;
+	/* Since the last report */
+	uint32_t report_frames;
+	uint32_t report_lost;
+	unsigned long long unrecovered;
+};
+
+/* Frames are at most max_frame bytes. r is 0 to adapt it to losses. */
+int fec_encoder_init(struct fec_encoder *encoder, unsigned k, unsigned r,
+	size_t max_frame);
+void fec_encoder_free(struct fec_encoder *encoder);
+/* Adds a frame to the current group. Returns 1 once the group is full. */
+int fec_encoder_add(struct fec_encoder *encoder, uint32_t sequence,
+	const uint8_t *frame, size_t len);
+/* Writes the parity frames of the current group at out, with frame flags
+ * (FRAME_FLAG_CRC), and starts the next one. Returns their total length,
+ * and their count in *count. */
+size_t fec_encoder_flush(struct fec_encoder *encoder, uint8_t *out,
+	uint8_t flags, unsigned *count);
+/* Most bytes written by fec_encoder_flush() for groups of count frames
+ * in total */
+size_t fec_encoder_room(const struct fec_encoder *encoder, unsigned count);
+/* Takes a FRAME_TYPE_FEC_LOSS payload from the peer */
+void fec_encoder_report(struct fec_encoder *encoder, const uint8_t *payload,
+	size_t len);
+
+int fec_decoder_init(struct fec_decoder *decoder, size_t max_frame);
+void fec_decoder_free(struct fec_decoder *decoder);
+/* Keeps a copy of a numbered frame received as is */
+int fec_decoder_add(struct fec_decoder *decoder, uint32_t sequence,
+	const uint8_t *frame, size_t len);
+/* Takes a FRAME_TYPE_FEC payload, and rebuilds what it can of its group:
+ * see recovered and fec_decoder_get(). Returns EINVAL if it is malformed,
+ * ENOMEM. */
+int fec_decoder_parity(struct fec_decoder *decoder, const uint8_t *payload,
+	size_t len);
+void fec_decoder_get(struct fec_decoder *decoder, unsigned i,
+	uint8_t **frame, size_t *len);
+/* Writes a FRAME_TYPE_FEC_LOSS payload once FEC_REPORT_FRAMES frames are
+ * accounted for. Returns its length, or 0 if it is not time yet. */
+size_t fec_decoder_report(struct fec_decoder *decoder, uint8_t *payload);
+
+#endif
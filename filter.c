@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "filter.h"
+
+#define FILTER_TOKEN_LEN 64
+
+#define DIR_SRC 1
+#define DIR_DST 2
+
+enum filter_op {
+	OP_AND,
+	OP_OR,
+	OP_NOT,
+	OP_FAMILY,
+	OP_PROTO,
+	OP_NET,
+	OP_PORT,
+	OP_LESS,
+	OP_GREATER,
+};
+
+struct filter_node {
+	enum filter_op op;
+	int left;
+	int right;
+	uint8_t dir;
+	uint8_t family;
+	uint8_t prefix;
+	uint8_t addr[16];
+	unsigned long value;
+};
+
+struct filter {
+	struct filter_node *nodes;
+	size_t len;
+	size_t cap;
+	int root;
+};
+
+struct parser {
+	struct filter *filter;
+	const char *pos;
+	char token[FILTER_TOKEN_LEN];
+};
+
+static int parse_or(struct parser *p, int *node);
+
+static void next_token(struct parser *p)
+{
+	size_t len = 0;
+	while (*p->pos == ' ' || *p->pos == '\t')
+		p->pos++;
+	if (*p->pos == '(' || *p->pos == ')' || *p->pos == '!') {
+		p->token[len++] = *p->pos++;
+	} else {
+		while (*p->pos != '\0' && *p->pos != ' ' && *p->pos != '\t' &&
+			*p->pos != '(' && *p->pos != ')') {
+			if (len < FILTER_TOKEN_LEN - 1)
+				p->token[len++] = *p->pos;
+			p->pos++;
+		}
+	}
+	p->token[len] = '\0';
+}
+
+static int is_token(const struct parser *p, const char *a, const char *b)
+{
+	return strcmp(p->token, a) == 0 || (b != NULL && strcmp(p->token, b) == 0);
+}
+
+static int syntax_error(const struct parser *p)
+{
+	if (p->token[0] == '\0')
+		fprintf(stderr, "Error: unexpected end of filter\n");
+	else
+		fprintf(stderr, "Error: invalid filter near '%s'\n", p->token);
+	return EINVAL;
+}
+
+static int new_node(struct parser *p, enum filter_op op, int *node)
+{
+	struct filter *f = p->filter;
+	if (f->len == f->cap) {
+		size_t cap = (f->cap == 0 ? 16 : f->cap * 2);
+		void *tmp = realloc(f->nodes, cap * sizeof(*f->nodes));
+		if (tmp == NULL)
+			return ENOMEM;
+		f->nodes = tmp;
+		f->cap = cap;
+	}
+	memset(&f->nodes[f->len], 0, sizeof(*f->nodes));
+	f->nodes[f->len].op = op;
+	*node = f->len++;
+	return 0;
+}
+
+static int parse_number(struct parser *p, unsigned long max,
+	unsigned long *value)
+{
+	char *endptr = NULL;
+	next_token(p);
+	errno = 0;
+	*value = strtoul(p->token, &endptr, 10);
+	if (p->token[0] == '\0' || *endptr != '\0' || errno != 0 || *value > max)
+		return syntax_error(p);
+	return 0;
+}
+
+static int parse_address(struct parser *p, struct filter_node *n, int is_net)
+{
+	char *slash = NULL;
+	unsigned long prefix = 0;
+	next_token(p);
+	if (is_net) {
+		slash = strchr(p->token, '/');
+		if (slash == NULL)
+			return syntax_error(p);
+		*slash = '\0';
+	}
+	if (inet_pton(AF_INET, p->token, n->addr) == 1) {
+		n->family = 4;
+		prefix = 32;
+	} else if (inet_pton(AF_INET6, p->token, n->addr) == 1) {
+		n->family = 6;
+		prefix = 128;
+	} else {
+		if (slash != NULL)
+			*slash = '/';
+		return syntax_error(p);
+	}
+	if (slash != NULL) {
+		char *endptr = NULL;
+		unsigned long max = prefix;
+		prefix = strtoul(slash + 1, &endptr, 10);
+		*slash = '/';
+		if (slash[1] == '\0' || *endptr != '\0' || prefix > max)
+			return syntax_error(p);
+	}
+	n->prefix = prefix;
+	return 0;
+}
+
+static int parse_primitive(struct parser *p, int *node)
+{
+	uint8_t dir = DIR_SRC | DIR_DST;
+	int res = 0;
+
+	if (is_token(p, "src", NULL) || is_token(p, "dst", NULL)) {
+		dir = (p->token[0] == 's' ? DIR_SRC : DIR_DST);
+		next_token(p);
+		if (!is_token(p, "host", "net") && !is_token(p, "port", NULL))
+			return syntax_error(p);
+	}
+
+	if (is_token(p, "ip", "ip6")) {
+		res = new_node(p, OP_FAMILY, node);
+		if (res == 0)
+			p->filter->nodes[*node].family = (p->token[2] == '6' ? 6 : 4);
+	} else if (is_token(p, "tcp", "udp") || is_token(p, "icmp", "icmp6")) {
+		unsigned long proto = (p->token[0] == 't' ? 6 :
+			p->token[0] == 'u' ? 17 : p->token[4] == '6' ? 58 : 1);
+		res = new_node(p, OP_PROTO, node);
+		if (res == 0)
+			p->filter->nodes[*node].value = proto;
+	} else if (is_token(p, "proto", NULL)) {
+		res = new_node(p, OP_PROTO, node);
+		if (res == 0)
+			res = parse_number(p, 255, &p->filter->nodes[*node].value);
+	} else if (is_token(p, "host", "net")) {
+		int is_net = (p->token[0] == 'n');
+		res = new_node(p, OP_NET, node);
+		if (res == 0)
+			res = parse_address(p, &p->filter->nodes[*node], is_net);
+	} else if (is_token(p, "port", NULL)) {
+		res = new_node(p, OP_PORT, node);
+		if (res == 0)
+			res = parse_number(p, 65535, &p->filter->nodes[*node].value);
+	} else if (is_token(p, "less", "greater")) {
+		res = new_node(p, p->token[0] == 'l' ? OP_LESS : OP_GREATER, node);
+		if (res == 0)
+			res = parse_number(p, (unsigned long)-1,
+				&p->filter->nodes[*node].value);
+	} else {
+		return syntax_error(p);
+	}
+	if (res == 0)
+		p->filter->nodes[*node].dir = dir;
+	next_token(p);
+	return res;
+}
+
+static int parse_unary(struct parser *p, int *node)
+{
+	if (is_token(p, "not", "!")) {
+		int child = 0;
+		next_token(p);
+		int res = parse_unary(p, &child);
+		if (res == 0)
+			res = new_node(p, OP_NOT, node);
+		if (res == 0)
+			p->filter->nodes[*node].left = child;
+		return res;
+	}
+	if (is_token(p, "(", NULL)) {
+		next_token(p);
+		int res = parse_or(p, node);
+		if (res != 0)
+			return res;
+		if (!is_token(p, ")", NULL))
+			return syntax_error(p);
+		next_token(p);
+		return 0;
+	}
+	return parse_primitive(p, node);
+}
+
+static int parse_binary(struct parser *p, int *node, enum filter_op op)
+{
+	int res = (op == OP_OR ? parse_binary(p, node, OP_AND) :
+		parse_unary(p, node));
+	while (res == 0 && (op == OP_OR ? is_token(p, "or", "||") :
+		is_token(p, "and", "&&"))) {
+		int right = 0;
+		int parent = 0;
+		next_token(p);
+		res = (op == OP_OR ? parse_binary(p, &right, OP_AND) :
+			parse_unary(p, &right));
+		if (res == 0)
+			res = new_node(p, op, &parent);
+		if (res == 0) {
+			p->filter->nodes[parent].left = *node;
+			p->filter->nodes[parent].right = right;
+			*node = parent;
+		}
+	}
+	return res;
+}
+
+static int parse_or(struct parser *p, int *node)
+{
+	return parse_binary(p, node, OP_OR);
+}
+
+int filter_compile(struct filter **filter, const char *expr)
+{
+	if (filter == NULL || expr == NULL)
+		return EINVAL;
+	struct filter *f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return ENOMEM;
+
+	struct parser p = { .filter = f, .pos = expr };
+	next_token(&p);
+	int res = parse_or(&p, &f->root);
+	if (res == 0 && p.token[0] != '\0')
+		res = syntax_error(&p);
+	if (res != 0) {
+		filter_free(f);
+		return res;
+	}
+	*filter = f;
+	return 0;
+}
+
+static int prefix_match(const uint8_t *addr, const uint8_t *net,
+	unsigned prefix)
+{
+	unsigned bytes = prefix / 8;
+	unsigned bits = prefix % 8;
+	if (memcmp(addr, net, bytes) != 0)
+		return 0;
+	if (bits == 0)
+		return 1;
+	uint8_t mask = 0xff << (8 - bits);
+	return (addr[bytes] & mask) == (net[bytes] & mask);
+}
+
+static int match_node(const struct filter *f, int i,
+	const struct packet_info *info)
+{
+	const struct filter_node *n = &f->nodes[i];
+	switch (n->op) {
+	case OP_AND:
+		return match_node(f, n->left, info) && match_node(f, n->right, info);
+	case OP_OR:
+		return match_node(f, n->left, info) || match_node(f, n->right, info);
+	case OP_NOT:
+		return !match_node(f, n->left, info);
+	case OP_FAMILY:
+		return info->family == n->family;
+	case OP_PROTO:
+		return info->family != 0 && info->proto == n->value;
+	case OP_NET:
+		if (info->family != n->family)
+			return 0;
+		return ((n->dir & DIR_SRC) && prefix_match(info->src, n->addr, n->prefix)) ||
+			((n->dir & DIR_DST) && prefix_match(info->dst, n->addr, n->prefix));
+	case OP_PORT:
+		if (info->l4_off == 0 || (info->proto != 6 && info->proto != 17 &&
+			info->proto != 132))
+			return 0;
+		return ((n->dir & DIR_SRC) && info->sport == n->value) ||
+			((n->dir & DIR_DST) && info->dport == n->value);
+	case OP_LESS:
+		return info->len <= n->value;
+	case OP_GREATER:
+		return info->len >= n->value;
+	}
+	return 0;
+}
+
+int filter_match(const struct filter *filter, const struct packet_info *info)
+{
+	if (filter == NULL)
+		return 1;
+	return match_node(filter, filter->root, info);
+}
+
+void filter_free(struct filter *filter)
+{
+	if (filter == NULL)
+		return;
+	free(filter->nodes);
+	free(filter);
+}
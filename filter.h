@@ -0,0 +1,22 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "packet.h"
+
+/* Packet filters, in a subset of the pcap-filter(7) syntax:
+ *
+ *   expr      := expr or expr | expr and expr | not expr | ( expr )
+ *              | primitive
+ *   primitive := ip | ip6 | tcp | udp | icmp | icmp6 | proto N
+ *              | [src|dst] host ADDR | [src|dst] net ADDR/LEN
+ *              | [src|dst] port N | less N | greater N
+ *
+ * "and", "or" and "not" can also be written "&&", "||" and "!". */
+
+struct filter;
+
+int filter_compile(struct filter **filter, const char *expr);
+int filter_match(const struct filter *filter, const struct packet_info *info);
+void filter_free(struct filter *filter);
+
+#endif
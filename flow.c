@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flow.h"
+
+int flow_table_init(struct flow_table *table, size_t max_flows)
+{
+	size_t cap = 16;
+	if (table == NULL || max_flows == 0)
+		return EINVAL;
+	while (cap < 2 * max_flows)
+		cap *= 2;
+	memset(table, 0, sizeof(*table));
+	table->slots = calloc(cap, sizeof(*table->slots));
+	if (table->slots == NULL)
+		return ENOMEM;
+	table->mask = cap - 1;
+	table->max = max_flows;
+	return 0;
+}
+
+void flow_table_free(struct flow_table *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+}
+
+void flow_key_from_packet(const struct packet_info *info, struct flow_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->family = info->family;
+	key->proto = info->proto;
+	key->sport = info->sport;
+	key->dport = info->dport;
+	memcpy(key->src, info->src, sizeof(key->src));
+	memcpy(key->dst, info->dst, sizeof(key->dst));
+}
+
+uint32_t flow_key_hash(const struct flow_key *key)
+{
+	uint32_t words[9];
+	uint32_t h = 0x666c6f77;
+	memcpy(words, key->src, 16);
+	memcpy(words + 4, key->dst, 16);
+	words[8] = ((uint32_t)key->sport << 16) ^ key->dport ^
+		((uint32_t)key->proto << 8) ^ key->family;
+	for (size_t i = 0; i < 9; i++) {
+		h ^= words[i];
+		h *= 0x01000193;
+		h ^= h >> 15;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+static int key_equal(const struct flow_key *a, const struct flow_key *b)
+{
+	return a->family == b->family && a->proto == b->proto &&
+		a->sport == b->sport && a->dport == b->dport &&
+		memcmp(a->src, b->src, sizeof(a->src)) == 0 &&
+		memcmp(a->dst, b->dst, sizeof(a->dst)) == 0;
+}
+
+struct flow *flow_table_get(struct flow_table *table,
+	const struct flow_key *key, uint32_t hash, int create)
+{
+	size_t i = hash & table->mask;
+	while (table->slots[i].used) {
+		if (table->slots[i].hash == hash &&
+			key_equal(&table->slots[i].key, key))
+			return &table->slots[i];
+		i = (i + 1) & table->mask;
+	}
+	if (!create || table->count >= table->max)
+		return NULL;
+	struct flow *flow = &table->slots[i];
+	memset(flow, 0, sizeof(*flow));
+	flow->key = *key;
+	flow->hash = hash;
+	flow->used = 1;
+	table->count++;
+	return flow;
+}
+
+void flow_table_remove(struct flow_table *table, struct flow *flow)
+{
+	size_t i = flow - table->slots;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & table->mask;
+		if (!table->slots[j].used)
+			break;
+		/* Entry j can fill the hole at i unless its home slot lies
+		 * cyclically in (i, j] */
+		size_t home = table->slots[j].hash & table->mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		table->slots[i] = table->slots[j];
+		i = j;
+	}
+	table->slots[i].used = 0;
+	table->count--;
+}
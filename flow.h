@@ -0,0 +1,52 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "packet.h"
+
+/* Table of unidirectional flows, keyed on addresses, protocol and ports.
+ * Open addressing with linear probing, kept at most half full; removals
+ * shift entries back so that no tombstones are needed. */
+
+struct flow_key {
+	uint8_t family;
+	uint8_t proto;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t src[16];
+	uint8_t dst[16];
+};
+
+struct flow {
+	struct flow_key key;
+	uint32_t hash;
+	uint8_t used;
+	uint8_t tcp_flags;
+	uint32_t tag;          /* free for the owner of the table */
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t first_ns;
+	uint64_t last_ns;
+};
+
+struct flow_table {
+	struct flow *slots;
+	size_t mask;
+	size_t count;
+	size_t max;
+};
+
+int flow_table_init(struct flow_table *table, size_t max_flows);
+void flow_table_free(struct flow_table *table);
+void flow_key_from_packet(const struct packet_info *info, struct flow_key *key);
+uint32_t flow_key_hash(const struct flow_key *key);
+/* Returns NULL if the flow is not in the table, or if it cannot be
+ * created because the table is full */
+struct flow *flow_table_get(struct flow_table *table,
+	const struct flow_key *key, uint32_t hash, int create);
+/* Entries may move: while iterating over slots, removing slot i means
+ * slot i has to be looked at again */
+void flow_table_remove(struct flow_table *table, struct flow *flow);
+
+#endif
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "crc32c.h"
+#include "frame.h"
+#include "util.h"
+
+size_t frame_header_len(uint8_t flags)
+{
+	size_t len = FRAME_HEADER_LEN;
+	if (flags & FRAME_FLAG_CRC)
+		len += FRAME_SYNC_LEN;
+	if (flags & FRAME_FLAG_SEQUENCE)
+		len += 4;
+	if (flags & FRAME_FLAG_METADATA)
+		len += FRAME_METADATA_LEN;
+	if (flags & FRAME_FLAG_CRC)
+		len += FRAME_CRC_LEN;
+	return len;
+}
+
+size_t frame_trailer_len(uint8_t flags)
+{
+	return (flags & FRAME_FLAG_CRC ? FRAME_CRC_LEN : 0);
+}
+
+static const uint8_t metadata_template[FRAME_METADATA_LEN] = {
+	FRAME_METADATA_LEN - 2, 0,
+	FRAME_META_TIMESTAMP, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	FRAME_META_QUEUE, 2, 0, 0,
+	FRAME_META_DIRECTION, 1, 0,
+	FRAME_META_FLOW_HASH, 4, 0, 0, 0, 0,
+	FRAME_META_GSO, 4, 0, 0, 0, 0,
+};
+
+static void put_metadata(uint8_t *out, const struct frame_metadata *metadata)
+{
+	memcpy(out, metadata_template, sizeof(metadata_template));
+	put_le64(out + 4, metadata->timestamp_ns);
+	put_le16(out + 14, metadata->queue);
+	out[18] = metadata->direction;
+	put_le32(out + 21, metadata->flow_hash);
+	out[27] = metadata->gso_type;
+	put_le16(out + 29, metadata->gso_size);
+}
+
+static int parse_metadata(const uint8_t *p, size_t len,
+	struct frame_metadata *metadata)
+{
+	memset(metadata, 0, sizeof(*metadata));
+	while (len > 0) {
+		if (len < 2 || p[1] > len - 2)
+			return EINVAL;
+		uint8_t type = p[0], value_len = p[1];
+		const uint8_t *value = p + 2;
+		int known = 1;
+		if (type == FRAME_META_TIMESTAMP && value_len == 8) {
+			metadata->timestamp_ns = get_le64(value);
+		} else if (type == FRAME_META_QUEUE && value_len == 2) {
+			metadata->queue = get_le16(value);
+		} else if (type == FRAME_META_DIRECTION && value_len == 1) {
+			metadata->direction = value[0];
+		} else if (type == FRAME_META_FLOW_HASH && value_len == 4) {
+			metadata->flow_hash = get_le32(value);
+		} else if (type == FRAME_META_GSO && value_len == 4) {
+			metadata->gso_type = value[0];
+			metadata->gso_size = get_le16(value + 2);
+		} else {
+			known = 0;
+		}
+		if (known)
+			metadata->present |= 1U << type;
+		p += 2 + value_len;
+		len -= 2 + value_len;
+	}
+	return 0;
+}
+
+size_t frame_put_header(uint8_t *out, const struct frame *frame)
+{
+	uint8_t *start = out;
+	if (frame->flags & FRAME_FLAG_CRC) {
+		memcpy(out, FRAME_SYNC, FRAME_SYNC_LEN);
+		out += FRAME_SYNC_LEN;
+	}
+	out[0] = frame->type;
+	out[1] = frame->flags;
+	put_le16(out + 2, frame->channel);
+	put_le32(out + 4, frame->len);
+	size_t off = FRAME_HEADER_LEN;
+	if (frame->flags & FRAME_FLAG_SEQUENCE) {
+		put_le32(out + off, frame->sequence);
+		off += 4;
+	}
+	if (frame->flags & FRAME_FLAG_METADATA) {
+		put_metadata(out + off, &frame->metadata);
+		off += FRAME_METADATA_LEN;
+	}
+	if (frame->flags & FRAME_FLAG_CRC) {
+		put_le32(out + off, crc32c(0, out, off));
+		off += FRAME_CRC_LEN;
+	}
+	return (out - start) + off;
+}
+
+size_t frame_len(const uint8_t *frame)
+{
+	const uint8_t *header = frame;
+	if (memcmp(frame, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+		header += FRAME_SYNC_LEN;
+	return frame_header_len(header[1]) + get_le32(header + 4) +
+		frame_trailer_len(header[1]);
+}
+
+size_t frame_put_crc(const uint8_t *payload, uint8_t *end)
+{
+	put_le32(end, crc32c(0, payload, end - payload));
+	return FRAME_CRC_LEN;
+}
+
+size_t frame_batch_header_len(uint8_t flags, size_t count)
+{
+	return frame_header_len(flags) + 4 + 4 * count;
+}
+
+uint8_t *frame_put_batch_header(uint8_t *data, uint8_t flags,
+	uint16_t channel, uint32_t sequence, const uint32_t *ends, size_t count)
+{
+	uint8_t *start = data - frame_batch_header_len(flags, count);
+	struct frame frame = {
+		.type = FRAME_TYPE_BATCH,
+		.flags = flags,
+		.channel = channel,
+		.sequence = sequence,
+		.len = 4 + 4 * count + (count > 0 ? ends[count - 1] : 0),
+	};
+	uint8_t *p = start + frame_put_header(start, &frame);
+	put_le32(p, count);
+	for (size_t i = 0; i < count; i++)
+		put_le32(p + 4 + 4 * i, ends[i]);
+	return start;
+}
+
+int frame_batch_open(const struct frame *frame, struct frame_batch *batch)
+{
+	if (frame->len < 4)
+		return EINVAL;
+	batch->count = get_le32(frame->payload);
+	if (batch->count > (frame->len - 4) / 4)
+		return EINVAL;
+	batch->ends = frame->payload + 4;
+	batch->data = batch->ends + 4 * batch->count;
+	size_t data_len = frame->len - 4 - 4 * batch->count;
+	uint32_t prev = 0;
+	for (uint32_t i = 0; i < batch->count; i++) {
+		uint32_t end = get_le32(batch->ends + 4 * i);
+		if (end < prev || end > data_len)
+			return EINVAL;
+		prev = end;
+	}
+	return 0;
+}
+
+int frame_decoder_init(struct frame_decoder *decoder, size_t max_payload,
+	size_t initial_payload)
+{
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->max_payload = max_payload;
+	decoder->cap = 2 * (FRAME_MAX_HEADER_LEN + initial_payload);
+	decoder->buf = malloc(decoder->cap);
+	return (decoder->buf == NULL ? ENOMEM : 0);
+}
+
+void frame_decoder_free(struct frame_decoder *decoder)
+{
+	free(decoder->buf);
+	decoder->buf = NULL;
+}
+
+int frame_decoder_fill(struct frame_decoder *decoder, int fd, size_t *read_len)
+{
+	/* Frames returned by frame_decoder_next() are no longer needed */
+	if (decoder->start > 0) {
+		memmove(decoder->buf, decoder->buf + decoder->start,
+			decoder->end - decoder->start);
+		decoder->end -= decoder->start;
+		decoder->start = 0;
+	}
+	/* Make room for a frame larger than the buffer */
+	size_t off = 0;
+	if (decoder->end >= FRAME_SYNC_LEN &&
+		memcmp(decoder->buf, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+		off = FRAME_SYNC_LEN;
+	if (decoder->end >= off + FRAME_HEADER_LEN) {
+		uint32_t payload_len = get_le32(decoder->buf + off + 4);
+		size_t needed = FRAME_MAX_HEADER_LEN + payload_len + FRAME_CRC_LEN;
+		if (needed > decoder->cap && payload_len <= decoder->max_payload) {
+			uint8_t *buf = realloc(decoder->buf, 2 * needed);
+			if (buf == NULL)
+				return ENOMEM;
+			decoder->buf = buf;
+			decoder->cap = 2 * needed;
+		}
+	}
+	if (decoder->end == decoder->cap)
+		return 0;
+
+	ssize_t res = read(fd, decoder->buf + decoder->end,
+		decoder->cap - decoder->end);
+	if (res < 0)
+		return (errno == EINTR ? EAGAIN : errno);
+	if (res == 0)
+		return ENODATA;
+	decoder->end += res;
+	if (read_len != NULL)
+		*read_len = res;
+	return 0;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Returns the offset of the first FRAME_SYNC in p, or len if there is none.
+ * Candidates are found 16 bytes at a time by matching its first two
+ * bytes. */
+static size_t find_sync(const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+	if (len < FRAME_SYNC_LEN)
+		return len;
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(FRAME_SYNC[0]);
+	const __m128i second = _mm_set1_epi8(FRAME_SYNC[1]);
+	for (; i + 16 + FRAME_SYNC_LEN <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + i + 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+		while (mask != 0) {
+			size_t j = i + __builtin_ctz(mask);
+			if (memcmp(p + j, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+				return j;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i + FRAME_SYNC_LEN <= len; i++) {
+		if (p[i] == (uint8_t)FRAME_SYNC[0] &&
+			memcmp(p + i, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+			return i;
+	}
+	return len;
+}
+
+/* Drops the frame at the start of the buffer, up to the next FRAME_SYNC.
+ * Returns EINVAL if the stream is not protected by CRCs, EAGAIN if more
+ * data is needed to find the next frame. */
+static int resync(struct frame_decoder *decoder, const char *reason)
+{
+	if (!decoder->checked) {
+		fprintf(stderr, "Error: %s in input stream\n", reason);
+		return EINVAL;
+	}
+	decoder->corrupted++;
+	size_t avail = decoder->end - decoder->start;
+	size_t skip = 1 + find_sync(decoder->buf + decoder->start + 1,
+		avail - 1);
+	/* A partial FRAME_SYNC might be at the end */
+	if (skip == avail && avail >= FRAME_SYNC_LEN)
+		skip = avail - (FRAME_SYNC_LEN - 1);
+	decoder->start += skip;
+	decoder->skipped += skip;
+	return (skip < avail ? 0 : EAGAIN);
+}
+
+int frame_decoder_next(struct frame_decoder *decoder, struct frame *frame)
+{
+	int res = 0;
+	while (res == 0) {
+		const uint8_t *start = decoder->buf + decoder->start;
+		size_t avail = decoder->end - decoder->start;
+		size_t sync_len = 0;
+		if (decoder->checked || (avail > 0 && start[0] == (uint8_t)FRAME_SYNC[0])) {
+			if (avail < FRAME_SYNC_LEN)
+				return EAGAIN;
+			if (memcmp(start, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+				sync_len = FRAME_SYNC_LEN;
+			else if (decoder->checked) {
+				res = resync(decoder, "missing frame marker");
+				continue;
+			}
+		}
+		const uint8_t *header = start + sync_len;
+		if (avail < sync_len + FRAME_HEADER_LEN)
+			return EAGAIN;
+		avail -= sync_len;
+		uint32_t payload_len = get_le32(header + 4);
+		if ((header[1] & ~FRAME_FLAGS_KNOWN) != 0 ||
+			get_le16(header + 2) >= FRAME_MAX_CHANNELS ||
+			payload_len > decoder->max_payload ||
+			(sync_len > 0) != ((header[1] & FRAME_FLAG_CRC) != 0)) {
+			res = resync(decoder, "invalid frame");
+			continue;
+		}
+		/* Extensions are only known to be complete with the payload */
+		size_t header_len = FRAME_HEADER_LEN;
+		if (header[1] & FRAME_FLAG_SEQUENCE)
+			header_len += 4;
+		size_t metadata_off = header_len;
+		size_t metadata_len = 0;
+		if (header[1] & FRAME_FLAG_METADATA) {
+			if (avail < header_len + 2)
+				return EAGAIN;
+			metadata_len = get_le16(header + header_len);
+			if (metadata_len > FRAME_METADATA_MAX) {
+				res = resync(decoder, "invalid frame metadata");
+				continue;
+			}
+			header_len += 2 + metadata_len;
+		}
+		if (header[1] & FRAME_FLAG_CRC) {
+			if (avail < header_len + FRAME_CRC_LEN)
+				return EAGAIN;
+			if (crc32c(0, header, header_len) !=
+				get_le32(header + header_len)) {
+				res = resync(decoder, "frame header checksum mismatch");
+				continue;
+			}
+			header_len += FRAME_CRC_LEN;
+		}
+		size_t trailer_len = frame_trailer_len(header[1]);
+		if (avail < header_len + trailer_len ||
+			avail - header_len - trailer_len < payload_len)
+			return EAGAIN;
+		if (header[1] & FRAME_FLAG_CRC) {
+			const uint8_t *payload = header + header_len;
+			if (crc32c(0, payload, payload_len) !=
+				get_le32(payload + payload_len)) {
+				res = resync(decoder, "frame checksum mismatch");
+				continue;
+			}
+			decoder->checked = 1;
+		}
+		frame->type = header[0];
+		frame->flags = header[1];
+		frame->channel = get_le16(header + 2);
+		if (frame->flags & FRAME_FLAG_SEQUENCE)
+			frame->sequence = get_le32(header + FRAME_HEADER_LEN);
+		if ((frame->flags & FRAME_FLAG_METADATA) &&
+			parse_metadata(header + metadata_off + 2, metadata_len,
+			&frame->metadata) != 0) {
+			res = resync(decoder, "invalid frame metadata");
+			continue;
+		}
+		decoder->start += sync_len + header_len + payload_len + trailer_len;
+		frame->payload = header + header_len;
+		frame->len = payload_len;
+		return 0;
+	}
+	return res;
+}
+
+void frame_sequence_check(struct frame_sequence *sequence, uint32_t number)
+{
+	sequence->received++;
+	if (!sequence->started) {
+		sequence->started = 1;
+		sequence->next = number + 1;
+		sequence->seen = 1;
+		return;
+	}
+	int32_t ahead = (int32_t)(number - sequence->next);
+	if (ahead >= 0) {
+		/* Everything between next and number is missing, for now */
+		sequence->lost += ahead;
+		sequence->seen = (ahead >= 63 ? 0 : sequence->seen << (ahead + 1)) | 1;
+		sequence->next = number + 1;
+		return;
+	}
+	uint32_t behind = sequence->next - 1 - number;
+	if (behind >= 64) {
+		sequence->reordered++;
+	} else if (sequence->seen & (1ULL << behind)) {
+		sequence->duplicates++;
+	} else {
+		sequence->seen |= 1ULL << behind;
+		sequence->reordered++;
+		if (sequence->lost > 0)
+			sequence->lost--;
+	}
+}
@@ -0,0 +1,193 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+/* Framing of packets over byte streams (stdin/stdout):
+ *
+ *   u8 type, u8 flags, u16 channel, u32 payload length,
+ *   extensions selected by flags, in the order of their bits, payload
+ *
+ * The channel tells which of the devices multiplexed over the stream a
+ * packet comes from or goes to, 0 for other frames. Its top 4 bits are
+ * reserved.
+ *
+ * Extensions:
+ *   FRAME_FLAG_SEQUENCE  u32 sequence number of the frame in its direction
+ *   FRAME_FLAG_METADATA  u16 length n, n bytes of (u8 type, u8 length,
+ *                        value) entries describing the packet
+ *   FRAME_FLAG_CRC       u32 CRC-32C of the header and extensions before it
+ *
+ * With FRAME_FLAG_CRC, the frame is also preceded by the 4 bytes of
+ * FRAME_SYNC, and followed by a u32 CRC-32C of the payload, so that a
+ * corrupted length is caught before waiting for the payload.
+ * Once a receiver has seen such a frame, it expects all of them to be, and
+ * skips to the next FRAME_SYNC when one is corrupted. FRAME_SYNC cannot be
+ * mistaken for a header, as its second byte has an unknown flag set.
+ *
+ * FRAME_TYPE_BATCH payload, to save the framing of each small packet:
+ *   u32 packet count n, n x u32 end offset of each packet relative to the
+ *   first one, packets back to back
+ *
+ * FRAME_TYPE_LZ4 payload, a batch of frames compressed together:
+ *   u32 length once decompressed, LZ4 block of the frames
+ *
+ * FRAME_TYPE_HEADER_* payloads are described in header.h, FRAME_TYPE_FEC*
+ * ones in fec.h.
+ *
+ * FRAME_TYPE_SEALED payload, a batch of frames encrypted together:
+ *   12 bytes nonce (u64 number of times the counter wrapped, u32 counter),
+ *   ChaCha20-Poly1305 ciphertext of the frames, 16 bytes tag
+ * Before any frame, each side sends 12 random bytes. The key of each
+ * direction is the ChaCha20 key stream of the pre-shared key with the
+ * random bytes of the sender as nonce, itself used as a key with those of
+ * the receiver as nonce, so that it differs per session and direction.
+ * Nonces go up from 0 in each direction.
+ *
+ * Integers are little-endian. Unknown flags and reserved bits are errors,
+ * frames of unknown types are skipped by their receiver. */
+
+#define FRAME_HEADER_LEN 8
+/* Longest metadata accepted, sent metadata is FRAME_METADATA_LEN */
+#define FRAME_METADATA_MAX 255
+#define FRAME_SYNC "\xf7\x8c\x5a\xa5"
+#define FRAME_SYNC_LEN 4
+#define FRAME_CRC_LEN 4
+#define FRAME_MAX_CHANNELS 4096
+#define FRAME_MAX_HEADER_LEN (FRAME_SYNC_LEN + FRAME_HEADER_LEN + 4 + 2 + \
+	FRAME_METADATA_MAX + FRAME_CRC_LEN)
+
+#define FRAME_TYPE_PACKET 0
+#define FRAME_TYPE_PROBE 1        /* latency probe, see probe.h */
+#define FRAME_TYPE_PROBE_REPLY 2  /* probe payload sent back unchanged */
+#define FRAME_TYPE_BATCH 3        /* several packets */
+#define FRAME_TYPE_LZ4 4          /* several frames, compressed */
+#define FRAME_TYPE_HEADER_CONTEXT 5  /* packet whose headers are a context */
+#define FRAME_TYPE_HEADER_PACKET 6   /* packet with compressed headers */
+#define FRAME_TYPE_SEALED 7       /* several frames, encrypted */
+#define FRAME_TYPE_FEC 8          /* parity of a group of frames */
+#define FRAME_TYPE_FEC_LOSS 9     /* losses seen before correction */
+
+#define FRAME_FLAG_SEQUENCE 0x01
+#define FRAME_FLAG_METADATA 0x02
+#define FRAME_FLAG_CRC 0x04
+#define FRAME_FLAGS_KNOWN (FRAME_FLAG_SEQUENCE | FRAME_FLAG_METADATA | \
+	FRAME_FLAG_CRC)
+
+/* Metadata entries, unknown ones are skipped */
+#define FRAME_META_TIMESTAMP 1  /* u64 ns since the epoch, read from device */
+#define FRAME_META_QUEUE 2      /* u16 device queue the packet was read from */
+#define FRAME_META_DIRECTION 3  /* u8 FRAME_DIRECTION_* */
+#define FRAME_META_FLOW_HASH 4  /* u32 packet_flow_hash(FRAME_FLOW_SEED) */
+#define FRAME_META_GSO 5        /* u8 VIRTIO_NET_HDR_GSO_* type, u8 0,
+                                   u16 segment size */
+
+#define FRAME_DIRECTION_FROM_DEVICE 1
+#define FRAME_DIRECTION_TO_DEVICE 2
+
+/* Fixed, so that receivers can compare hashes across senders */
+#define FRAME_FLOW_SEED 0x666c6f77
+
+/* The entries above, in that order, which is what senders use so that
+ * encoding is a copy of a template and a few stores */
+#define FRAME_METADATA_LEN (2 + (2 + 8) + (2 + 2) + (2 + 1) + (2 + 4) + \
+	(2 + 4))
+
+struct frame_metadata {
+	unsigned present;         /* 1 << FRAME_META_* of decoded entries */
+	uint64_t timestamp_ns;
+	uint16_t queue;
+	uint8_t direction;
+	uint32_t flow_hash;
+	uint8_t gso_type;
+	uint16_t gso_size;
+};
+
+struct frame {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t channel;
+	uint32_t sequence;        /* with FRAME_FLAG_SEQUENCE */
+	struct frame_metadata metadata;  /* with FRAME_FLAG_METADATA */
+	const uint8_t *payload;
+	size_t len;
+};
+
+/* Packets of a batch frame, which has been validated as a whole */
+struct frame_batch {
+	uint32_t count;
+	const uint8_t *ends;
+	const uint8_t *data;
+};
+
+struct frame_decoder {
+	uint8_t *buf;
+	size_t cap;
+	size_t start;
+	size_t end;
+	size_t max_payload;
+	int checked;              /* a frame with a valid CRC was received */
+	unsigned long long corrupted;
+	unsigned long long skipped;  /* bytes dropped to resynchronise */
+};
+
+/* Receiver side accounting of sequence numbers. Frames up to 64 sequence
+ * numbers late are told apart as reordered or duplicated; later ones are
+ * counted as reordered. */
+struct frame_sequence {
+	int started;
+	uint32_t next;
+	uint64_t seen;            /* bit i is set if next - 1 - i was received */
+	unsigned long long received;
+	unsigned long long lost;  /* missing, net of those which came late */
+	unsigned long long duplicates;
+	unsigned long long reordered;
+};
+
+/* Length of the header and extensions written by frame_put_header(), and
+ * of the trailer written by frame_put_crc() */
+size_t frame_header_len(uint8_t flags);
+size_t frame_trailer_len(uint8_t flags);
+/* Writes the header and extensions of a frame for a payload of frame->len
+ * bytes, which the caller places right after them. Returns their length. */
+size_t frame_put_header(uint8_t *out, const struct frame *frame);
+/* Length of a whole frame written by frame_put_header(), from its header */
+size_t frame_len(const uint8_t *frame);
+/* Writes the CRC trailer at the end of the payload of a frame with
+ * FRAME_FLAG_CRC. Returns its length. */
+size_t frame_put_crc(const uint8_t *payload, uint8_t *end);
+/* Length of the header, extensions, count and offsets of a batch frame */
+size_t frame_batch_header_len(uint8_t flags, size_t count);
+/* Writes a batch frame header which ends right before the packets at
+ * data, given their end offsets. Returns where the frame starts. */
+uint8_t *frame_put_batch_header(uint8_t *data, uint8_t flags,
+	uint16_t channel, uint32_t sequence, const uint32_t *ends, size_t count);
+/* Returns EINVAL if the offsets of a batch frame are inconsistent */
+int frame_batch_open(const struct frame *frame, struct frame_batch *batch);
+
+static inline void frame_batch_get(const struct frame_batch *batch,
+	uint32_t i, const uint8_t **data, size_t *len)
+{
+	uint32_t start = (i == 0 ? 0 : get_le32(batch->ends + 4 * (i - 1)));
+	*data = batch->data + start;
+	*len = get_le32(batch->ends + 4 * i) - start;
+}
+
+/* The buffer starts with room for two frames of initial_payload bytes,
+ * and grows for larger ones up to max_payload */
+int frame_decoder_init(struct frame_decoder *decoder, size_t max_payload,
+	size_t initial_payload);
+void frame_decoder_free(struct frame_decoder *decoder);
+/* Reads what is available from a non-blocking fd. Returns EAGAIN if there
+ * was nothing to read, ENODATA at end of file. */
+int frame_decoder_fill(struct frame_decoder *decoder, int fd, size_t *read_len);
+/* Returns 0 and the next complete frame, of any type, EAGAIN if more data
+ * is needed, EINVAL if the stream is corrupted and cannot be
+ * resynchronised */
+int frame_decoder_next(struct frame_decoder *decoder, struct frame *frame);
+
+void frame_sequence_check(struct frame_sequence *sequence, uint32_t number);
+
+#endif
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include "generate.h"
+#include "packet.h"
+#include "pool.h"
+#include "tunnel.h"
+#include "util.h"
+
+#define PI_HEADER_LEN 4
+#define ETH_HEADER_LEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86dd
+
+/* Benchmarking ranges (RFC 2544, RFC 5180) */
+#define GENERATE_DEFAULT_SRC4 "198.18.0.1"
+#define GENERATE_DEFAULT_DST4 "198.19.0.1"
+#define GENERATE_DEFAULT_SRC6 "2001:2::1"
+#define GENERATE_DEFAULT_DST6 "2001:2:0:1::1"
+
+/* Simple IMIX: 7 small, 4 medium and 1 large packet */
+static const size_t imix_sizes[] = { 40, 576, 1500 };
+static const unsigned imix_weights[] = { 7, 4, 1 };
+
+struct generator {
+	const struct generate_options *options;
+	struct pool pool;
+	struct pool_buffer **templates;
+	size_t template_count;
+	/* Index into options->sizes of each packet, in sending order */
+	uint8_t schedule[GENERATE_SCHEDULE_MAX];
+	size_t schedule_len;
+	/* Offsets from the start of the buffer, the same for all templates */
+	size_t counter_off;
+	size_t l4_csum_off;
+	size_t ip_id_off;   /* 0 for IPv6 */
+	size_t ip_csum_off;
+};
+
+static int parse_address(const char *str, uint8_t *addr, uint8_t *family)
+{
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		*family = 4;
+		return 0;
+	}
+	if (inet_pton(AF_INET6, str, addr) == 1) {
+		*family = 6;
+		return 0;
+	}
+	fprintf(stderr, "Error: invalid address '%s'\n", str);
+	return EINVAL;
+}
+
+static int parse_number(const char *str, unsigned long long max,
+	unsigned long long *value)
+{
+	char *endptr = NULL;
+	errno = 0;
+	unsigned long long res = strtoull(str, &endptr, 10);
+	unsigned long long multiplier = 1;
+	if (*endptr == 'k')
+		multiplier = 1000;
+	else if (*endptr == 'M')
+		multiplier = 1000000;
+	if (multiplier != 1)
+		endptr++;
+	if (endptr == str || *endptr != '\0' || str[0] == '-' || errno != 0 ||
+		res > ULLONG_MAX / multiplier || res * multiplier > max)
+		return EINVAL;
+	*value = res * multiplier;
+	return 0;
+}
+
+static int parse_sizes(struct generate_options *options, char *str)
+{
+	if (strcmp(str, "imix") == 0) {
+		options->size_count = sizeof(imix_sizes) / sizeof(imix_sizes[0]);
+		memcpy(options->sizes, imix_sizes, sizeof(imix_sizes));
+		memcpy(options->weights, imix_weights, sizeof(imix_weights));
+		return 0;
+	}
+	options->size_count = 0;
+	unsigned total = 0;
+	char *saveptr = NULL;
+	for (char *tok = strtok_r(str, "/", &saveptr); tok != NULL;
+		tok = strtok_r(NULL, "/", &saveptr)) {
+		if (options->size_count == GENERATE_SIZES_MAX)
+			return EINVAL;
+		unsigned long long len = 0, weight = 1;
+		char *star = strchr(tok, '*');
+		if (star != NULL) {
+			*star = '\0';
+			if (parse_number(star + 1, GENERATE_SCHEDULE_MAX, &weight) != 0 ||
+				weight == 0)
+				return EINVAL;
+		}
+		if (parse_number(tok, 65535, &len) != 0)
+			return EINVAL;
+		total += weight;
+		options->sizes[options->size_count] = len;
+		options->weights[options->size_count] = weight;
+		options->size_count++;
+	}
+	if (options->size_count == 0 || total > GENERATE_SCHEDULE_MAX)
+		return EINVAL;
+	return 0;
+}
+
+int generate_parse(struct generate_options *options, const char *spec)
+{
+	if (options == NULL)
+		return EINVAL;
+	memset(options, 0, sizeof(*options));
+	options->proto = 17;
+	options->sport = 1024;
+	options->dport = 9; /* discard */
+	options->flows = 1;
+	options->sizes[0] = 64;
+	options->weights[0] = 1;
+	options->size_count = 1;
+
+	char *copy = strdup(spec != NULL ? spec : "");
+	if (copy == NULL)
+		return ENOMEM;
+	int res = 0;
+	uint8_t src_family = 0, dst_family = 0;
+	char *saveptr = NULL;
+	for (char *tok = strtok_r(copy, ",", &saveptr); tok != NULL && res == 0;
+		tok = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(tok, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Error: expected key=value, got '%s'\n", tok);
+			res = EINVAL;
+			break;
+		}
+		*value++ = '\0';
+		unsigned long long num = 0;
+		if (strcmp(tok, "proto") == 0) {
+			if (strcmp(value, "udp") == 0) {
+				options->proto = 17;
+			} else if (strcmp(value, "tcp") == 0) {
+				options->proto = 6;
+			} else {
+				fprintf(stderr, "Error: unknown protocol '%s'\n", value);
+				res = EINVAL;
+			}
+		} else if (strcmp(tok, "src") == 0) {
+			res = parse_address(value, options->src, &src_family);
+		} else if (strcmp(tok, "dst") == 0) {
+			res = parse_address(value, options->dst, &dst_family);
+		} else if (strcmp(tok, "sport") == 0 || strcmp(tok, "dport") == 0) {
+			res = parse_number(value, 65535, &num);
+			if (res != 0 || num == 0) {
+				fprintf(stderr, "Error: invalid port '%s'\n", value);
+				res = EINVAL;
+			} else if (tok[0] == 's') {
+				options->sport = num;
+			} else {
+				options->dport = num;
+			}
+		} else if (strcmp(tok, "flows") == 0) {
+			res = parse_number(value, 65535, &num);
+			if (res != 0 || num == 0) {
+				fprintf(stderr, "Error: invalid flow count '%s'\n", value);
+				res = EINVAL;
+			}
+			options->flows = num;
+		} else if (strcmp(tok, "size") == 0) {
+			res = parse_sizes(options, value);
+			if (res != 0)
+				fprintf(stderr, "Error: invalid packet sizes\n");
+		} else if (strcmp(tok, "rate") == 0) {
+			res = parse_number(value, 1000000000ULL, &options->rate);
+			if (res != 0)
+				fprintf(stderr, "Error: invalid rate '%s'\n", value);
+		} else if (strcmp(tok, "count") == 0) {
+			res = parse_number(value, UINT64_MAX, &options->count);
+			if (res != 0)
+				fprintf(stderr, "Error: invalid count '%s'\n", value);
+		} else {
+			fprintf(stderr, "Error: unknown generator setting '%s'\n", tok);
+			res = EINVAL;
+		}
+	}
+	free(copy);
+	if (res != 0)
+		return res;
+
+	/* A single address picks the family of the default for the other */
+	options->family = (src_family == 6 || dst_family == 6 ? 6 : 4);
+	if (src_family == 0)
+		inet_pton(options->family == 6 ? AF_INET6 : AF_INET,
+			options->family == 6 ? GENERATE_DEFAULT_SRC6 :
+			GENERATE_DEFAULT_SRC4, options->src);
+	if (dst_family == 0)
+		inet_pton(options->family == 6 ? AF_INET6 : AF_INET,
+			options->family == 6 ? GENERATE_DEFAULT_DST6 :
+			GENERATE_DEFAULT_DST4, options->dst);
+	if ((src_family != 0 && src_family != options->family) ||
+		(dst_family != 0 && dst_family != options->family)) {
+		fprintf(stderr, "Error: source and destination families differ\n");
+		return EINVAL;
+	}
+	if ((unsigned long)options->sport + options->flows - 1 > 65535) {
+		fprintf(stderr, "Error: too many flows for the source port\n");
+		return EINVAL;
+	}
+	if (options->flows * options->size_count > GENERATE_TEMPLATES_MAX) {
+		fprintf(stderr, "Error: too many flows\n");
+		return EINVAL;
+	}
+	size_t min_len = (options->family == 6 ? 40 : 20) +
+		(options->proto == 6 ? 20 : 8) + 4;
+	for (size_t i = 0; i < options->size_count; i++) {
+		if (options->sizes[i] < min_len) {
+			if (verbosity > 0)
+				fprintf(stderr, "Raising %zuB packets to %zuB\n",
+					options->sizes[i], min_len);
+			options->sizes[i] = min_len;
+		}
+	}
+	return 0;
+}
+
+/* Smooth weighted round-robin, which spreads the large packets out
+ * instead of sending them back to back */
+static void build_schedule(struct generator *gen)
+{
+	const struct generate_options *options = gen->options;
+	int current[GENERATE_SIZES_MAX] = { 0 };
+	int total = 0;
+	for (size_t i = 0; i < options->size_count; i++)
+		total += options->weights[i];
+	gen->schedule_len = total;
+	for (int n = 0; n < total; n++) {
+		size_t best = 0;
+		for (size_t i = 0; i < options->size_count; i++) {
+			current[i] += options->weights[i];
+			if (current[i] > current[best])
+				best = i;
+		}
+		current[best] -= total;
+		gen->schedule[n] = best;
+	}
+}
+
+static void build_template(struct generator *gen, struct pool_buffer *buffer,
+	unsigned long flow, size_t len, unsigned link)
+{
+	const struct generate_options *options = gen->options;
+	uint8_t *ip = buffer->data;
+	size_t ip_len = (options->family == 6 ? 40 : 20);
+	size_t l4_len = len - ip_len;
+	memset(ip, 0, len);
+	if (options->family == 6) {
+		ip[0] = 0x60;
+		put_be16(ip + 4, l4_len);
+		ip[6] = options->proto;
+		ip[7] = 64;
+		memcpy(ip + 8, options->src, 16);
+		memcpy(ip + 24, options->dst, 16);
+	} else {
+		ip[0] = 0x45;
+		put_be16(ip + 2, len);
+		put_be16(ip + 6, 0x4000); /* don't fragment */
+		ip[8] = 64;
+		ip[9] = options->proto;
+		memcpy(ip + 12, options->src, 4);
+		memcpy(ip + 16, options->dst, 4);
+	}
+	uint8_t *l4 = ip + ip_len;
+	put_be16(l4, options->sport + flow);
+	put_be16(l4 + 2, options->dport);
+	if (options->proto == 6) {
+		l4[12] = 5 << 4;
+		l4[13] = PACKET_TCP_ACK | PACKET_TCP_PSH;
+		put_be16(l4 + 14, 65535);
+	} else {
+		put_be16(l4 + 4, l4_len);
+	}
+	packet_fill_checksums(ip, len, 0);
+	buffer->len = len;
+
+	if (link & PACKET_LINK_ETHERNET) {
+		buffer->data -= ETH_HEADER_LEN;
+		buffer->len += ETH_HEADER_LEN;
+		memcpy(buffer->data, options->mac, 6);
+		/* Locally administered source */
+		memcpy(buffer->data + 6, "\x02\x00\x00\x00\x00\x01", 6);
+		put_be16(buffer->data + 12,
+			options->family == 6 ? ETH_P_IPV6 : ETH_P_IP);
+	}
+	if (link & PACKET_LINK_PI) {
+		buffer->data -= PI_HEADER_LEN;
+		buffer->len += PI_HEADER_LEN;
+		put_be16(buffer->data, 0);
+		put_be16(buffer->data + 2,
+			options->family == 6 ? ETH_P_IPV6 : ETH_P_IP);
+	}
+}
+
+static int generator_init(struct generator *gen,
+	const struct generate_options *options, unsigned link)
+{
+	memset(gen, 0, sizeof(*gen));
+	gen->options = options;
+	build_schedule(gen);
+
+	size_t headroom = 0;
+	if (link & PACKET_LINK_PI)
+		headroom += PI_HEADER_LEN;
+	if (link & PACKET_LINK_ETHERNET)
+		headroom += ETH_HEADER_LEN;
+	size_t max_len = 0;
+	for (size_t i = 0; i < options->size_count; i++) {
+		if (options->sizes[i] > max_len)
+			max_len = options->sizes[i];
+	}
+	gen->template_count = options->flows * options->size_count;
+	int res = pool_init(&gen->pool, gen->template_count, headroom + max_len,
+		headroom);
+	if (res != 0)
+		return res;
+	gen->templates = calloc(gen->template_count, sizeof(*gen->templates));
+	if (gen->templates == NULL) {
+		pool_destroy(&gen->pool);
+		return ENOMEM;
+	}
+	for (size_t i = 0; i < gen->template_count; i++) {
+		gen->templates[i] = pool_get(&gen->pool);
+		build_template(gen, gen->templates[i], i / options->size_count,
+			options->sizes[i % options->size_count], link);
+	}
+
+	size_t ip_len = (options->family == 6 ? 40 : 20);
+	gen->counter_off = headroom + ip_len + (options->proto == 6 ? 20 : 8);
+	gen->l4_csum_off = headroom + ip_len + (options->proto == 6 ? 16 : 6);
+	if (options->family == 4) {
+		gen->ip_id_off = headroom + 4;
+		gen->ip_csum_off = headroom + 10;
+	}
+	return 0;
+}
+
+static void generator_destroy(struct generator *gen)
+{
+	free(gen->templates);
+	pool_destroy(&gen->pool);
+}
+
+/* Returns the template of the nth packet, with its counter set to n */
+static struct pool_buffer *generator_next(struct generator *gen,
+	unsigned long long n)
+{
+	const struct generate_options *options = gen->options;
+	unsigned long flow = n % options->flows;
+	size_t size = gen->schedule[(n / options->flows) % gen->schedule_len];
+	struct pool_buffer *buffer =
+		gen->templates[flow * options->size_count + size];
+	uint8_t *p = buffer->data;
+
+	uint32_t old_counter = get_be32(p + gen->counter_off);
+	uint32_t counter = (uint32_t)n;
+	put_be32(p + gen->counter_off, counter);
+	packet_checksum_update32(p + gen->l4_csum_off, old_counter, counter);
+	if (options->proto == 17 && get_be16(p + gen->l4_csum_off) == 0)
+		put_be16(p + gen->l4_csum_off, 0xffff);
+	if (gen->ip_id_off != 0) {
+		uint16_t old_id = get_be16(p + gen->ip_id_off);
+		put_be16(p + gen->ip_id_off, counter & 0xffff);
+		packet_checksum_update16(p + gen->ip_csum_off, old_id,
+			counter & 0xffff);
+	}
+	return buffer;
+}
+
+int generate_run(int tun_fd, const struct generate_options *options,
+	unsigned link, struct stats *stats)
+{
+	struct generator gen;
+	int res = generator_init(&gen, options, link);
+	if (res != 0)
+		return res;
+
+	/* Pace by batches, so that high rates don't sleep for every packet */
+	unsigned long long batch = GENERATE_BATCH_LEN;
+	if (options->rate != 0 && options->rate / 1000 < batch)
+		batch = (options->rate / 1000 > 0 ? options->rate / 1000 : 1);
+
+	uint64_t start = now_ns(CLOCK_MONOTONIC);
+	unsigned long long sent = 0;
+	while (interrupt_flag == 0 && (options->count == 0 ||
+		sent < options->count)) {
+		if (stats_flag != 0) {
+			stats_flag = 0;
+			stats_print(stderr, stats);
+		}
+		if (options->rate != 0) {
+			uint64_t due = start + sent * 1000000000ULL / options->rate;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000ULL,
+				.tv_nsec = due % 1000000000ULL,
+			};
+			if (now_ns(CLOCK_MONOTONIC) < due &&
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				NULL) == EINTR)
+				continue;
+		}
+		for (unsigned long long i = 0; i < batch; i++) {
+			if (options->count != 0 && sent == options->count)
+				break;
+			struct pool_buffer *buffer = generator_next(&gen, sent);
+			res = inject_packet(tun_fd, buffer->data, buffer->len);
+			if (res == 0) {
+				stats->tun_tx_packets++;
+				stats->tun_tx_bytes += buffer->len;
+			} else if (res == EIO) {
+				stats->tun_tx_dropped++;
+				res = 0;
+			} else {
+				break;
+			}
+			sent++;
+		}
+		if (res != 0)
+			break;
+	}
+
+	uint64_t elapsed = now_ns(CLOCK_MONOTONIC) - start;
+	if (verbosity > 0 && elapsed > 0) {
+		fprintf(stderr, "Generated %llu packets in %.3fs (%.0f pps, "
+			"%.1f Mbit/s)\n", sent, elapsed / 1e9, sent * 1e9 / elapsed,
+			stats->tun_tx_bytes * 8e3 / elapsed);
+	}
+	generator_destroy(&gen);
+	return (res == EINTR ? 0 : res);
+}
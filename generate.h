@@ -0,0 +1,46 @@
+#ifndef GENERATE_H
+#define GENERATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+/* Synthetic traffic written into the device, for load tests of the kernel
+ * side of the tunnel. Every (flow, size) combination is built once into a
+ * pool buffer, and sending a packet only patches a counter into it along
+ * with the checksums which cover that counter. */
+
+#define GENERATE_SIZES_MAX 8
+/* Upper bound on the sum of the size weights */
+#define GENERATE_SCHEDULE_MAX 64
+#define GENERATE_TEMPLATES_MAX 65536
+
+#ifndef GENERATE_BATCH_LEN
+#define GENERATE_BATCH_LEN 32
+#endif
+
+struct generate_options {
+	uint8_t family;
+	uint8_t proto;
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint16_t sport;          /* flows use consecutive source ports */
+	uint16_t dport;
+	unsigned long flows;
+	size_t sizes[GENERATE_SIZES_MAX];   /* IP packet lengths */
+	unsigned weights[GENERATE_SIZES_MAX];
+	size_t size_count;
+	unsigned long long rate;  /* packets per second, 0 for unlimited */
+	unsigned long long count; /* 0 until interrupted */
+	uint8_t mac[6];           /* destination, with PACKET_LINK_ETHERNET */
+};
+
+/* Parses a comma-separated list of key=value settings:
+ *   proto=udp|tcp  src=addr  dst=addr  sport=N  dport=N  flows=N
+ *   size=imix|len[*weight][/len[*weight]...]  rate=N[k|M]  count=N
+ * Both addresses must be of the same family. */
+int generate_parse(struct generate_options *options, const char *spec);
+int generate_run(int tun_fd, const struct generate_options *options,
+	unsigned link, struct stats *stats);
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "frame.h"
+#include "header.h"
+#include "crc32c.h"
+#include "util.h"
+
+#define IPV6_HEADER_LEN 40
+#define UDP_HEADER_LEN 8
+#define RTP_HEADER_LEN 12
+
+/* Largest step of the RTP sequence number (or IPv4 ID) left implicit: the
+ * other values its low bits can tell apart are for lost packets */
+#define LSB_DELTA_MAX 4
+
+static uint16_t ipv4_header_checksum(const uint8_t *ip, size_t ihl)
+{
+	uint32_t sum = packet_checksum_add(ip, 10, 0);
+	return packet_checksum_fold(packet_checksum_add(ip + 12, ihl - 12, sum));
+}
+
+/* Fills the layout of a context for a packet. Returns EINVAL if the
+ * receiver could not rebuild its headers exactly from the context. */
+static int get_layout(const uint8_t *data, size_t len,
+	const struct packet_info *info, struct header_context *ctx)
+{
+	size_t l3 = info->l3_off;
+	size_t l4 = info->l4_off;
+	if (info->family == 0 || info->proto != 17 || info->fragment ||
+		l4 == 0 || l4 + UDP_HEADER_LEN > HEADER_MAX_LEN ||
+		len < l4 + UDP_HEADER_LEN)
+		return EINVAL;
+	const uint8_t *ip = data + l3;
+	if (info->family == 4) {
+		if ((size_t)get_be16(ip + 2) != len - l3 ||
+			(get_be16(ip + 6) & 0x3fff) != 0 ||
+			ipv4_header_checksum(ip, l4 - l3) != get_be16(ip + 10))
+			return EINVAL;
+	} else if ((size_t)get_be16(ip + 4) != len - l3 - IPV6_HEADER_LEN) {
+		return EINVAL;
+	}
+	if ((size_t)get_be16(data + l4 + 4) != len - l4)
+		return EINVAL;
+
+	/* RTP version 2, but not RTCP (payload types 200 to 204 with the
+	 * marker bit) which shares its ports when multiplexed */
+	size_t rtp = l4 + UDP_HEADER_LEN;
+	uint8_t type = (len >= rtp + RTP_HEADER_LEN ? data[rtp + 1] & 0x7f : 0);
+	ctx->rtp = (len >= rtp + RTP_HEADER_LEN &&
+		rtp + RTP_HEADER_LEN <= HEADER_MAX_LEN &&
+		(data[rtp] >> 6) == 2 && (type < 72 || type > 76));
+	ctx->len = rtp + (ctx->rtp ? RTP_HEADER_LEN : 0);
+	ctx->l3_off = l3;
+	ctx->l4_off = l4;
+	ctx->family = info->family;
+	return 0;
+}
+
+/* Copies the headers of a packet, with the fields which are sent apart or
+ * recomputed zeroed */
+static void mask_header(const struct header_context *ctx, const uint8_t *data,
+	uint8_t *out)
+{
+	memcpy(out, data, ctx->len);
+	uint8_t *ip = out + ctx->l3_off;
+	if (ctx->family == 4) {
+		memset(ip + 2, 0, 4);
+		memset(ip + 10, 0, 2);
+	} else {
+		memset(ip + 4, 0, 2);
+	}
+	memset(out + ctx->l4_off + 4, 0, 4);
+	if (ctx->rtp) {
+		uint8_t *rtp = out + ctx->l4_off + UDP_HEADER_LEN;
+		rtp[1] &= 0x7f;
+		memset(rtp + 2, 0, 6);
+	}
+}
+
+static void load_fields(struct header_context *ctx, const uint8_t *data)
+{
+	if (ctx->family == 4)
+		ctx->ip_id = get_be16(data + ctx->l3_off + 4);
+	if (ctx->rtp) {
+		const uint8_t *rtp = data + ctx->l4_off + UDP_HEADER_LEN;
+		ctx->rtp_sequence = get_be16(rtp + 2);
+		ctx->rtp_timestamp = get_be32(rtp + 4);
+	}
+}
+
+/* The value following previous with the given low bits */
+static uint16_t lsb_decode(uint16_t previous, unsigned lsb)
+{
+	uint16_t next = previous + 1;
+	return next + ((lsb - next) & HEADER_FLAG_LSB_MASK);
+}
+
+/* Check of rebuilt headers against those compressed */
+static uint8_t header_check(const uint8_t *data, size_t len)
+{
+	return crc32c(0, data, len) & 0xff;
+}
+
+int header_compressor_init(struct header_compressor *compressor,
+	unsigned link)
+{
+	memset(compressor, 0, sizeof(*compressor));
+	compressor->link = link;
+	return flow_table_init(&compressor->flows, HEADER_CONTEXTS);
+}
+
+void header_compressor_free(struct header_compressor *compressor)
+{
+	flow_table_free(&compressor->flows);
+}
+
+/* Returns the id of the context of a flow, which is invalid if the flow
+ * is new */
+static uint8_t get_context(struct header_compressor *compressor,
+	const struct packet_info *info, uint64_t now_ns)
+{
+	struct flow_key key;
+	flow_key_from_packet(info, &key);
+	uint32_t hash = flow_key_hash(&key);
+	struct flow *flow = flow_table_get(&compressor->flows, &key, hash, 0);
+	if (flow == NULL) {
+		uint32_t id = compressor->next_id;
+		if (id < HEADER_CONTEXTS) {
+			compressor->next_id++;
+		} else {
+			/* Take over the context of the flow seen least recently */
+			struct flow *oldest = NULL;
+			for (size_t i = 0; i <= compressor->flows.mask; i++) {
+				struct flow *f = &compressor->flows.slots[i];
+				if (f->used && (oldest == NULL || f->last_ns < oldest->last_ns))
+					oldest = f;
+			}
+			id = oldest->tag;
+			flow_table_remove(&compressor->flows, oldest);
+		}
+		flow = flow_table_get(&compressor->flows, &key, hash, 1);
+		flow->tag = id;
+		compressor->contexts[id].valid = 0;
+	}
+	flow->last_ns = now_ns;
+	flow->packets++;
+	return flow->tag;
+}
+
+uint8_t header_compress(struct header_compressor *compressor, uint8_t *data,
+	size_t len, const struct packet_info *info, uint64_t now_ns,
+	size_t *out_len)
+{
+	struct header_context layout = { .len = 0 };
+	*out_len = len;
+	if (get_layout(data, len, info, &layout) != 0)
+		return FRAME_TYPE_PACKET;
+	mask_header(&layout, data, layout.header);
+	load_fields(&layout, data);
+	uint8_t id = get_context(compressor, info, now_ns);
+	struct header_context *ctx = &compressor->contexts[id];
+
+	int refresh = (!ctx->valid || ctx->len != layout.len ||
+		ctx->rtp != layout.rtp ||
+		memcmp(ctx->header, layout.header, layout.len) != 0 ||
+		ctx->since_refresh >= HEADER_REFRESH_PACKETS);
+	uint32_t stride = (ctx->valid ? ctx->timestamp_stride : 0);
+	uint8_t flags = 0;
+	if (!refresh && ctx->rtp) {
+		uint16_t delta = layout.rtp_sequence - ctx->rtp_sequence;
+		uint32_t ts_delta = layout.rtp_timestamp - ctx->rtp_timestamp;
+		if (delta == 0 || delta > LSB_DELTA_MAX ||
+			ts_delta != stride * delta) {
+			flags |= HEADER_FLAG_RTP;
+			/* A new stride seen twice in a row is worth a refresh, a
+			 * single jump (silence, marker) is not */
+			if (delta == 1) {
+				if (ts_delta == ctx->next_stride) {
+					refresh = 1;
+					stride = ts_delta;
+				}
+				ctx->next_stride = ts_delta;
+			}
+		}
+		if (ctx->family == 4 &&
+			layout.ip_id != (uint16_t)(ctx->ip_id + delta))
+			flags |= HEADER_FLAG_IP_ID;
+		flags |= layout.rtp_sequence & HEADER_FLAG_LSB_MASK;
+	} else if (!refresh && ctx->family == 4) {
+		uint16_t delta = layout.ip_id - ctx->ip_id;
+		if (delta == 0 || delta > LSB_DELTA_MAX)
+			flags |= HEADER_FLAG_IP_ID;
+		flags |= layout.ip_id & HEADER_FLAG_LSB_MASK;
+	}
+
+	if (refresh) {
+		*ctx = layout;
+		ctx->timestamp_stride = stride;
+		ctx->valid = 1;
+		memmove(data + HEADER_CONTEXT_PREFIX_LEN, data, len);
+		data[0] = id;
+		put_be32(data + 1, stride);
+		*out_len = HEADER_CONTEXT_PREFIX_LEN + len;
+		return FRAME_TYPE_HEADER_CONTEXT;
+	}
+
+	const uint8_t *udp = data + layout.l4_off;
+	const uint8_t *rtp = udp + UDP_HEADER_LEN;
+	if (get_be16(udp + 6) != 0)
+		flags |= HEADER_FLAG_UDP_CHECKSUM;
+	if (layout.rtp && (rtp[1] & 0x80))
+		flags |= HEADER_FLAG_RTP_MARKER;
+	uint8_t fields[3 + 2 + 6 + 2];
+	uint8_t *p = fields;
+	*p++ = id;
+	*p++ = flags;
+	*p++ = header_check(data, layout.len);
+	if (flags & HEADER_FLAG_IP_ID) {
+		put_be16(p, layout.ip_id);
+		p += 2;
+	}
+	if (flags & HEADER_FLAG_RTP) {
+		put_be16(p, layout.rtp_sequence);
+		put_be32(p + 2, layout.rtp_timestamp);
+		p += 6;
+	}
+	if (flags & HEADER_FLAG_UDP_CHECKSUM) {
+		put_be16(p, get_be16(udp + 6));
+		p += 2;
+	}
+	ctx->ip_id = layout.ip_id;
+	ctx->rtp_sequence = layout.rtp_sequence;
+	ctx->rtp_timestamp = layout.rtp_timestamp;
+	ctx->since_refresh++;
+
+	/* The fields are always shorter than the headers they replace */
+	size_t fields_len = p - fields;
+	memcpy(data, fields, fields_len);
+	memmove(data + fields_len, data + layout.len, len - layout.len);
+	*out_len = fields_len + len - layout.len;
+	return FRAME_TYPE_HEADER_PACKET;
+}
+
+int header_decompressor_init(struct header_decompressor *decompressor,
+	unsigned link, size_t max_payload)
+{
+	memset(decompressor, 0, sizeof(*decompressor));
+	decompressor->link = link;
+	decompressor->cap = HEADER_MAX_LEN + max_payload;
+	decompressor->buf = malloc(decompressor->cap);
+	return (decompressor->buf == NULL ? ENOMEM : 0);
+}
+
+void header_decompressor_free(struct header_decompressor *decompressor)
+{
+	free(decompressor->buf);
+	decompressor->buf = NULL;
+}
+
+static int read_context(struct header_decompressor *decompressor,
+	const uint8_t *payload, size_t len, const uint8_t **data,
+	size_t *data_len)
+{
+	if (len < HEADER_CONTEXT_PREFIX_LEN)
+		return EINVAL;
+	struct header_context *ctx = &decompressor->contexts[payload[0]];
+	const uint8_t *packet = payload + HEADER_CONTEXT_PREFIX_LEN;
+	size_t packet_len = len - HEADER_CONTEXT_PREFIX_LEN;
+	struct packet_info info;
+	ctx->valid = 0;
+	if (packet_parse(packet, packet_len, decompressor->link, &info) != 0 ||
+		get_layout(packet, packet_len, &info, ctx) != 0)
+		return EINVAL;
+	mask_header(ctx, packet, ctx->header);
+	load_fields(ctx, packet);
+	ctx->timestamp_stride = get_be32(payload + 1);
+	ctx->valid = 1;
+	*data = packet;
+	*data_len = packet_len;
+	return 0;
+}
+
+static int read_packet(struct header_decompressor *decompressor,
+	const uint8_t *payload, size_t len, const uint8_t **data,
+	size_t *data_len)
+{
+	if (len < 3)
+		return EINVAL;
+	struct header_context *ctx = &decompressor->contexts[payload[0]];
+	uint8_t flags = payload[1];
+	if (!ctx->valid)
+		return ENOENT;
+	size_t fields_len = 3 + ((flags & HEADER_FLAG_IP_ID) ? 2 : 0) +
+		((flags & HEADER_FLAG_RTP) ? 6 : 0) +
+		((flags & HEADER_FLAG_UDP_CHECKSUM) ? 2 : 0);
+	if (len < fields_len || ctx->len + len - fields_len > decompressor->cap)
+		return EINVAL;
+	/* Fields of another kind of flow: its context id was taken over and
+	 * the new context lost, until it is sent again */
+	if (((flags & HEADER_FLAG_IP_ID) && ctx->family != 4) ||
+		((flags & (HEADER_FLAG_RTP | HEADER_FLAG_RTP_MARKER)) && !ctx->rtp)) {
+		ctx->valid = 0;
+		return ENOENT;
+	}
+
+	const uint8_t *p = payload + 3;
+	uint16_t ip_id = 0;
+	uint16_t sequence = 0;
+	uint32_t timestamp = 0;
+	if (flags & HEADER_FLAG_IP_ID) {
+		ip_id = get_be16(p);
+		p += 2;
+	}
+	if (ctx->rtp) {
+		if (flags & HEADER_FLAG_RTP) {
+			sequence = get_be16(p);
+			timestamp = get_be32(p + 2);
+			p += 6;
+		} else {
+			sequence = lsb_decode(ctx->rtp_sequence,
+				flags & HEADER_FLAG_LSB_MASK);
+			timestamp = ctx->rtp_timestamp + ctx->timestamp_stride *
+				(uint16_t)(sequence - ctx->rtp_sequence);
+		}
+		if (!(flags & HEADER_FLAG_IP_ID))
+			ip_id = ctx->ip_id + (uint16_t)(sequence - ctx->rtp_sequence);
+	} else if (!(flags & HEADER_FLAG_IP_ID)) {
+		ip_id = lsb_decode(ctx->ip_id, flags & HEADER_FLAG_LSB_MASK);
+	}
+	uint16_t udp_checksum = 0;
+	if (flags & HEADER_FLAG_UDP_CHECKSUM)
+		udp_checksum = get_be16(p);
+
+	uint8_t *out = decompressor->buf;
+	size_t out_len = ctx->len + len - fields_len;
+	memcpy(out, ctx->header, ctx->len);
+	memcpy(out + ctx->len, payload + fields_len, len - fields_len);
+	uint8_t *ip = out + ctx->l3_off;
+	if (ctx->family == 4) {
+		put_be16(ip + 2, out_len - ctx->l3_off);
+		put_be16(ip + 4, ip_id);
+		put_be16(ip + 10, ipv4_header_checksum(ip, ctx->l4_off - ctx->l3_off));
+	} else {
+		put_be16(ip + 4, out_len - ctx->l3_off - IPV6_HEADER_LEN);
+	}
+	uint8_t *udp = out + ctx->l4_off;
+	put_be16(udp + 4, out_len - ctx->l4_off);
+	put_be16(udp + 6, udp_checksum);
+	if (ctx->rtp) {
+		uint8_t *rtp = udp + UDP_HEADER_LEN;
+		if (flags & HEADER_FLAG_RTP_MARKER)
+			rtp[1] |= 0x80;
+		put_be16(rtp + 2, sequence);
+		put_be32(rtp + 4, timestamp);
+	}
+	/* A context taken over by another flow whose new context was lost, or
+	 * values guessed wrong after a longer loss, until it is sent again */
+	if (header_check(out, ctx->len) != payload[2]) {
+		ctx->valid = 0;
+		return ENOENT;
+	}
+	ctx->ip_id = ip_id;
+	ctx->rtp_sequence = sequence;
+	ctx->rtp_timestamp = timestamp;
+	*data = out;
+	*data_len = out_len;
+	return 0;
+}
+
+int header_decompress(struct header_decompressor *decompressor, uint8_t type,
+	const uint8_t *payload, size_t len, const uint8_t **data,
+	size_t *data_len)
+{
+	if (type == FRAME_TYPE_HEADER_CONTEXT)
+		return read_context(decompressor, payload, len, data, data_len);
+	return read_packet(decompressor, payload, len, data, data_len);
+}
@@ -0,0 +1,104 @@
+#ifndef HEADER_H
+#define HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "flow.h"
+#include "packet.h"
+
+/* Compression of IPv4/IPv6 + UDP (+ RTP) headers of packet frames, in the
+ * spirit of ROHC (RFC 5795) but much simpler. Each flow gets a context,
+ * which the compressor sends in full in a FRAME_TYPE_HEADER_CONTEXT frame:
+ *
+ *   u8 context id, u32 RTP timestamp stride, packet
+ *
+ * Following packets of the flow whose headers only differ from the
+ * context in fields which are expected to change go in
+ * FRAME_TYPE_HEADER_PACKET frames:
+ *
+ *   u8 context id, u8 flags, u8 check, fields selected by flags,
+ *   packet payload
+ *
+ * Lengths and the IPv4 header checksum are recomputed by the receiver.
+ * The check is the low byte of the CRC-32C of the headers, which the
+ * receiver drops the packet on if its rebuilt ones do not match.
+ * The IPv4 ID, and RTP sequence number and timestamp, are sent only when
+ * they do not follow the previous packet of the flow. The low 4 bits of
+ * the flags hold those of the RTP sequence number (or of the IPv4 ID
+ * without RTP), so that a receiver which missed up to 12 packets of a
+ * flow still rebuilds the right values. Contexts are sent again every
+ * HEADER_REFRESH_PACKETS packets, so that a receiver recovers from any
+ * longer loss. Integers are big-endian, like in the headers they replace. */
+
+#define HEADER_CONTEXTS 256
+/* Room needed after a packet being compressed in place */
+#define HEADER_CONTEXT_PREFIX_LEN 5
+/* Layer 2, IP with options or extension headers, UDP and RTP */
+#define HEADER_MAX_LEN 128
+
+#ifndef HEADER_REFRESH_PACKETS
+#define HEADER_REFRESH_PACKETS 64
+#endif
+
+#define HEADER_FLAG_LSB_MASK 0x0f
+#define HEADER_FLAG_IP_ID 0x10       /* u16 IPv4 ID */
+#define HEADER_FLAG_RTP 0x20         /* u16 sequence, u32 timestamp */
+#define HEADER_FLAG_UDP_CHECKSUM 0x40  /* u16 checksum, zero if absent */
+#define HEADER_FLAG_RTP_MARKER 0x80
+
+struct header_context {
+	uint8_t header[HEADER_MAX_LEN];  /* with changing fields zeroed */
+	uint8_t len;                     /* up to the end of UDP or RTP */
+	uint8_t l3_off;
+	uint8_t l4_off;
+	uint8_t family;
+	uint8_t rtp;
+	uint8_t valid;
+	uint16_t ip_id;
+	uint16_t rtp_sequence;
+	uint32_t rtp_timestamp;
+	uint32_t timestamp_stride;       /* per RTP sequence number */
+	/* Compressor side */
+	uint32_t next_stride;            /* timestamp delta seen once */
+	uint32_t since_refresh;
+};
+
+struct header_compressor {
+	unsigned link;
+	/* Flows are tagged with the id of their context */
+	struct flow_table flows;
+	uint32_t next_id;
+	struct header_context contexts[HEADER_CONTEXTS];
+};
+
+struct header_decompressor {
+	unsigned link;
+	struct header_context contexts[HEADER_CONTEXTS];
+	/* Rebuilt packets */
+	uint8_t *buf;
+	size_t cap;
+};
+
+int header_compressor_init(struct header_compressor *compressor,
+	unsigned link);
+void header_compressor_free(struct header_compressor *compressor);
+/* Compresses a packet parsed into info in place, given room for
+ * HEADER_CONTEXT_PREFIX_LEN more bytes after it. Returns the frame type to
+ * send the result with, which is FRAME_TYPE_PACKET for an unchanged
+ * packet, and its length in *out_len. */
+uint8_t header_compress(struct header_compressor *compressor, uint8_t *data,
+	size_t len, const struct packet_info *info, uint64_t now_ns,
+	size_t *out_len);
+
+/* Compressed payloads are at most max_payload bytes */
+int header_decompressor_init(struct header_decompressor *decompressor,
+	unsigned link, size_t max_payload);
+void header_decompressor_free(struct header_decompressor *decompressor);
+/* Rebuilds the packet of a FRAME_TYPE_HEADER_* frame. Returns ENOENT if
+ * its context has not been received or does not match it, EINVAL if it
+ * is malformed. */
+int header_decompress(struct header_decompressor *decompressor, uint8_t type,
+	const uint8_t *payload, size_t len, const uint8_t **data,
+	size_t *data_len);
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "ipfix.h"
+#include "util.h"
+
+#define IPFIX_VERSION 10
+#define IPFIX_HEADER_LEN 16
+#define IPFIX_SET_HEADER_LEN 4
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_TEMPLATE_V4 256
+#define IPFIX_TEMPLATE_V6 257
+/* Keeps messages within a UDP datagram on a 1500B path */
+#define IPFIX_MESSAGE_LEN 1400
+/* Collectors over UDP may miss templates, send them again regularly */
+#define IPFIX_TEMPLATE_INTERVAL_NS (30 * 1000000000ULL)
+
+#define REASON_IDLE 1
+#define REASON_ACTIVE 2
+#define REASON_END 3
+#define REASON_FORCED 4
+
+#define RECORD_V4_LEN (4 + 4 + 1 + 2 + 2 + 8 + 8 + 8 + 8 + 2 + 1)
+#define RECORD_V6_LEN (RECORD_V4_LEN - 8 + 32)
+
+/* Information elements, in record order, with the addresses first */
+static const uint16_t common_fields[][2] = {
+	{ 4, 1 },   /* protocolIdentifier */
+	{ 7, 2 },   /* sourceTransportPort */
+	{ 11, 2 },  /* destinationTransportPort */
+	{ 2, 8 },   /* packetDeltaCount */
+	{ 1, 8 },   /* octetDeltaCount */
+	{ 152, 8 }, /* flowStartMilliseconds */
+	{ 153, 8 }, /* flowEndMilliseconds */
+	{ 6, 2 },   /* tcpControlBits */
+	{ 136, 1 }, /* flowEndReason */
+};
+
+struct ipfix_meter {
+	unsigned link;
+	uint64_t idle_ns;
+	uint64_t active_ns;
+	struct flow_table table;
+	/* Flows ended by FIN/RST, exported on the next expiry */
+	int ended;
+	int fd;
+	int is_udp;
+	/* Data records exported in all, and before the message being built */
+	uint32_t sequence;
+	uint32_t msg_sequence;
+	uint64_t template_ns;
+	uint8_t msg[IPFIX_MESSAGE_LEN];
+	size_t msg_len;
+	size_t set_start;
+	uint16_t set_id;
+	unsigned long long exported;
+	unsigned long long untracked;
+};
+
+static void close_set(struct ipfix_meter *meter)
+{
+	if (meter->set_id == 0)
+		return;
+	put_be16(meter->msg + meter->set_start + 2,
+		meter->msg_len - meter->set_start);
+	meter->set_id = 0;
+}
+
+static int send_message(struct ipfix_meter *meter, uint64_t now_ns)
+{
+	close_set(meter);
+	if (meter->msg_len <= IPFIX_HEADER_LEN)
+		return 0;
+	put_be16(meter->msg, IPFIX_VERSION);
+	put_be16(meter->msg + 2, meter->msg_len);
+	put_be32(meter->msg + 4, now_ns / 1000000000ULL);
+	put_be32(meter->msg + 8, meter->msg_sequence);
+	put_be32(meter->msg + 12, 0);
+
+	int res = 0;
+	if (meter->is_udp) {
+		/* Nobody listening is not an error for a UDP exporter */
+		if (send(meter->fd, meter->msg, meter->msg_len, 0) < 0 &&
+			errno != ECONNREFUSED)
+			res = errno;
+	} else {
+		res = write_all(meter->fd, meter->msg, meter->msg_len);
+	}
+	if (res != 0)
+		fprintf(stderr, "Error: unable to export flows: %s\n",
+			strerror(res));
+	meter->msg_len = IPFIX_HEADER_LEN;
+	meter->msg_sequence = meter->sequence;
+	return res;
+}
+
+/* Makes room for len bytes in a set with the given id */
+static int reserve(struct ipfix_meter *meter, uint16_t set_id, size_t len,
+	uint64_t now_ns)
+{
+	size_t need = len + (meter->set_id == set_id ? 0 : IPFIX_SET_HEADER_LEN);
+	if (meter->msg_len + need > IPFIX_MESSAGE_LEN) {
+		int res = send_message(meter, now_ns);
+		if (res != 0)
+			return res;
+	}
+	if (meter->set_id != set_id) {
+		close_set(meter);
+		meter->set_start = meter->msg_len;
+		meter->set_id = set_id;
+		put_be16(meter->msg + meter->msg_len, set_id);
+		meter->msg_len += IPFIX_SET_HEADER_LEN;
+	}
+	return 0;
+}
+
+static size_t put_template(uint8_t *p, uint16_t id, uint16_t addr_ie_src,
+	uint16_t addr_ie_dst, uint16_t addr_len)
+{
+	size_t count = sizeof(common_fields) / sizeof(common_fields[0]);
+	put_be16(p, id);
+	put_be16(p + 2, count + 2);
+	put_be16(p + 4, addr_ie_src);
+	put_be16(p + 6, addr_len);
+	put_be16(p + 8, addr_ie_dst);
+	put_be16(p + 10, addr_len);
+	for (size_t i = 0; i < count; i++) {
+		put_be16(p + 12 + 4 * i, common_fields[i][0]);
+		put_be16(p + 14 + 4 * i, common_fields[i][1]);
+	}
+	return 12 + 4 * count;
+}
+
+static int send_templates(struct ipfix_meter *meter, uint64_t now_ns)
+{
+	uint8_t buf[2 * (12 + 4 * sizeof(common_fields) /
+		sizeof(common_fields[0]))];
+	size_t len = put_template(buf, IPFIX_TEMPLATE_V4, 8, 12, 4);
+	len += put_template(buf + len, IPFIX_TEMPLATE_V6, 27, 28, 16);
+	int res = reserve(meter, IPFIX_TEMPLATE_SET, len, now_ns);
+	if (res != 0)
+		return res;
+	memcpy(meter->msg + meter->msg_len, buf, len);
+	meter->msg_len += len;
+	meter->template_ns = now_ns;
+	return 0;
+}
+
+static int export_flow(struct ipfix_meter *meter, const struct flow *flow,
+	uint8_t reason, uint64_t now_ns)
+{
+	int v6 = (flow->key.family == 6);
+	size_t addr_len = (v6 ? 16 : 4);
+	int res = 0;
+
+	if (meter->template_ns == 0 || (meter->is_udp &&
+		now_ns - meter->template_ns > IPFIX_TEMPLATE_INTERVAL_NS))
+		res = send_templates(meter, now_ns);
+	if (res == 0)
+		res = reserve(meter, v6 ? IPFIX_TEMPLATE_V6 : IPFIX_TEMPLATE_V4,
+			v6 ? RECORD_V6_LEN : RECORD_V4_LEN, now_ns);
+	if (res != 0)
+		return res;
+
+	uint8_t *p = meter->msg + meter->msg_len;
+	memcpy(p, flow->key.src, addr_len);
+	memcpy(p + addr_len, flow->key.dst, addr_len);
+	p += 2 * addr_len;
+	p[0] = flow->key.proto;
+	put_be16(p + 1, flow->key.sport);
+	put_be16(p + 3, flow->key.dport);
+	put_be64(p + 5, flow->packets);
+	put_be64(p + 13, flow->bytes);
+	put_be64(p + 21, flow->first_ns / 1000000);
+	put_be64(p + 29, flow->last_ns / 1000000);
+	put_be16(p + 37, flow->tcp_flags);
+	p[39] = reason;
+	meter->msg_len += (v6 ? RECORD_V6_LEN : RECORD_V4_LEN);
+	meter->sequence++;
+	meter->exported++;
+	return 0;
+}
+
+static int open_collector(struct ipfix_meter *meter, const char *spec)
+{
+	char host[256];
+	const char *port = strrchr(spec, ':');
+	if (port == NULL || (size_t)(port - spec) >= sizeof(host)) {
+		fprintf(stderr, "Error: invalid collector, expected udp:HOST:PORT\n");
+		return EINVAL;
+	}
+	memcpy(host, spec, port - spec);
+	host[port - spec] = '\0';
+	port++;
+
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	int err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "Error: unable to resolve collector: %s\n",
+			gai_strerror(err));
+		return EINVAL;
+	}
+	meter->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (meter->fd < 0 || connect(meter->fd, res->ai_addr, res->ai_addrlen)) {
+		err = errno;
+		perror("collector socket");
+		freeaddrinfo(res);
+		return err;
+	}
+	freeaddrinfo(res);
+	meter->is_udp = 1;
+	return 0;
+}
+
+int ipfix_meter_open(struct ipfix_meter **meter, const char *dest,
+	unsigned link, uint64_t idle_ns, uint64_t active_ns)
+{
+	if (meter == NULL || dest == NULL)
+		return EINVAL;
+	struct ipfix_meter *m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return ENOMEM;
+	m->fd = -1;
+	m->link = link;
+	m->idle_ns = idle_ns;
+	m->active_ns = active_ns;
+	m->msg_len = IPFIX_HEADER_LEN;
+
+	int res = flow_table_init(&m->table, IPFIX_MAX_FLOWS);
+	if (res == 0 && strncmp(dest, "udp:", 4) == 0) {
+		res = open_collector(m, dest + 4);
+	} else if (res == 0) {
+		m->fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m->fd < 0) {
+			res = errno;
+			fprintf(stderr, "Error: unable to open flow file %s\n", dest);
+			perror("open()");
+		}
+	}
+	if (res != 0) {
+		if (m->fd >= 0)
+			close(m->fd);
+		flow_table_free(&m->table);
+		free(m);
+		return res;
+	}
+	*meter = m;
+	return 0;
+}
+
+void ipfix_meter_add(struct ipfix_meter *meter, const uint8_t *data,
+	size_t len, uint64_t now_ns)
+{
+	struct packet_info info;
+	struct flow_key key;
+	if (packet_parse(data, len, meter->link, &info) != 0)
+		return;
+	flow_key_from_packet(&info, &key);
+	uint32_t hash = flow_key_hash(&key);
+	struct flow *flow = flow_table_get(&meter->table, &key, hash, 1);
+	if (flow == NULL) {
+		meter->untracked++;
+		return;
+	}
+	if (flow->packets == 0)
+		flow->first_ns = now_ns;
+	flow->last_ns = now_ns;
+	flow->packets++;
+	flow->bytes += len - info.l3_off;
+	flow->tcp_flags |= info.tcp_flags;
+	if (info.tcp_flags & (PACKET_TCP_FIN | PACKET_TCP_RST))
+		meter->ended = 1;
+}
+
+static int expire(struct ipfix_meter *meter, uint64_t now_ns, int force)
+{
+	int res = 0;
+	size_t i = 0;
+	while (res == 0 && i <= meter->table.mask) {
+		struct flow *flow = &meter->table.slots[i];
+		uint8_t reason = 0;
+		if (!flow->used) {
+			i++;
+			continue;
+		}
+		if (force)
+			reason = REASON_FORCED;
+		else if (now_ns - flow->last_ns >= meter->idle_ns)
+			reason = REASON_IDLE;
+		else if (meter->ended &&
+			(flow->tcp_flags & (PACKET_TCP_FIN | PACKET_TCP_RST)))
+			reason = REASON_END;
+		else if (now_ns - flow->first_ns >= meter->active_ns)
+			reason = REASON_ACTIVE;
+
+		if (reason == REASON_ACTIVE) {
+			/* Long-lived flows are reported in slices */
+			res = export_flow(meter, flow, reason, now_ns);
+			flow->packets = flow->bytes = 0;
+			flow->first_ns = flow->last_ns = now_ns;
+			i++;
+		} else if (reason != 0) {
+			/* A slice already reported all of its packets */
+			if (flow->packets > 0)
+				res = export_flow(meter, flow, reason, now_ns);
+			flow_table_remove(&meter->table, flow);
+		} else {
+			i++;
+		}
+	}
+	meter->ended = 0;
+	if (res == 0)
+		res = send_message(meter, now_ns);
+	return res;
+}
+
+int ipfix_meter_expire(struct ipfix_meter *meter, uint64_t now_ns)
+{
+	return expire(meter, now_ns, 0);
+}
+
+void ipfix_meter_print(FILE *f, const struct ipfix_meter *meter)
+{
+	fprintf(f, "flows: %zu active, %llu exported, %llu packets untracked\n",
+		meter->table.count, meter->exported, meter->untracked);
+}
+
+int ipfix_meter_close(struct ipfix_meter *meter)
+{
+	if (meter == NULL)
+		return EINVAL;
+	int res = expire(meter, now_ns(CLOCK_REALTIME), 1);
+	close(meter->fd);
+	flow_table_free(&meter->table);
+	free(meter);
+	return res;
+}
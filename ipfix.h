@@ -0,0 +1,30 @@
+#ifndef IPFIX_H
+#define IPFIX_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "flow.h"
+
+/* Flow metering and export as IPFIX (RFC 7011) messages, to a file or to
+ * a UDP collector. Flows are exported once idle for idle_ns, every
+ * active_ns while active, after a TCP FIN/RST, and on exit. */
+
+#ifndef IPFIX_MAX_FLOWS
+#define IPFIX_MAX_FLOWS 65536
+#endif
+
+struct ipfix_meter;
+
+/* dest is a path, or udp:HOST:PORT */
+int ipfix_meter_open(struct ipfix_meter **meter, const char *dest,
+	unsigned link, uint64_t idle_ns, uint64_t active_ns);
+void ipfix_meter_add(struct ipfix_meter *meter, const uint8_t *data,
+	size_t len, uint64_t now_ns);
+/* Exports flows which timed out, to be called about once a second */
+int ipfix_meter_expire(struct ipfix_meter *meter, uint64_t now_ns);
+void ipfix_meter_print(FILE *f, const struct ipfix_meter *meter);
+/* Exports all remaining flows */
+int ipfix_meter_close(struct ipfix_meter *meter);
+
+#endif
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include "aead.h"
+#include "ktls.h"
+#include "util.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+static int is_tcp_socket(int fd)
+{
+	int protocol = 0;
+	socklen_t len = sizeof(protocol);
+	if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) != 0)
+		return 0;
+	return (protocol == IPPROTO_TCP);
+}
+
+static int same_socket(int a, int b)
+{
+	struct stat sa, sb;
+	if (fstat(a, &sa) != 0 || fstat(b, &sb) != 0)
+		return 0;
+	return (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+}
+
+static int set_ulp(int fd)
+{
+	if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0)
+		return 0;
+	int res = errno;
+	if (res == ENOENT)
+		fprintf(stderr, "Error: the kernel does not support TLS sockets"
+			" (modprobe tls)\n");
+	else
+		perror("setsockopt(TCP_ULP)");
+	return res;
+}
+
+/* The key and IV of a direction come from the random bytes of both
+ * sides, the sender's first, so that records are only accepted in the
+ * connection and direction they were sent in */
+static int set_crypto(int fd, int direction, const uint8_t *secret,
+	const uint8_t *sender, const uint8_t *receiver)
+{
+	struct tls12_crypto_info_chacha20_poly1305 info;
+	memset(&info, 0, sizeof(info));
+	info.info.version = TLS_1_3_VERSION;
+	info.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+	uint8_t material[sizeof(info.key) + sizeof(info.iv)];
+	uint8_t half[KTLS_SECRET_LEN];
+	aead_derive(secret, sender, half, sizeof(half));
+	aead_derive(half, receiver, material, sizeof(material));
+	memset(half, 0, sizeof(half));
+	memcpy(info.key, material, sizeof(info.key));
+	memcpy(info.iv, material + sizeof(info.key), sizeof(info.iv));
+	int res = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+	res = (res == 0 ? 0 : errno);
+	memset(material, 0, sizeof(material));
+	memset(&info, 0, sizeof(info));
+	if (res != 0)
+		perror(direction == TLS_TX ? "setsockopt(TLS_TX)" :
+			"setsockopt(TLS_RX)");
+	return res;
+}
+
+int ktls_enable(int in_fd, int out_fd, const uint8_t *secret)
+{
+	if (in_fd < 0 || out_fd < 0 || !is_tcp_socket(in_fd) ||
+		!is_tcp_socket(out_fd)) {
+		fprintf(stderr, "Error: --ktls requires stdin and stdout to be TCP"
+			" connections\n");
+		return ENOTSOCK;
+	}
+	int shared = same_socket(in_fd, out_fd);
+	int res = set_ulp(out_fd);
+	if (res == 0 && !shared)
+		res = set_ulp(in_fd);
+	if (res != 0)
+		return res;
+
+	uint8_t local[KTLS_RANDOM_LEN];
+	uint8_t remote[KTLS_RANDOM_LEN];
+	if (getrandom(local, sizeof(local), 0) != sizeof(local)) {
+		perror("getrandom()");
+		return EIO;
+	}
+	res = write_all(out_fd, local, sizeof(local));
+	/* Not one byte more: TLS records follow, which the kernel must see
+	 * from their start */
+	if (res == 0)
+		res = read_exact(in_fd, remote, sizeof(remote), NULL);
+	if (res != 0) {
+		fprintf(stderr, "Error: unable to exchange TLS parameters with the"
+			" peer: %s\n", strerror(res));
+		return res;
+	}
+	/* Our own bytes coming back mean the stream loops back to us, and
+	 * that everything we send would be accepted as coming from the peer */
+	if (memcmp(local, remote, sizeof(local)) == 0) {
+		fprintf(stderr, "Error: the TLS peer echoes what it receives\n");
+		return EINVAL;
+	}
+	res = set_crypto(out_fd, TLS_TX, secret, local, remote);
+	if (res == 0)
+		res = set_crypto(in_fd, TLS_RX, secret, remote, local);
+	return res;
+}
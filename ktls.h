@@ -0,0 +1,24 @@
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <stdint.h>
+#include "aead.h"
+
+/* Kernel TLS (TCP_ULP "tls") on stdin/stdout when they are TCP
+ * connections to another tuncat, so that the kernel encrypts and
+ * authenticates the stream in the write() and read() tuncat already does.
+ * There is no handshake: each side sends KTLS_RANDOM_LEN random bytes in
+ * clear, and the key and IV of each direction of the connection are
+ * derived from a pre-shared secret and the random bytes of both sides,
+ * its sender's first.
+ * Records are TLS 1.3 ChaCha20-Poly1305. */
+
+#define KTLS_SECRET_LEN AEAD_KEY_LEN
+#define KTLS_RANDOM_LEN 12
+
+/* Exchanges random bytes with the peer and sets up transmit on out_fd and
+ * receive on in_fd, which can be the same socket. Returns ENOTSOCK if
+ * either is not a TCP connection, ENOENT if the kernel has no TLS. */
+int ktls_enable(int in_fd, int out_fd, const uint8_t *secret);
+
+#endif
@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, uint8_t *token,
+	const uint8_t *lit, size_t len)
+{
+	*token = (len >= 15 ? 15 : len) << 4;
+	if (len >= 15)
+		op = put_length(op, len - 15);
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+size_t lz4_compress_block(const uint8_t *src, size_t src_len,
+	uint8_t *dst, size_t dst_cap)
+{
+	uint32_t table[1 << LZ4_HASH_LOG];
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_cap;
+	size_t lit = 0;
+
+	if (src_len > LZ4_MFLIMIT) {
+		const uint8_t *mflimit = iend - LZ4_MFLIMIT;
+		const uint8_t *matchlimit = iend - LZ4_LASTLITERALS;
+		unsigned misses = 0;
+		memset(table, 0, sizeof(table));
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t *ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+				read32(ref) != seq) {
+				/* Skip faster through incompressible data */
+				ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *mp = ip + LZ4_MINMATCH;
+			const uint8_t *rp = ref + LZ4_MINMATCH;
+			while (mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			lit = ip - anchor;
+			size_t mlen = mp - ip - LZ4_MINMATCH;
+			if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1 +
+				2 + mlen / 255 + 1)
+				return 0;
+			uint8_t *token = op++;
+			op = put_literals(op, token, anchor, lit);
+			size_t offset = ip - ref;
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+			*token |= (mlen >= 15 ? 15 : mlen);
+			if (mlen >= 15)
+				op = put_length(op, mlen - 15);
+			ip = anchor = mp;
+			if (ip < mflimit)
+				table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+		}
+	}
+
+	lit = iend - anchor;
+	if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1)
+		return 0;
+	uint8_t *token = op++;
+	op = put_literals(op, token, anchor, lit);
+	return op - dst;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend)
+			return EINVAL;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz4_decompress_block(const uint8_t *src, size_t src_len,
+	uint8_t *dst, size_t dst_cap, size_t *out_len)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && get_length(&ip, iend, &lit) != 0)
+			return EINVAL;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return EINVAL;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return EINVAL;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return EINVAL;
+		size_t mlen = token & 15;
+		if (mlen == 15 && get_length(&ip, iend, &mlen) != 0)
+			return EINVAL;
+		mlen += LZ4_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return EINVAL;
+		const uint8_t *ref = op - offset;
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen-- > 0)
+				*op++ = *ref++;
+		}
+	}
+	*out_len = op - dst;
+	return 0;
+}
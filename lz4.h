@@ -0,0 +1,22 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimal codec for the LZ4 block format, so that compressed captures and
+ * streams can be produced and read without an external dependency. Output
+ * is compatible with LZ4_decompress_safe() from the reference library. */
+
+/* Worst-case compressed size for an input of n bytes */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Returns the compressed length, or 0 if it would not fit in dst_cap */
+size_t lz4_compress_block(const uint8_t *src, size_t src_len,
+	uint8_t *dst, size_t dst_cap);
+
+/* Returns 0 and sets *out_len, or EINVAL on malformed/oversized input */
+int lz4_decompress_block(const uint8_t *src, size_t src_len,
+	uint8_t *dst, size_t dst_cap, size_t *out_len);
+
+#endif
@@ -1,10 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
-#define __USE_POSIX
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <pwd.h>
@@ -14,6 +16,23 @@
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include "aead.h"
+#include "capture.h"
+#include "fanout.h"
+#include "fec.h"
+#include "filter.h"
+#include "generate.h"
+#include "ktls.h"
+#include "merge.h"
+#include "packet.h"
+#include "reflect.h"
+#include "route.h"
+#include "sample.h"
+#include "scan.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "udp.h"
+#include "util.h"
 
 #define STR(x) #x
 #define UNUSED(x) (void)(x)
@@ -22,12 +41,59 @@
 #define DEFAULT_BUFFER_LEN 65536
 #endif
 
-static volatile int interrupt_flag = 0;
-static int verbosity = 0;
+enum {
+	OPT_FROM = 256,
+	OPT_TO,
+	OPT_EXPORT,
+	OPT_FILTER,
+	OPT_COUNT,
+	OPT_SAMPLE,
+	OPT_SKETCH,
+	OPT_FLOWS,
+	OPT_FLOW_TIMEOUT,
+	OPT_GENERATE,
+	OPT_REFLECT,
+	OPT_PROBE,
+	OPT_SEQUENCE,
+	OPT_BATCH,
+	OPT_METADATA,
+	OPT_CRC,
+	OPT_COMPRESS,
+	OPT_COMPRESS_HEADERS,
+	OPT_ENCRYPT,
+	OPT_KTLS,
+	OPT_UDP,
+	OPT_FEC,
+	OPT_PACE,
+	OPT_STRIPE,
+	OPT_TEE,
+	OPT_BALANCE,
+	OPT_CHANNELS,
+	OPT_ROUTES,
+	OPT_SWITCH,
+};
+
+volatile sig_atomic_t interrupt_flag = 0;
+volatile sig_atomic_t stats_flag = 0;
+volatile sig_atomic_t reload_flag = 0;
+int verbosity = 0;
 
 void print_usage(FILE *f)
 {
-	fprintf(f, "Usage: tuncat [-i tunX] [-b bufferlen] [-v] [-e] [-f] [-p]\n");
+	fprintf(f, "Usage: tuncat [-i tunX] [-b bufferlen] [-v] [-e] [-f] [-p] [-F]\n");
+	fprintf(f, "              [--sample=[count:|random:|flow:]N] [--sketch[=K]]\n");
+	fprintf(f, "              [--flows=file|udp:host:port [--flow-timeout=idle[:active]]]\n");
+	fprintf(f, "              [-F [--probe[=ms]] [--sequence] [--batch|--metadata]\n");
+	fprintf(f, "                  [--crc] [--compress] [--compress-headers]\n");
+	fprintf(f, "                  [--encrypt=keyfile]] [--ktls=keyfile]\n");
+	fprintf(f, "              [-F --udp=port:host:port... [--stripe=round-robin|flow]\n");
+	fprintf(f, "                  [--fec[=k[:r]]] [--pace=rate]]\n");
+	fprintf(f, "              [-F --channels=N] [--routes=file | -e --switch]\n");
+	fprintf(f, "              [-w capture] [--tee=dest[,queue=N][,drop=newest|oldest]...]\n");
+	fprintf(f, "              [--balance=dest[,queue=N][,drop=newest|oldest]...]\n");
+	fprintf(f, "              [-r capture [--from=t] [--to=t] [--export]]\n");
+	fprintf(f, "              [-r capture... [--export|--count] [-j threads]] [--filter=expr]\n");
+	fprintf(f, "              [--generate[=key=value,...] | --reflect]\n");
 	fprintf(f, "\n");
 	fprintf(f, "  -v, --verbose         increase verbosity (can be repeated)\n");
 	fprintf(f, "  -i, --interface=tunX  use a (possibly existing) tun interface\n");
@@ -37,12 +103,85 @@ void print_usage(FILE *f)
 	fprintf(f, "  -u, --user=[id|name]  set the device owner (default is euid)\n");
 	fprintf(f, "  -g, --group=[id|name] set the device group (default is egid)\n");
 	fprintf(f, "  -b, --buffer=bytes    override default " STR(DEFAULT_BUFFER_LEN) "B buffer size\n");
+	fprintf(f, "  -F, --framed          prefix packets on stdin/stdout with a frame header\n");
+	fprintf(f, "      --batch           send each batch of packets read in a single frame\n");
+	fprintf(f, "      --metadata        add the read time and flow hash of packets to frames\n");
+	fprintf(f, "      --compress        compress batches of frames with LZ4, unless they\n");
+	fprintf(f, "                        turn out to be incompressible\n");
+	fprintf(f, "      --compress-headers\n");
+	fprintf(f, "                        send only what changes in IP/UDP/RTP headers from\n");
+	fprintf(f, "                        one packet of a flow to the next\n");
+	fprintf(f, "      --encrypt=keyfile encrypt and authenticate batches of frames with\n");
+	fprintf(f, "                        ChaCha20-Poly1305, with the key of keyfile (32\n");
+	fprintf(f, "                        bytes, or 64 hex digits), dropping anything else\n");
+	fprintf(f, "      --ktls=keyfile    have the kernel encrypt stdin/stdout, which must be\n");
+	fprintf(f, "                        TCP connections to another tuncat, with TLS records\n");
+	fprintf(f, "                        keyed from the secret in keyfile\n");
+	fprintf(f, "      --udp=port:host:port  exchange frames with the peer tuncat in UDP\n");
+	fprintf(f, "                        datagrams instead of on stdin/stdout, striped over\n");
+	fprintf(f, "                        several paths if repeated (up to 8)\n");
+	fprintf(f, "      --stripe=mode     send frames over each path in turn and put them back\n");
+	fprintf(f, "                        in order (round-robin, the default), or keep each\n");
+	fprintf(f, "                        flow on one path (flow)\n");
+	fprintf(f, "      --fec[=k[:r]]     send r parity frames after every k frames (default\n");
+	fprintf(f, "                        8, r adapting to losses), to rebuild lost ones\n");
+	fprintf(f, "      --pace=bits/s     space out datagrams sent at that rate (k, M or G\n");
+	fprintf(f, "                        suffix), with departure times for the fq qdisc\n");
+	fprintf(f, "      --channels=N      multiplex N devices (tunX0, tunX1...) over the same\n");
+	fprintf(f, "                        stream, packets of device i going to device i of\n");
+	fprintf(f, "                        the peer tuncat\n");
+	fprintf(f, "      --routes=file     send packets read from the devices to the device or\n");
+	fprintf(f, "                        peer channel of the longest prefix route of their\n");
+	fprintf(f, "                        destination, from lines 'prefix/len N|peer[:N]'\n");
+	fprintf(f, "                        of file (reloaded on SIGHUP)\n");
+	fprintf(f, "      --switch          forward ethernet frames between the tap devices and\n");
+	fprintf(f, "                        the peer by the port their destination was last\n");
+	fprintf(f, "                        seen on, and flood those to unknown addresses\n");
+	fprintf(f, "      --crc             protect frames with a CRC-32C, for the peer to skip\n");
+	fprintf(f, "                        corrupted ones instead of giving up\n");
+	fprintf(f, "      --sequence        number frames, for the peer to count losses (with -F)\n");
+	fprintf(f, "      --probe[=ms]      measure the round trip time to the peer tuncat every\n");
+	fprintf(f, "                        ms milliseconds (default 1000), in-band (with -F)\n");
+	fprintf(f, "      --sample=[mode:]N only forward and capture 1 in N packets, either\n");
+	fprintf(f, "                        every Nth (count), at random, or 1 in N flows\n");
+	fprintf(f, "      --sketch[=K]      estimate distinct addresses and flows, and the\n");
+	fprintf(f, "                        top K (default 10) sources, in constant memory\n");
+	fprintf(f, "      --flows=dest      export IPFIX flow records to a file or UDP collector\n");
+	fprintf(f, "      --flow-timeout=s[:s]  export flows idle (default 15s) or active\n");
+	fprintf(f, "                        (default 120s) for that many seconds\n");
+	fprintf(f, "  -w, --write=file      save packets read from the device to a capture file\n");
+	fprintf(f, "      --tee=dest        also send packets read from the device to a file,\n");
+	fprintf(f, "                        pipe or unix:path socket (as frames) or to\n");
+	fprintf(f, "                        udp:host:port, queueing up to N (default 256) and\n");
+	fprintf(f, "                        dropping the newest or oldest ones when it does not\n");
+	fprintf(f, "                        keep up (can be repeated)\n");
+	fprintf(f, "      --balance=dest    send each flow of packets read from the device to\n");
+	fprintf(f, "                        one of several outputs like those of --tee, by a\n");
+	fprintf(f, "                        hash which only moves flows of outputs that close\n");
+	fprintf(f, "  -r, --read=file       inject packets from a capture file into the device,\n");
+	fprintf(f, "                        several captures are merged by timestamp\n");
+	fprintf(f, "      --from=time       start reading the capture at a unix time (s[.ns])\n");
+	fprintf(f, "      --to=time         stop reading the capture at a unix time (s[.ns])\n");
+	fprintf(f, "      --export          write the captures to stdout as pcap, without device\n");
+	fprintf(f, "      --count           print packet counts of the captures, without device\n");
+	fprintf(f, "  -j, --threads=N       scan captures on N threads (default is one per CPU)\n");
+	fprintf(f, "      --filter=expr     only keep packets matching a pcap-filter(7) subset\n");
+	fprintf(f, "      --generate[=spec] write synthetic packets into the device, with spec\n");
+	fprintf(f, "                        settings proto=udp|tcp src=addr dst=addr sport=N\n");
+	fprintf(f, "                        dport=N flows=N size=imix|len[*weight][/...]\n");
+	fprintf(f, "                        rate=pps[k|M] count=N\n");
+	fprintf(f, "      --reflect         write packets back to the device with source and\n");
+	fprintf(f, "                        destination swapped, and answer pings\n");
 }
 
 void signal_handler(int signum)
 {
-	UNUSED(signum);
-	interrupt_flag = 1;
+	if (signum == SIGUSR1)
+		stats_flag = 1;
+	else if (signum == SIGHUP)
+		reload_flag = 1;
+	else
+		interrupt_flag = 1;
 }
 
 int setup_signal_handlers()
@@ -57,6 +196,16 @@ int setup_signal_handlers()
 		return res;
 
 	res = sigaction(SIGTERM, &act, NULL);
+	if (res != 0)
+		return res;
+
+	res = sigaction(SIGUSR1, &act, NULL);
+	if (res != 0)
+		return res;
+
+	/* Closed outputs are handled where they are written to */
+	act.sa_handler = SIG_IGN;
+	res = sigaction(SIGPIPE, &act, NULL);
 	return res;
 }
 
@@ -108,41 +257,110 @@ int get_gid_by_name(const char *name, gid_t *id)
 	return 0;
 }
 
-int infinite_loop(int tun_fd, size_t buffer_len)
+int parse_timestamp(const char *str, uint64_t *ts_ns)
 {
-	fd_set read_set;
-	fd_set write_set;
-	FD_ZERO(&read_set);
-	FD_ZERO(&write_set);
-	int res = 0;
-	int nfds = tun_fd + 1;
-	char *buffer = calloc(buffer_len, 1);
-	if (buffer == NULL)
-		return ENOMEM;
-
-	while (res == 0) {
-		FD_SET(tun_fd, &read_set);
-		FD_SET(STDIN_FILENO, &read_set);
-		FD_SET(STDOUT_FILENO, &write_set);
-		res = select(nfds, &read_set, &write_set, NULL, NULL);
-		if (res < 0) {
-			if (errno == EINTR) {
-				res = 0;
-				break;
-			}
-			perror("select()");
-			res = errno;
+	if (str == NULL || ts_ns == NULL)
+		return EINVAL;
+	char *endptr = NULL;
+	errno = 0;
+	unsigned long long secs = strtoull(str, &endptr, 10);
+	if (endptr == str || errno != 0 || secs > UINT64_MAX / 1000000000ULL) {
+		fprintf(stderr, "Error: invalid timestamp\n");
+		return EINVAL;
+	}
+	uint64_t nsecs = 0;
+	uint64_t scale = 100000000ULL;
+	if (*endptr == '.') {
+		for (endptr++; *endptr >= '0' && *endptr <= '9'; endptr++) {
+			nsecs += (*endptr - '0') * scale;
+			scale /= 10;
 		}
-		if (interrupt_flag != 0) {
-			fprintf(stderr, "Received interrupt, exiting\n");
+	}
+	if (*endptr != '\0') {
+		fprintf(stderr, "Error: invalid timestamp\n");
+		return EINVAL;
+	}
+	*ts_ns = secs * 1000000000ULL + nsecs;
+	return 0;
+}
+
+/* Reads a key file, holding either the raw key or its hex encoding */
+int read_key(const char *path, uint8_t *key)
+{
+	char buf[2 * AEAD_KEY_LEN + 3];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: unable to open key file %s\n", path);
+		perror("open()");
+		return errno;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf));
+	int res = (len < 0 ? errno : 0);
+	close(fd);
+	if (len < 0) {
+		perror("read(key)");
+		return res;
+	}
+	if (len == AEAD_KEY_LEN) {
+		memcpy(key, buf, AEAD_KEY_LEN);
+		return 0;
+	}
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	int valid = (len == 2 * AEAD_KEY_LEN);
+	for (ssize_t i = 0; valid && i < len; i++)
+		valid = isxdigit((unsigned char)buf[i]);
+	if (!valid) {
+		fprintf(stderr, "Error: key file must hold %d bytes, or %d"
+			" hexadecimal digits\n", AEAD_KEY_LEN, 2 * AEAD_KEY_LEN);
+		return EINVAL;
+	}
+	for (size_t i = 0; i < AEAD_KEY_LEN; i++) {
+		char hex[3] = { buf[2 * i], buf[2 * i + 1], '\0' };
+		key[i] = strtoul(hex, NULL, 16);
+	}
+	return 0;
+}
+
+int replay_captures(int tun_fd, struct capture_reader **readers,
+	size_t reader_count, const struct filter *filter, uint64_t from_ns,
+	uint64_t to_ns)
+{
+	unsigned link = 0;
+	if (capture_reader_link_type(readers[0]) == CAPTURE_LINK_ETHERNET)
+		link |= PACKET_LINK_ETHERNET;
+	if (capture_reader_flags(readers[0]) & CAPTURE_FLAG_PI)
+		link |= PACKET_LINK_PI;
+
+	unsigned long count = 0;
+	struct capture_merge *merge = NULL;
+	int res = capture_merge_open(&merge, readers, reader_count, from_ns);
+	while (res == 0 && interrupt_flag == 0) {
+		uint64_t ts = 0;
+		const uint8_t *data = NULL;
+		size_t len = 0;
+		res = capture_merge_next(merge, &ts, &data, &len);
+		if (res != 0 || ts >= to_ns)
 			break;
+		if (filter != NULL) {
+			struct packet_info info;
+			packet_parse(data, len, link, &info);
+			if (!filter_match(filter, &info))
+				continue;
 		}
+		res = inject_packet(tun_fd, data, len);
+		if (res == EIO)
+			fprintf(stderr, "Error: interface is down\n");
+		count++;
 	}
-	return res;
+	capture_merge_close(merge);
+	if (verbosity > 0)
+		fprintf(stderr, "Injected %lu packets\n", count);
+	return (res == ENODATA || res == EINTR ? 0 : res);
 }
 
-int create_tun(int *tun_fd, char *name, size_t name_buffer_len, int persistent,
-	uid_t uid, gid_t gid)
+int create_tun(int *tun_fd, char *name, size_t name_buffer_len, short flags,
+	int persistent, uid_t uid, gid_t gid)
 {
 	if (tun_fd == NULL)
 		return EINVAL;
@@ -156,7 +374,7 @@ int create_tun(int *tun_fd, char *name, size_t name_buffer_len, int persistent,
 
 	struct ifreq ifr;
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	ifr.ifr_flags = flags;
 	if (name != NULL) {
 		if (strlen(name) >= IFNAMSIZ) {
 			fprintf(stderr, "Error: interface name too long\n");
@@ -232,6 +450,28 @@ int create_tun(int *tun_fd, char *name, size_t name_buffer_len, int persistent,
 	return 0;
 }
 
+int get_hwaddr(const char *name, uint8_t *mac)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket()");
+		return errno;
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	int res = ioctl(fd, SIOCGIFHWADDR, &ifr);
+	if (res < 0) {
+		fprintf(stderr, "Error: unable to get the address of %s\n", name);
+		perror("ioctl(SIOCGIFHWADDR)");
+		res = errno;
+	} else {
+		memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+	}
+	close(fd);
+	return res;
+}
+
 int close_tun(int fd)
 {
 	if (fd <= 0)
@@ -253,21 +493,101 @@ int main(int argc, char *argv[])
 		{"user", required_argument, 0, 'u'},
 		{"group", required_argument, 0, 'g'},
 		{"buffer", required_argument, 0, 'b'},
+		{"write", required_argument, 0, 'w'},
+		{"read", required_argument, 0, 'r'},
+		{"from", required_argument, 0, OPT_FROM},
+		{"to", required_argument, 0, OPT_TO},
+		{"export", no_argument, 0, OPT_EXPORT},
+		{"count", no_argument, 0, OPT_COUNT},
+		{"threads", required_argument, 0, 'j'},
+		{"filter", required_argument, 0, OPT_FILTER},
+		{"framed", no_argument, 0, 'F'},
+		{"sample", required_argument, 0, OPT_SAMPLE},
+		{"sketch", optional_argument, 0, OPT_SKETCH},
+		{"flows", required_argument, 0, OPT_FLOWS},
+		{"flow-timeout", required_argument, 0, OPT_FLOW_TIMEOUT},
+		{"generate", optional_argument, 0, OPT_GENERATE},
+		{"reflect", no_argument, 0, OPT_REFLECT},
+		{"probe", optional_argument, 0, OPT_PROBE},
+		{"sequence", no_argument, 0, OPT_SEQUENCE},
+		{"batch", no_argument, 0, OPT_BATCH},
+		{"metadata", no_argument, 0, OPT_METADATA},
+		{"crc", no_argument, 0, OPT_CRC},
+		{"compress", no_argument, 0, OPT_COMPRESS},
+		{"compress-headers", no_argument, 0, OPT_COMPRESS_HEADERS},
+		{"encrypt", required_argument, 0, OPT_ENCRYPT},
+		{"ktls", required_argument, 0, OPT_KTLS},
+		{"udp", required_argument, 0, OPT_UDP},
+		{"fec", optional_argument, 0, OPT_FEC},
+		{"pace", required_argument, 0, OPT_PACE},
+		{"stripe", required_argument, 0, OPT_STRIPE},
+		{"tee", required_argument, 0, OPT_TEE},
+		{"balance", required_argument, 0, OPT_BALANCE},
+		{"channels", required_argument, 0, OPT_CHANNELS},
+		{"routes", required_argument, 0, OPT_ROUTES},
+		{"switch", no_argument, 0, OPT_SWITCH},
 		{NULL, 0, 0, 0}
 	};
 
+	int tun_fd = 0;
 	int persistent = 0;
 	int buffer_len = DEFAULT_BUFFER_LEN;
 	uid_t uid = geteuid();
 	gid_t gid = getegid();
+	const char *write_path = NULL;
+	size_t read_count = 0;
+	const char **read_paths = calloc(argc, sizeof(*read_paths));
+	struct capture_reader **readers = calloc(argc, sizeof(*readers));
+	uint64_t from_ns = 0;
+	uint64_t to_ns = UINT64_MAX;
+	int export = 0;
+	int count = 0;
+	long threads = 0;
+	struct filter *filter = NULL;
+	struct capture_writer *capture = NULL;
+	const char *sample_spec = NULL;
+	struct sampler sampler;
+	long sketch_top = 0;
+	const char *flows_dest = NULL;
+	unsigned long flow_idle = 15;
+	unsigned long flow_active = 120;
+	int generate = 0;
+	int reflect = 0;
+	long probe_ms = 0;
+	struct probe_stats probes;
+	struct generate_options generate_options;
+	struct stats stats;
+	struct tunnel_options tunnel;
+	uint8_t key[AEAD_KEY_LEN];
+	uint8_t ktls_secret[KTLS_SECRET_LEN];
+	int ktls = 0;
+	const char *udp_specs[TUNNEL_MAX_PATHS];
+	const char *tee_specs[FANOUT_MAX_OUTPUTS];
+	unsigned tee_count = 0;
+	const char *balance_specs[FANOUT_MAX_OUTPUTS];
+	unsigned balance_count = 0;
+	unsigned udp_count = 0;
+	int stripe = 0;
+	long channels = 1;
+	const char *routes_path = NULL;
+	int switching = 0;
+	memset(&stats, 0, sizeof(stats));
+	memset(&tunnel, 0, sizeof(tunnel));
+	tunnel.in_fd = STDIN_FILENO;
+	tunnel.out_fd = STDOUT_FILENO;
+
+	if (read_paths == NULL || readers == NULL) {
+		res = ENOMEM;
+		goto cleanup;
+	}
 
 	struct ifreq ifr;
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_NO_PI;
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
 
 	int chr = 0, num = 0;
 	do {
-		chr = getopt_long(argc, argv, "vi:efpb:", long_options, &num);
+		chr = getopt_long(argc, argv, "vi:efpu:g:b:w:r:j:F", long_options, &num);
 		switch(chr) {
 		case -1:
 			break;
@@ -303,8 +623,200 @@ int main(int argc, char *argv[])
 			if (buffer_len <= 0) {
 				fprintf(stderr, "Error: invalid buffer size\n");
 				res = EINVAL;
+			}
+			break;
+		case 'w':
+			write_path = optarg;
+			break;
+		case 'r':
+			read_paths[read_count++] = optarg;
+			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			if (threads <= 0) {
+				fprintf(stderr, "Error: invalid thread count\n");
+				res = EINVAL;
+			}
+			break;
+		case OPT_FILTER:
+			filter_free(filter);
+			filter = NULL;
+			res = filter_compile(&filter, optarg);
+			break;
+		case OPT_COUNT:
+			count = 1;
+			break;
+		case 'F':
+			tunnel.framed = 1;
+			break;
+		case OPT_SAMPLE:
+			sample_spec = optarg;
+			break;
+		case OPT_FLOWS:
+			flows_dest = optarg;
+			break;
+		case OPT_FLOW_TIMEOUT: {
+			char *endptr = NULL;
+			flow_idle = strtoul(optarg, &endptr, 10);
+			if (*endptr == ':')
+				flow_active = strtoul(endptr + 1, &endptr, 10);
+			if (*endptr != '\0' || flow_idle == 0 || flow_active == 0) {
+				fprintf(stderr, "Error: invalid flow timeouts\n");
+				res = EINVAL;
+			}
+			break;
+		}
+		case OPT_SKETCH:
+			sketch_top = (optarg != NULL ? strtol(optarg, NULL, 10) : 10);
+			if (sketch_top <= 0 || sketch_top > SKETCH_TOP_MAX) {
+				fprintf(stderr, "Error: invalid number of top sources\n");
+				res = EINVAL;
+			}
+			break;
+		case OPT_GENERATE:
+			generate = 1;
+			res = generate_parse(&generate_options, optarg);
+			break;
+		case OPT_REFLECT:
+			reflect = 1;
+			break;
+		case OPT_PROBE:
+			probe_ms = (optarg != NULL ? strtol(optarg, NULL, 10) : 1000);
+			if (probe_ms <= 0) {
+				fprintf(stderr, "Error: invalid probe interval\n");
+				res = EINVAL;
+			}
+			break;
+		case OPT_SEQUENCE:
+			tunnel.sequenced = 1;
+			break;
+		case OPT_BATCH:
+			tunnel.batched = 1;
+			break;
+		case OPT_METADATA:
+			tunnel.metadata = 1;
+			break;
+		case OPT_CRC:
+			tunnel.checksummed = 1;
+			break;
+		case OPT_COMPRESS:
+			tunnel.compressed = 1;
+			break;
+		case OPT_COMPRESS_HEADERS:
+			tunnel.header_compressed = 1;
+			break;
+		case OPT_ENCRYPT:
+			res = read_key(optarg, key);
+			tunnel.key = key;
+			break;
+		case OPT_KTLS:
+			res = read_key(optarg, ktls_secret);
+			ktls = 1;
+			break;
+		case OPT_UDP:
+			if (udp_count == TUNNEL_MAX_PATHS) {
+				fprintf(stderr, "Error: at most %d UDP paths\n",
+					TUNNEL_MAX_PATHS);
+				res = EINVAL;
+				break;
+			}
+			udp_specs[udp_count++] = optarg;
+			break;
+		case OPT_TEE:
+			if (tee_count == FANOUT_MAX_OUTPUTS) {
+				fprintf(stderr, "Error: at most %d outputs\n",
+					FANOUT_MAX_OUTPUTS);
+				res = EINVAL;
+				break;
+			}
+			tee_specs[tee_count++] = optarg;
+			break;
+		case OPT_BALANCE:
+			if (balance_count == FANOUT_MAX_OUTPUTS) {
+				fprintf(stderr, "Error: at most %d outputs\n",
+					FANOUT_MAX_OUTPUTS);
+				res = EINVAL;
 				break;
 			}
+			balance_specs[balance_count++] = optarg;
+			break;
+		case OPT_CHANNELS:
+			channels = strtol(optarg, NULL, 10);
+			if (channels <= 0 || channels > TUNNEL_MAX_CHANNELS) {
+				fprintf(stderr, "Error: invalid number of channels (1 to %d)\n",
+					TUNNEL_MAX_CHANNELS);
+				res = EINVAL;
+			}
+			break;
+		case OPT_ROUTES:
+			routes_path = optarg;
+			break;
+		case OPT_SWITCH:
+			switching = 1;
+			break;
+		case OPT_STRIPE:
+			stripe = 1;
+			if (strcmp(optarg, "flow") == 0) {
+				tunnel.stripe_flows = 1;
+			} else if (strcmp(optarg, "round-robin") != 0) {
+				fprintf(stderr, "Error: unknown striping mode '%s'\n", optarg);
+				res = EINVAL;
+			}
+			break;
+		case OPT_FEC: {
+			char *endptr = NULL;
+			tunnel.fec_group = 8;
+			tunnel.fec_parity = 0;
+			if (optarg != NULL) {
+				tunnel.fec_group = strtoul(optarg, &endptr, 10);
+				if (*endptr == ':')
+					tunnel.fec_parity = strtoul(endptr + 1, &endptr, 10);
+			}
+			if ((endptr != NULL && *endptr != '\0') ||
+				tunnel.fec_group == 0 || tunnel.fec_group > FEC_MAX_GROUP ||
+				tunnel.fec_parity > tunnel.fec_group ||
+				(endptr != NULL && endptr[-1] == ':')) {
+				fprintf(stderr, "Error: invalid FEC group, expected 1 to %d"
+					" frames and at most as many parity frames\n",
+					FEC_MAX_GROUP);
+				res = EINVAL;
+			}
+			/* Groups are made of consecutive sequence numbers */
+			tunnel.sequenced = 1;
+			break;
+		}
+		case OPT_PACE: {
+			char *endptr = NULL;
+			errno = 0;
+			unsigned long long rate = strtoull(optarg, &endptr, 10);
+			unsigned long long multiplier = 1;
+			if (*endptr == 'k')
+				multiplier = 1000;
+			else if (*endptr == 'M')
+				multiplier = 1000000;
+			else if (*endptr == 'G')
+				multiplier = 1000000000;
+			if (multiplier != 1)
+				endptr++;
+			if (endptr == optarg || *endptr != '\0' || optarg[0] == '-' ||
+				errno != 0 || rate > ULLONG_MAX / multiplier)
+				rate = 0;
+			tunnel.pace_bps = rate * multiplier;
+			if (tunnel.pace_bps == 0) {
+				fprintf(stderr, "Error: invalid pacing rate\n");
+				res = EINVAL;
+			}
+			break;
+		}
+		case OPT_FROM:
+			res = parse_timestamp(optarg, &from_ns);
+			break;
+		case OPT_TO:
+			res = parse_timestamp(optarg, &to_ns);
+			break;
+		case OPT_EXPORT:
+			export = 1;
+			break;
 		default:
 			print_usage(stderr);
 			res = 1;
@@ -313,15 +825,295 @@ int main(int argc, char *argv[])
 
 	if (res != 0)
 		goto cleanup;
+	if ((probe_ms > 0 || tunnel.sequenced || tunnel.batched ||
+		tunnel.metadata || tunnel.checksummed || tunnel.compressed ||
+		tunnel.header_compressed || tunnel.key != NULL) && !tunnel.framed) {
+		fprintf(stderr, "Error: --probe, --sequence, --batch, --metadata,"
+			" --crc, --compress, --compress-headers and --encrypt require"
+			" framing (-F)\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (udp_count > 0 && (!tunnel.framed || tunnel.batched ||
+		tunnel.compressed || tunnel.key != NULL || ktls)) {
+		fprintf(stderr, "Error: --udp requires framing (-F), one frame per"
+			" packet (no --batch, --compress or --encrypt), and no --ktls\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if ((tunnel.fec_group > 0 || tunnel.pace_bps > 0) && udp_count == 0) {
+		fprintf(stderr, "Error: --fec and --pace require a datagram transport"
+			" (--udp)\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (stripe && udp_count < 2) {
+		fprintf(stderr, "Error: --stripe requires several paths (--udp)\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	/* Frames striped round-robin are numbered to be put back in order */
+	if (udp_count > 1 && !tunnel.stripe_flows)
+		tunnel.sequenced = 1;
+	if (tunnel.batched && tunnel.metadata) {
+		fprintf(stderr, "Error: metadata is per packet, not per batch\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (tunnel.batched && tunnel.header_compressed) {
+		fprintf(stderr, "Error: header compression is per packet frame, not"
+			" per batch\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (channels > 1 && (!tunnel.framed || generate || reflect ||
+		read_count > 0 || write_path != NULL)) {
+		fprintf(stderr, "Error: --channels requires framing (-F), and"
+			" cannot be used with -r, -w, --generate or --reflect\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (routes_path != NULL && (tunnel.batched || generate || reflect ||
+		read_count > 0)) {
+		fprintf(stderr, "Error: --routes sends a frame per packet (no"
+			" --batch), and cannot be used with -r, --generate or"
+			" --reflect\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if (switching && (!(ifr.ifr_flags & IFF_TAP) || routes_path != NULL ||
+		tunnel.batched || generate || reflect || read_count > 0)) {
+		fprintf(stderr, "Error: --switch requires tap devices (-e), sends a"
+			" frame per packet (no --batch), and cannot be used with"
+			" --routes, -r, --generate or --reflect\n");
+		res = EINVAL;
+		goto cleanup;
+	}
+	if ((export || count) && read_count == 0) {
+		fprintf(stderr, "Error: --export and --count require a capture to read\n");
+		res = EINVAL;
+		goto cleanup;
+	}
 
-	int tun_fd = 0;
-	res = create_tun(&tun_fd, ifr.ifr_name, IFNAMSIZ, persistent, uid, gid);
-	if (res != 0)
+	for (size_t i = 0; i < read_count; i++) {
+		res = capture_reader_open(&readers[i], read_paths[i]);
+		if (res != 0)
+			goto cleanup;
+	}
+	if (export || count) {
+		struct scan_options options = {
+			.filter = filter,
+			.from_ns = from_ns,
+			.to_ns = to_ns,
+			.threads = threads,
+			.out_fd = (export ? STDOUT_FILENO : -1),
+		};
+		struct scan_counters counters;
+		res = scan_captures(readers, read_count, &options, &counters);
+		if (res == 0 && count) {
+			printf("blocks %lu packets %lu matched %lu bytes %llu\n",
+				counters.blocks, counters.packets, counters.matched,
+				counters.matched_bytes);
+			printf("tcp %lu udp %lu icmp %lu other %lu\n", counters.tcp,
+				counters.udp, counters.icmp, counters.other);
+		}
+		goto cleanup;
+	}
+	/* Channel i goes to the device named after -i and i, or to one named
+	 * by the kernel */
+	char base_name[IFNAMSIZ];
+	memcpy(base_name, ifr.ifr_name, IFNAMSIZ);
+	for (long i = 0; i < channels; i++) {
+		char name[IFNAMSIZ];
+		memcpy(name, base_name, IFNAMSIZ);
+		if (channels > 1 && base_name[0] != '\0' &&
+			snprintf(name, IFNAMSIZ, "%s%ld", base_name, i) >= IFNAMSIZ) {
+			fprintf(stderr, "Error: interface name too long for %ld"
+				" channels\n", channels);
+			res = ENAMETOOLONG;
+			goto cleanup;
+		}
+		res = create_tun(&tunnel.tun_fds[i], name, IFNAMSIZ, ifr.ifr_flags,
+			persistent, uid, gid);
+		if (res != 0)
+			goto cleanup;
+		tunnel.channels++;
+		if (i == 0)
+			memcpy(ifr.ifr_name, name, IFNAMSIZ);
+		if (channels > 1)
+			fprintf(stderr, "Listening on %s (channel %ld)\n", name, i);
+		else
+			fprintf(stderr, "Listening on %s\n", name);
+	}
+	tun_fd = tunnel.tun_fds[0];
+
+	res = setup_signal_handlers();
+	if (res != 0) {
+		perror("sigaction()");
 		goto cleanup;
-	fprintf(stderr, "Listening on %s\n", ifr.ifr_name);
+	}
+
+	unsigned link = 0;
+	if (ifr.ifr_flags & IFF_TAP)
+		link |= PACKET_LINK_ETHERNET;
+	if (!(ifr.ifr_flags & IFF_NO_PI))
+		link |= PACKET_LINK_PI;
+	if (generate || reflect) {
+		if (generate && (link & PACKET_LINK_ETHERNET)) {
+			res = get_hwaddr(ifr.ifr_name, generate_options.mac);
+			if (res != 0)
+				goto cleanup;
+		}
+		if (generate)
+			res = generate_run(tun_fd, &generate_options, link, &stats);
+		else
+			res = reflect_run(tun_fd, link, buffer_len, &stats);
+		if (verbosity > 0)
+			stats_print(stderr, &stats);
+		goto cleanup;
+	}
+
+	if (read_count > 0) {
+		res = replay_captures(tun_fd, readers, read_count, filter, from_ns,
+			to_ns);
+		goto cleanup;
+	}
+
+	if (write_path != NULL) {
+		uint16_t link_type = (ifr.ifr_flags & IFF_TAP) ?
+			CAPTURE_LINK_ETHERNET : CAPTURE_LINK_RAW;
+		uint16_t flags = (ifr.ifr_flags & IFF_NO_PI) ? 0 : CAPTURE_FLAG_PI;
+		res = capture_writer_open(&capture, write_path, link_type, flags,
+			buffer_len);
+		if (res != 0)
+			goto cleanup;
+	}
+
+	tunnel.buffer_len = buffer_len;
+	tunnel.link = link;
+	tunnel.filter = filter;
+	tunnel.capture = capture;
+	if (tee_count > 0) {
+		res = fanout_open(&tunnel.tee, tee_specs, tee_count, buffer_len);
+		if (res != 0)
+			goto cleanup;
+		stats.tee = tunnel.tee;
+	}
+	if (balance_count > 0) {
+		res = fanout_open(&tunnel.balance, balance_specs, balance_count,
+			buffer_len);
+		if (res != 0)
+			goto cleanup;
+		stats.balance = tunnel.balance;
+	}
+	if (routes_path != NULL) {
+		res = route_table_open(&tunnel.routes, routes_path);
+		if (res != 0)
+			goto cleanup;
+		fprintf(stderr, "Loaded %u routes from %s\n", tunnel.routes->count,
+			routes_path);
+		/* Only once there are routes to reload, SIGHUP ends tuncat
+		 * otherwise */
+		struct sigaction act;
+		act.sa_handler = &signal_handler;
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = 0;
+		if (sigaction(SIGHUP, &act, NULL) != 0) {
+			perror("sigaction()");
+			res = errno;
+			goto cleanup;
+		}
+	}
+	if (switching) {
+		tunnel.bridge = malloc(sizeof(*tunnel.bridge));
+		if (tunnel.bridge == NULL) {
+			res = ENOMEM;
+			goto cleanup;
+		}
+		bridge_init(tunnel.bridge);
+		stats.bridge = tunnel.bridge;
+	}
+	if (sample_spec != NULL) {
+		res = sampler_parse(&sampler, sample_spec, tunnel.link);
+		if (res != 0)
+			goto cleanup;
+		tunnel.sampler = &sampler;
+	}
+	if (sketch_top > 0) {
+		tunnel.sketch = malloc(sizeof(*tunnel.sketch));
+		if (tunnel.sketch == NULL) {
+			res = ENOMEM;
+			goto cleanup;
+		}
+		sketch_init(tunnel.sketch, tunnel.link, sketch_top);
+		stats.sketch = tunnel.sketch;
+	}
+	if (flows_dest != NULL) {
+		res = ipfix_meter_open(&tunnel.flows, flows_dest, tunnel.link,
+			flow_idle * 1000000000ULL, flow_active * 1000000000ULL);
+		if (res != 0)
+			goto cleanup;
+		stats.flows = tunnel.flows;
+	}
+	if (probe_ms > 0) {
+		probe_init(&probes, probe_ms * 1000000ULL);
+		tunnel.probes = &probes;
+		stats.probes = &probes;
+	}
+	for (unsigned i = 0; i < udp_count; i++) {
+		int fd = -1;
+		res = udp_open(udp_specs[i], &fd);
+		if (res != 0)
+			goto cleanup;
+		tunnel.path_fds[tunnel.path_count++] = fd;
+		if (tunnel.pace_bps > 0) {
+			res = udp_enable_txtime(fd);
+			if (res != 0)
+				goto cleanup;
+		}
+	}
+	if (udp_count > 0) {
+		tunnel.in_fd = tunnel.out_fd = tunnel.path_fds[0];
+		tunnel.datagrams = 1;
+	}
+	if (isatty(tunnel.out_fd)) {
+		fprintf(stderr, "Warning: stdout is a terminal, not forwarding"
+			" packets to it\n");
+		tunnel.out_fd = -1;
+	}
+	if (ktls) {
+		res = ktls_enable(tunnel.in_fd, tunnel.out_fd, ktls_secret);
+		if (res != 0)
+			goto cleanup;
+	}
+	res = infinite_loop(&tunnel, &stats);
+	if (verbosity > 0)
+		stats_print(stderr, &stats);
 
 cleanup:
-	if (tun_fd != 0)
-		close_tun(tun_fd);
+	if (capture != NULL) {
+		int close_res = capture_writer_close(capture);
+		if (res == 0)
+			res = close_res;
+	}
+	for (size_t i = 0; i < read_count; i++)
+		capture_reader_close(readers[i]);
+	free(readers);
+	free(read_paths);
+	filter_free(filter);
+	free(tunnel.sketch);
+	fanout_close(tunnel.tee);
+	fanout_close(tunnel.balance);
+	route_table_close(tunnel.routes);
+	free(tunnel.bridge);
+	if (tunnel.flows != NULL) {
+		int close_res = ipfix_meter_close(tunnel.flows);
+		if (res == 0)
+			res = close_res;
+	}
+	for (unsigned i = 0; i < tunnel.path_count; i++)
+		close(tunnel.path_fds[i]);
+	for (unsigned i = 0; i < tunnel.channels; i++)
+		close_tun(tunnel.tun_fds[i]);
 	return res;
 }
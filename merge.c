@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "merge.h"
+
+struct merge_entry {
+	uint64_t ts;
+	size_t source;
+	const uint8_t *data;
+	size_t len;
+};
+
+struct capture_merge {
+	struct capture_reader **readers;
+	struct merge_entry *heap;
+	size_t heap_len;
+	/* The root was returned by the last call, and its reader must only
+	 * be advanced once the caller is done with the packet */
+	int root_consumed;
+};
+
+static int entry_less(const struct merge_entry *a, const struct merge_entry *b)
+{
+	return a->ts < b->ts || (a->ts == b->ts && a->source < b->source);
+}
+
+static void sift_down(struct capture_merge *merge, size_t i)
+{
+	struct merge_entry *heap = merge->heap;
+	struct merge_entry tmp = heap[i];
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= merge->heap_len)
+			break;
+		if (child + 1 < merge->heap_len &&
+			entry_less(&heap[child + 1], &heap[child]))
+			child++;
+		if (!entry_less(&heap[child], &tmp))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = tmp;
+}
+
+/* Reads the next packet of a source into e, returns ENODATA at its end */
+static int fill_entry(struct capture_merge *merge, size_t source,
+	struct merge_entry *e)
+{
+	e->source = source;
+	return capture_reader_next(merge->readers[source], &e->ts, &e->data,
+		&e->len);
+}
+
+int capture_merge_open(struct capture_merge **merge,
+	struct capture_reader **readers, size_t reader_count, uint64_t from_ns)
+{
+	if (merge == NULL || readers == NULL || reader_count == 0)
+		return EINVAL;
+
+	for (size_t i = 1; i < reader_count; i++) {
+		if (capture_reader_link_type(readers[i]) !=
+			capture_reader_link_type(readers[0]) ||
+			capture_reader_flags(readers[i]) !=
+			capture_reader_flags(readers[0])) {
+			fprintf(stderr, "Error: cannot merge captures of different"
+				" link types\n");
+			return EINVAL;
+		}
+	}
+
+	struct capture_merge *m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return ENOMEM;
+	m->readers = readers;
+	m->heap = calloc(reader_count, sizeof(*m->heap));
+	if (m->heap == NULL) {
+		free(m);
+		return ENOMEM;
+	}
+
+	int res = 0;
+	for (size_t i = 0; res == 0 && i < reader_count; i++) {
+		res = capture_reader_seek(readers[i], from_ns);
+		if (res == 0)
+			res = fill_entry(m, i, &m->heap[m->heap_len]);
+		if (res == 0)
+			m->heap_len++;
+		else if (res == ENODATA)
+			res = 0;
+	}
+	if (res != 0) {
+		capture_merge_close(m);
+		return res;
+	}
+	for (size_t i = m->heap_len / 2; i-- > 0;)
+		sift_down(m, i);
+	*merge = m;
+	return 0;
+}
+
+int capture_merge_next(struct capture_merge *merge, uint64_t *ts_ns,
+	const uint8_t **data, size_t *len)
+{
+	if (merge == NULL || ts_ns == NULL || data == NULL || len == NULL)
+		return EINVAL;
+
+	if (merge->root_consumed && merge->heap_len > 0) {
+		int res = fill_entry(merge, merge->heap[0].source, &merge->heap[0]);
+		if (res == ENODATA)
+			merge->heap[0] = merge->heap[--merge->heap_len];
+		else if (res != 0)
+			return res;
+		if (merge->heap_len > 0)
+			sift_down(merge, 0);
+	}
+	merge->root_consumed = 0;
+	if (merge->heap_len == 0)
+		return ENODATA;
+
+	*ts_ns = merge->heap[0].ts;
+	*data = merge->heap[0].data;
+	*len = merge->heap[0].len;
+	merge->root_consumed = 1;
+	return 0;
+}
+
+void capture_merge_close(struct capture_merge *merge)
+{
+	if (merge == NULL)
+		return;
+	free(merge->heap);
+	free(merge);
+}
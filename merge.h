@@ -0,0 +1,23 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "capture.h"
+
+/* Merges several captures into one stream ordered by timestamp, using a
+ * binary heap with one entry per capture. Packets are returned straight
+ * from each reader's block buffer, nothing is allocated per packet. */
+
+struct capture_merge;
+
+int capture_merge_open(struct capture_merge **merge,
+	struct capture_reader **readers, size_t reader_count, uint64_t from_ns);
+/* Returns ENODATA once all captures are exhausted. The packet data remains
+ * valid until the next call. Packets with equal timestamps come out in the
+ * order their captures were given. */
+int capture_merge_next(struct capture_merge *merge, uint64_t *ts_ns,
+	const uint8_t **data, size_t *len);
+void capture_merge_close(struct capture_merge *merge);
+
+#endif
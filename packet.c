@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <string.h>
+#include "packet.h"
+#include "util.h"
+
+#define ETH_HEADER_LEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86dd
+#define ETH_P_8021Q 0x8100
+#define ETH_P_8021AD 0x88a8
+
+/* Returns the offset of the network header, and its ethertype if known */
+static size_t skip_l2(const uint8_t *data, size_t len, unsigned link,
+	uint16_t *ethertype)
+{
+	size_t off = 0;
+	*ethertype = 0;
+	if (link & PACKET_LINK_PI)
+		off += 4;
+	if (link & PACKET_LINK_ETHERNET) {
+		off += ETH_HEADER_LEN;
+		while (off <= len && off >= 2 &&
+			(get_be16(data + off - 2) == ETH_P_8021Q ||
+			get_be16(data + off - 2) == ETH_P_8021AD))
+			off += 4;
+		if (off <= len)
+			*ethertype = get_be16(data + off - 2);
+	}
+	return off;
+}
+
+static void parse_l4(const uint8_t *data, size_t len, size_t off,
+	struct packet_info *info)
+{
+	size_t need = 0;
+	switch (info->proto) {
+	case 6: /* TCP */
+		need = 20;
+		break;
+	case 17: /* UDP */
+	case 132: /* SCTP */
+		need = 8;
+		break;
+	case 1: /* ICMP */
+	case 58: /* ICMPv6 */
+		need = 4;
+		break;
+	default:
+		return;
+	}
+	if (info->fragment || off > len || len - off < need)
+		return;
+	info->l4_off = off;
+	if (info->proto == 1 || info->proto == 58)
+		return;
+	info->sport = get_be16(data + off);
+	info->dport = get_be16(data + off + 2);
+	if (info->proto == 6)
+		info->tcp_flags = data[off + 13];
+}
+
+static int parse_ipv4(const uint8_t *data, size_t len, size_t off,
+	struct packet_info *info)
+{
+	if (len - off < 20)
+		return EINVAL;
+	const uint8_t *ip = data + off;
+	size_t ihl = (ip[0] & 0x0f) * 4;
+	if (ihl < 20 || len - off < ihl)
+		return EINVAL;
+	info->family = 4;
+	info->proto = ip[9];
+	info->fragment = (get_be16(ip + 6) & 0x1fff) != 0;
+	memcpy(info->src, ip + 12, 4);
+	memcpy(info->dst, ip + 16, 4);
+	parse_l4(data, len, off + ihl, info);
+	return 0;
+}
+
+static int parse_ipv6(const uint8_t *data, size_t len, size_t off,
+	struct packet_info *info)
+{
+	if (len - off < 40)
+		return EINVAL;
+	const uint8_t *ip = data + off;
+	info->family = 6;
+	memcpy(info->src, ip + 8, 16);
+	memcpy(info->dst, ip + 24, 16);
+
+	uint8_t next = ip[6];
+	off += 40;
+	while (1) {
+		if (next == 0 || next == 43 || next == 60) {
+			/* Hop-by-hop, routing, destination options */
+			if (len - off < 8)
+				break;
+			next = data[off];
+			off += 8 + data[off + 1] * 8;
+		} else if (next == 44) {
+			if (len - off < 8)
+				break;
+			if ((get_be16(data + off + 2) & 0xfff8) != 0)
+				info->fragment = 1;
+			next = data[off];
+			off += 8;
+		} else {
+			break;
+		}
+		if (off > len)
+			break;
+	}
+	info->proto = next;
+	parse_l4(data, len, off, info);
+	return 0;
+}
+
+int packet_parse(const uint8_t *data, size_t len, unsigned link,
+	struct packet_info *info)
+{
+	if (data == NULL || info == NULL)
+		return EINVAL;
+	memset(info, 0, sizeof(*info));
+	info->len = len;
+
+	uint16_t ethertype = 0;
+	size_t off = skip_l2(data, len, link, &ethertype);
+	if (off >= len)
+		return EINVAL;
+	if (ethertype != 0 && ethertype != ETH_P_IP && ethertype != ETH_P_IPV6)
+		return EINVAL;
+	info->l3_off = off;
+	switch (data[off] >> 4) {
+	case 4:
+		return parse_ipv4(data, len, off, info);
+	case 6:
+		return parse_ipv6(data, len, off, info);
+	default:
+		return EINVAL;
+	}
+}
+
+uint32_t packet_checksum_add(const uint8_t *data, size_t len, uint32_t initial)
+{
+	uint64_t sum = initial;
+	while (len >= 2) {
+		sum += get_be16(data);
+		data += 2;
+		len -= 2;
+	}
+	if (len > 0)
+		sum += data[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint32_t)sum;
+}
+
+uint16_t packet_checksum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+uint32_t packet_pseudo_header_sum(const struct packet_info *info,
+	size_t l4_len)
+{
+	size_t addr_len = (info->family == 6 ? 16 : 4);
+	uint32_t sum = packet_checksum_add(info->src, addr_len, 0);
+	sum = packet_checksum_add(info->dst, addr_len, sum);
+	return sum + info->proto + (uint32_t)(l4_len & 0xffff) +
+		(uint32_t)(l4_len >> 16);
+}
+
+void packet_checksum_update16(uint8_t *csum, uint16_t old_word,
+	uint16_t new_word)
+{
+	uint32_t sum = (uint16_t)~get_be16(csum);
+	sum += (uint16_t)~old_word;
+	sum += new_word;
+	uint16_t res = packet_checksum_fold(sum);
+	csum[0] = res >> 8;
+	csum[1] = res & 0xff;
+}
+
+void packet_checksum_update32(uint8_t *csum, uint32_t old_word,
+	uint32_t new_word)
+{
+	packet_checksum_update16(csum, old_word >> 16, new_word >> 16);
+	packet_checksum_update16(csum, old_word & 0xffff, new_word & 0xffff);
+}
+
+void packet_fill_checksums(uint8_t *data, size_t len, unsigned link)
+{
+	struct packet_info info;
+	if (packet_parse(data, len, link, &info) != 0)
+		return;
+	uint8_t *ip = data + info.l3_off;
+	if (info.family == 4) {
+		size_t ihl = (ip[0] & 0x0f) * 4;
+		ip[10] = ip[11] = 0;
+		uint16_t csum = packet_checksum_fold(packet_checksum_add(ip, ihl, 0));
+		ip[10] = csum >> 8;
+		ip[11] = csum & 0xff;
+	}
+	if (info.l4_off == 0)
+		return;
+
+	size_t csum_off = 0;
+	uint32_t sum = 0;
+	size_t l4_len = len - info.l4_off;
+	switch (info.proto) {
+	case 6:
+		csum_off = 16;
+		sum = packet_pseudo_header_sum(&info, l4_len);
+		break;
+	case 17:
+		csum_off = 6;
+		sum = packet_pseudo_header_sum(&info, l4_len);
+		break;
+	case 58:
+		csum_off = 2;
+		sum = packet_pseudo_header_sum(&info, l4_len);
+		break;
+	case 1:
+		csum_off = 2;
+		break;
+	default:
+		return;
+	}
+	uint8_t *l4 = data + info.l4_off;
+	l4[csum_off] = l4[csum_off + 1] = 0;
+	uint16_t csum = packet_checksum_fold(packet_checksum_add(l4, l4_len, sum));
+	/* An all-zero UDP checksum means none was computed */
+	if (csum == 0 && info.proto == 17)
+		csum = 0xffff;
+	l4[csum_off] = csum >> 8;
+	l4[csum_off + 1] = csum & 0xff;
+}
+
+static uint32_t mix32(uint32_t h, uint32_t v)
+{
+	v *= 0xcc9e2d51;
+	v = (v << 15) | (v >> 17);
+	v *= 0x1b873593;
+	h ^= v;
+	h = (h << 13) | (h >> 19);
+	return h * 5 + 0xe6546b64;
+}
+
+static uint32_t fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32_t packet_flow_hash(const struct packet_info *info, uint32_t seed)
+{
+	size_t addr_len = (info->family == 6 ? 16 : 4);
+	uint32_t a[4] = { 0 };
+	uint32_t b[4] = { 0 };
+	memcpy(a, info->src, addr_len);
+	memcpy(b, info->dst, addr_len);
+
+	/* Order endpoints so that both directions hash the same */
+	uint16_t pa = info->sport;
+	uint16_t pb = info->dport;
+	int cmp = memcmp(info->src, info->dst, addr_len);
+	if (cmp > 0 || (cmp == 0 && pa > pb)) {
+		uint32_t tmp[4];
+		memcpy(tmp, a, sizeof(a));
+		memcpy(a, b, sizeof(a));
+		memcpy(b, tmp, sizeof(a));
+		pa = info->dport;
+		pb = info->sport;
+	}
+
+	uint32_t h = seed;
+	for (size_t i = 0; i < addr_len / 4; i++) {
+		h = mix32(h, a[i]);
+		h = mix32(h, b[i]);
+	}
+	h = mix32(h, ((uint32_t)pa << 16) | pb);
+	h = mix32(h, ((uint32_t)info->family << 8) | info->proto);
+	return fmix32(h);
+}
@@ -0,0 +1,57 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Framing of packets as read from the device */
+#define PACKET_LINK_PI 0x0001       /* preceded by a struct tun_pi */
+#define PACKET_LINK_ETHERNET 0x0002 /* starts with an ethernet header */
+
+#define PACKET_TCP_FIN 0x01
+#define PACKET_TCP_SYN 0x02
+#define PACKET_TCP_RST 0x04
+#define PACKET_TCP_PSH 0x08
+#define PACKET_TCP_ACK 0x10
+
+struct packet_info {
+	uint8_t family;    /* 4, 6, or 0 if not an IP packet */
+	uint8_t proto;     /* IP protocol of the transport header */
+	uint8_t tcp_flags;
+	uint8_t fragment;  /* non-first fragment, no transport header */
+	uint16_t sport;    /* host byte order, 0 if not TCP/UDP/SCTP */
+	uint16_t dport;
+	uint8_t src[16];   /* IPv4 addresses use the first 4 bytes */
+	uint8_t dst[16];
+	uint16_t l3_off;
+	uint16_t l4_off;   /* 0 if there is no transport header */
+	size_t len;
+};
+
+/* Returns 0 if data holds an IPv4/IPv6 packet, EINVAL otherwise (info is
+ * still filled with whatever could be parsed) */
+int packet_parse(const uint8_t *data, size_t len, unsigned link,
+	struct packet_info *info);
+
+/* One's complement sum of len bytes, folded to 16 bits but not inverted,
+ * which can be chained through initial */
+uint32_t packet_checksum_add(const uint8_t *data, size_t len, uint32_t initial);
+/* Final checksum, as stored in headers */
+uint16_t packet_checksum_fold(uint32_t sum);
+/* Sum of the IPv4/IPv6 pseudo-header of a transport checksum */
+uint32_t packet_pseudo_header_sum(const struct packet_info *info,
+	size_t l4_len);
+/* Updates a checksum at csum (network order) for a 16-bit word of the
+ * covered data changing from old to new (RFC 1624) */
+void packet_checksum_update16(uint8_t *csum, uint16_t old_word,
+	uint16_t new_word);
+void packet_checksum_update32(uint8_t *csum, uint32_t old_word,
+	uint32_t new_word);
+/* Recomputes the IPv4 header checksum, and the TCP/UDP/ICMP checksum */
+void packet_fill_checksums(uint8_t *data, size_t len, unsigned link);
+
+/* Hash of the addresses, protocol and ports, which is the same for both
+ * directions of a flow */
+uint32_t packet_flow_hash(const struct packet_info *info, uint32_t seed);
+
+#endif
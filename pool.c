@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pool.h"
+
+/* Buffers start on a cache line */
+#define POOL_ALIGN 64
+
+int pool_init(struct pool *pool, size_t count, size_t size, size_t headroom)
+{
+	if (pool == NULL || count == 0 || size <= headroom)
+		return EINVAL;
+	memset(pool, 0, sizeof(*pool));
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	if (posix_memalign((void**)&pool->storage, POOL_ALIGN, count * size) != 0)
+		return ENOMEM;
+	pool->buffers = calloc(count, sizeof(*pool->buffers));
+	pool->free = calloc(count, sizeof(*pool->free));
+	if (pool->buffers == NULL || pool->free == NULL) {
+		pool_destroy(pool);
+		return ENOMEM;
+	}
+	pool->count = count;
+	pool->size = size;
+	pool->headroom = headroom;
+	for (size_t i = 0; i < count; i++) {
+		pool->buffers[i].head = pool->storage + i * size;
+		pool->free[i] = &pool->buffers[count - 1 - i];
+	}
+	pool->free_len = count;
+	return 0;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	free(pool->storage);
+	free(pool->buffers);
+	free(pool->free);
+	memset(pool, 0, sizeof(*pool));
+}
+
+struct pool_buffer *pool_get(struct pool *pool)
+{
+	if (pool->free_len == 0)
+		return NULL;
+	struct pool_buffer *buffer = pool->free[--pool->free_len];
+	buffer->data = buffer->head + pool->headroom;
+	buffer->len = 0;
+	buffer->refs = 1;
+	return buffer;
+}
+
+void pool_put(struct pool *pool, struct pool_buffer *buffer)
+{
+	pool->free[pool->free_len++] = buffer;
+}
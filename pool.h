@@ -0,0 +1,54 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Preallocated packet buffers of a fixed size, carved out of a single
+ * allocation, with headroom in front of the packet so that headers can be
+ * prepended in place. Buffers are reference counted, to be shared by
+ * several queues without copying them. */
+
+struct pool_buffer {
+	uint8_t *head;  /* start of the storage */
+	uint8_t *data;  /* start of the packet */
+	size_t len;
+	unsigned refs;
+};
+
+struct pool {
+	uint8_t *storage;
+	struct pool_buffer *buffers;
+	struct pool_buffer **free;
+	size_t free_len;
+	size_t count;
+	size_t size;
+	size_t headroom;
+};
+
+int pool_init(struct pool *pool, size_t count, size_t size, size_t headroom);
+void pool_destroy(struct pool *pool);
+/* Returns a buffer with a single reference, NULL if all buffers are in
+ * use */
+struct pool_buffer *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, struct pool_buffer *buffer);
+
+static inline void pool_ref(struct pool_buffer *buffer)
+{
+	buffer->refs++;
+}
+
+/* Puts the buffer back once its last reference is dropped */
+static inline void pool_unref(struct pool *pool, struct pool_buffer *buffer)
+{
+	if (--buffer->refs == 0)
+		pool_put(pool, buffer);
+}
+
+static inline size_t pool_tailroom(const struct pool *pool,
+	const struct pool_buffer *buffer)
+{
+	return pool->size - (buffer->data - buffer->head) - buffer->len;
+}
+
+#endif
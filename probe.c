@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "probe.h"
+#include "util.h"
+
+void probe_init(struct probe_stats *probes, uint64_t interval_ns)
+{
+	memset(probes, 0, sizeof(*probes));
+	probes->interval_ns = interval_ns;
+	probes->min_rtt_ns = UINT64_MAX;
+}
+
+void probe_build(struct probe_stats *probes, uint8_t *payload,
+	uint64_t now_ns)
+{
+	put_le64(payload, probes->next_sequence++);
+	put_le64(payload + 8, now_ns);
+	probes->sent++;
+}
+
+static size_t bucket_of(uint64_t value)
+{
+	if (value < (1 << PROBE_SUB_BITS))
+		return value;
+	int msb = 63 - __builtin_clzll(value);
+	size_t sub = (value >> (msb - PROBE_SUB_BITS)) &
+		((1 << PROBE_SUB_BITS) - 1);
+	return ((size_t)(msb - PROBE_SUB_BITS + 1) << PROBE_SUB_BITS) + sub;
+}
+
+/* Middle of the range of values in a bucket */
+static uint64_t bucket_value(size_t bucket)
+{
+	if (bucket < (1 << PROBE_SUB_BITS))
+		return bucket;
+	int shift = (bucket >> PROBE_SUB_BITS) - 1;
+	uint64_t base = ((uint64_t)(1 << PROBE_SUB_BITS) |
+		(bucket & ((1 << PROBE_SUB_BITS) - 1))) << shift;
+	return base + ((1ULL << shift) >> 1);
+}
+
+int probe_reply(struct probe_stats *probes, const uint8_t *payload,
+	size_t len, uint64_t now_ns)
+{
+	if (len != PROBE_PAYLOAD_LEN)
+		return EINVAL;
+	uint64_t sequence = get_le64(payload);
+	uint64_t sent_ns = get_le64(payload + 8);
+	if (sequence >= probes->next_sequence || sent_ns > now_ns)
+		return EINVAL;
+
+	uint64_t rtt = now_ns - sent_ns;
+	if (probes->received > 0) {
+		if (sequence < probes->last_sequence)
+			probes->reordered++;
+		double delta = (double)rtt - (double)probes->last_rtt_ns;
+		if (delta < 0)
+			delta = -delta;
+		probes->jitter_ns += (delta - probes->jitter_ns) / 16;
+	}
+	probes->last_sequence = sequence;
+	probes->last_rtt_ns = rtt;
+	probes->received++;
+	probes->sum_rtt_ns += rtt;
+	if (rtt < probes->min_rtt_ns)
+		probes->min_rtt_ns = rtt;
+	if (rtt > probes->max_rtt_ns)
+		probes->max_rtt_ns = rtt;
+	probes->buckets[bucket_of(rtt)]++;
+	return 0;
+}
+
+static uint64_t percentile(const struct probe_stats *probes, unsigned pct)
+{
+	unsigned long long rank = (probes->received * pct + 99) / 100;
+	unsigned long long seen = 0;
+	for (size_t i = 0; i < PROBE_BUCKETS; i++) {
+		seen += probes->buckets[i];
+		if (seen < rank || seen == 0)
+			continue;
+		uint64_t value = bucket_value(i);
+		if (value < probes->min_rtt_ns)
+			return probes->min_rtt_ns;
+		return (value > probes->max_rtt_ns ? probes->max_rtt_ns : value);
+	}
+	return probes->max_rtt_ns;
+}
+
+void probe_print(FILE *f, const struct probe_stats *probes)
+{
+	fprintf(f, "probes: %llu sent, %llu replies, %llu reordered\n",
+		probes->sent, probes->received, probes->reordered);
+	if (probes->received == 0)
+		return;
+	fprintf(f, "rtt: min %.3fms avg %.3fms max %.3fms, p50 %.3fms p90 %.3fms"
+		" p99 %.3fms, jitter %.3fms\n", probes->min_rtt_ns / 1e6,
+		(double)(probes->sum_rtt_ns / probes->received) / 1e6,
+		probes->max_rtt_ns / 1e6, percentile(probes, 50) / 1e6,
+		percentile(probes, 90) / 1e6, percentile(probes, 99) / 1e6,
+		probes->jitter_ns / 1e6);
+}
@@ -0,0 +1,46 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Latency probes sent in-band in the framed output stream. The peer sends
+ * each probe back unchanged as a reply, so that the round trip covers both
+ * tuncat processes and the transport in between:
+ *
+ *   u64 sequence number, u64 send time (sender's monotonic clock)
+ */
+
+#define PROBE_PAYLOAD_LEN 16
+
+/* Round trip times are binned by their highest set bit, then by the next
+ * PROBE_SUB_BITS bits, which bounds the error of percentiles to 1/8 */
+#define PROBE_SUB_BITS 3
+#define PROBE_BUCKETS (64 << PROBE_SUB_BITS)
+
+struct probe_stats {
+	uint64_t interval_ns;
+	uint64_t next_sequence;
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long reordered;  /* replies older than a previous one */
+	uint64_t last_sequence;
+	uint64_t last_rtt_ns;
+	uint64_t min_rtt_ns;
+	uint64_t max_rtt_ns;
+	long double sum_rtt_ns;
+	double jitter_ns;              /* RFC 3550 smoothed RTT variation */
+	unsigned long long buckets[PROBE_BUCKETS];
+};
+
+void probe_init(struct probe_stats *probes, uint64_t interval_ns);
+/* Fills the payload of a new probe sent at now_ns (CLOCK_MONOTONIC) */
+void probe_build(struct probe_stats *probes, uint8_t *payload,
+	uint64_t now_ns);
+/* Accounts for a reply received at now_ns. Returns EINVAL if the payload
+ * is not one of ours. */
+int probe_reply(struct probe_stats *probes, const uint8_t *payload,
+	size_t len, uint64_t now_ns);
+void probe_print(FILE *f, const struct probe_stats *probes);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/select.h>
+#include "packet.h"
+#include "pool.h"
+#include "reflect.h"
+#include "tunnel.h"
+#include "util.h"
+
+#define PI_HEADER_LEN 4
+#define REFLECT_TTL 64
+
+static void swap(uint8_t *a, uint8_t *b, size_t len)
+{
+	uint8_t tmp[16];
+	memcpy(tmp, a, len);
+	memcpy(a, b, len);
+	memcpy(b, tmp, len);
+}
+
+/* Swapping addresses and ports leaves every checksum unchanged, since they
+ * are sums which include both: only the fields which get new values need
+ * an incremental update */
+int reflect_packet(uint8_t *data, size_t len, unsigned link)
+{
+	struct packet_info info;
+	if (packet_parse(data, len, link, &info) != 0)
+		return EINVAL;
+	uint8_t *ip = data + info.l3_off;
+	uint8_t *l4 = (info.l4_off != 0 ? data + info.l4_off : NULL);
+
+	if (info.proto == 1 || info.proto == 58) {
+		uint8_t request = (info.proto == 1 ? 8 : 128);
+		uint8_t reply = (info.proto == 1 ? 0 : 129);
+		if (l4 == NULL || len < (size_t)info.l4_off + 4 || l4[0] != request)
+			return EINVAL;
+		l4[0] = reply;
+		packet_checksum_update16(l4 + 2, request << 8 | l4[1],
+			reply << 8 | l4[1]);
+	} else if (l4 != NULL && info.sport != 0) {
+		swap(l4, l4 + 2, 2);
+	}
+
+	if (info.family == 4) {
+		swap(ip + 12, ip + 16, 4);
+		uint16_t old_word = get_be16(ip + 8);
+		ip[8] = REFLECT_TTL;
+		packet_checksum_update16(ip + 10, old_word, get_be16(ip + 8));
+	} else {
+		swap(ip + 8, ip + 24, 16);
+		ip[7] = REFLECT_TTL;
+	}
+	if (link & PACKET_LINK_ETHERNET) {
+		size_t off = (link & PACKET_LINK_PI ? PI_HEADER_LEN : 0);
+		swap(data + off, data + off + 6, 6);
+	}
+	return 0;
+}
+
+int reflect_run(int tun_fd, unsigned link, size_t buffer_len,
+	struct stats *stats)
+{
+	struct pool pool;
+	struct pool_buffer *batch[READ_BATCH_LEN];
+	int res = pool_init(&pool, READ_BATCH_LEN, buffer_len, 0);
+	if (res != 0)
+		return res;
+	for (int i = 0; i < READ_BATCH_LEN; i++)
+		batch[i] = pool_get(&pool);
+
+	while (res == 0 && interrupt_flag == 0) {
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(tun_fd, &read_set);
+		if (select(tun_fd + 1, &read_set, NULL, NULL, NULL) < 0) {
+			if (errno != EINTR) {
+				perror("select()");
+				res = errno;
+			}
+		}
+
+		/* Read a whole batch before writing it back, so that both
+		 * directions of the device are kept busy */
+		int count = 0;
+		while (res == 0 && count < READ_BATCH_LEN) {
+			struct pool_buffer *buffer = batch[count];
+			ssize_t len = read(tun_fd, buffer->data, buffer_len);
+			if (len < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					perror("read(tun)");
+					res = errno;
+				}
+				break;
+			}
+			stats->tun_rx_packets++;
+			stats->tun_rx_bytes += len;
+			buffer->len = len;
+			if (reflect_packet(buffer->data, len, link) != 0) {
+				stats->filtered++;
+				continue;
+			}
+			count++;
+		}
+		for (int i = 0; res == 0 && i < count; i++) {
+			res = inject_packet(tun_fd, batch[i]->data, batch[i]->len);
+			if (res == 0) {
+				stats->tun_tx_packets++;
+				stats->tun_tx_bytes += batch[i]->len;
+			} else if (res == EIO) {
+				stats->tun_tx_dropped++;
+				res = 0;
+			}
+		}
+
+		if (stats_flag != 0) {
+			stats_flag = 0;
+			stats_print(stderr, stats);
+		}
+	}
+	if (interrupt_flag != 0)
+		fprintf(stderr, "Received interrupt, exiting\n");
+
+	for (int i = 0; i < READ_BATCH_LEN; i++)
+		pool_put(&pool, batch[i]);
+	pool_destroy(&pool);
+	return (res == EINTR ? 0 : res);
+}
@@ -0,0 +1,20 @@
+#ifndef REFLECT_H
+#define REFLECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+/* Writes packets read from the device straight back to it, with source
+ * and destination swapped, to measure the packet rate of the kernel side
+ * of the tunnel. ICMP echo requests are answered, and other packets which
+ * cannot be reflected (other ICMP messages, non-IP) are counted as
+ * filtered. */
+int reflect_run(int tun_fd, unsigned link, size_t buffer_len,
+	struct stats *stats);
+
+/* Turns a packet into its reply in place. Returns EINVAL if it cannot be
+ * reflected. */
+int reflect_packet(uint8_t *data, size_t len, unsigned link);
+
+#endif
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "reorder.h"
+
+void reorder_init(struct reorder *reorder, uint64_t timeout_ns)
+{
+	memset(reorder, 0, sizeof(*reorder));
+	reorder->timeout_ns = timeout_ns;
+}
+
+void reorder_free(struct reorder *reorder)
+{
+	for (unsigned i = 0; i < REORDER_WINDOW; i++)
+		free(reorder->slots[i].data);
+}
+
+static struct reorder_slot *slot_of(struct reorder *reorder, uint32_t sequence)
+{
+	return &reorder->slots[sequence % REORDER_WINDOW];
+}
+
+static int is_held(struct reorder *reorder, uint32_t sequence)
+{
+	struct reorder_slot *slot = slot_of(reorder, sequence);
+	return (slot->valid && slot->sequence == sequence);
+}
+
+/* Moves next past a frame, delivered or given up on */
+static void advance(struct reorder *reorder, int delivered)
+{
+	reorder->seen = (reorder->seen << 1) | (delivered ? 1 : 0);
+	reorder->next++;
+}
+
+/* The wait for the missing frame at next starts with the first frame held
+ * after it */
+static void start_gap(struct reorder *reorder, uint64_t now)
+{
+	reorder->gap_since = now;
+	for (uint32_t i = 1; i < REORDER_WINDOW; i++) {
+		struct reorder_slot *slot = slot_of(reorder, reorder->next + i);
+		if (slot->valid && slot->sequence == reorder->next + i) {
+			reorder->gap_since = slot->arrival;
+			return;
+		}
+	}
+}
+
+int reorder_hold(struct reorder *reorder, uint32_t sequence)
+{
+	if (!reorder->started) {
+		reorder->started = 1;
+		reorder->next = sequence;
+		advance(reorder, 1);
+		reorder->skip_to = reorder->next;
+		return REORDER_DELIVER;
+	}
+	int32_t ahead = (int32_t)(sequence - reorder->next);
+	if (ahead == 0) {
+		advance(reorder, 1);
+		return REORDER_DELIVER;
+	}
+	if (ahead < 0 && ahead >= -64) {
+		/* Sent twice, or rebuilt from parity before it came in */
+		uint64_t bit = 1ULL << (-ahead - 1);
+		if (reorder->seen & bit) {
+			reorder->duplicates++;
+			return REORDER_DROP;
+		}
+		reorder->seen |= bit;
+		return REORDER_DELIVER;
+	}
+	if (ahead < 0) {
+		/* Too late, or a peer which started over */
+		if (ahead <= -REORDER_WINDOW && reorder->held == 0) {
+			reorder->next = sequence;
+			advance(reorder, 1);
+			reorder->skip_to = reorder->next;
+		}
+		return REORDER_DELIVER;
+	}
+	if (is_held(reorder, sequence)) {
+		reorder->duplicates++;
+		return REORDER_DROP;
+	}
+	if (ahead >= REORDER_WINDOW)
+		reorder->skip_to = sequence - REORDER_WINDOW + 1;
+	return REORDER_HOLD;
+}
+
+uint8_t *reorder_store(struct reorder *reorder, uint32_t sequence,
+	size_t len, uint64_t now)
+{
+	struct reorder_slot *slot = slot_of(reorder, sequence);
+	if (slot->cap < len) {
+		uint8_t *data = realloc(slot->data, len);
+		if (data == NULL)
+			return NULL;
+		slot->data = data;
+		slot->cap = len;
+	}
+	if (reorder->held == 0)
+		reorder->gap_since = now;
+	slot->sequence = sequence;
+	slot->valid = 1;
+	slot->len = len;
+	slot->arrival = now;
+	reorder->held++;
+	reorder->held_total++;
+	return slot->data;
+}
+
+int reorder_pop(struct reorder *reorder, uint64_t now, uint8_t **frame,
+	size_t *len)
+{
+	while (reorder->held > 0 ||
+		(int32_t)(reorder->skip_to - reorder->next) > 0) {
+		struct reorder_slot *slot = slot_of(reorder, reorder->next);
+		if (slot->valid && slot->sequence == reorder->next) {
+			slot->valid = 0;
+			reorder->held--;
+			advance(reorder, 1);
+			if (reorder->held > 0 && !is_held(reorder, reorder->next))
+				start_gap(reorder, now);
+			*frame = slot->data;
+			*len = slot->len;
+			return 1;
+		}
+		if ((int32_t)(reorder->skip_to - reorder->next) <= 0 &&
+			now - reorder->gap_since < reorder->timeout_ns)
+			return 0;
+		/* Given up on, along with the rest of the gap */
+		advance(reorder, 0);
+		reorder->skipped++;
+	}
+	reorder->skip_to = reorder->next;
+	return 0;
+}
+
+uint64_t reorder_deadline(const struct reorder *reorder)
+{
+	if (reorder->held == 0)
+		return UINT64_MAX;
+	return reorder->gap_since + reorder->timeout_ns;
+}
@@ -0,0 +1,62 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Puts numbered frames back in order, for those striped over several
+ * paths whose latencies differ. A frame ahead of the next expected one is
+ * held until the missing ones arrive, or until it has waited for the
+ * timeout, after which they are given up on. Frames later than that are
+ * let through as they come, unless they were already delivered. */
+
+#define REORDER_WINDOW 256
+
+#define REORDER_DELIVER 0
+#define REORDER_HOLD 1
+#define REORDER_DROP 2     /* already delivered */
+
+struct reorder_slot {
+	uint32_t sequence;
+	int valid;
+	size_t len;
+	size_t cap;
+	uint64_t arrival;
+	uint8_t *data;             /* frame, without CRC */
+};
+
+struct reorder {
+	int started;
+	uint32_t next;
+	uint64_t seen;             /* bit i is set if next - 1 - i was delivered */
+	unsigned held;
+	/* Frames up to there are released without waiting, to make room */
+	uint32_t skip_to;
+	/* When the first frame held after the missing one at next arrived */
+	uint64_t gap_since;
+	uint64_t timeout_ns;
+	unsigned long long held_total;
+	unsigned long long skipped;  /* frames given up on */
+	unsigned long long duplicates;
+	struct reorder_slot slots[REORDER_WINDOW];
+};
+
+void reorder_init(struct reorder *reorder, uint64_t timeout_ns);
+void reorder_free(struct reorder *reorder);
+/* Returns REORDER_HOLD if a frame has to wait for earlier ones (see
+ * reorder_store()), REORDER_DELIVER if it can be delivered right away,
+ * REORDER_DROP if it was already */
+int reorder_hold(struct reorder *reorder, uint32_t sequence);
+/* Returns a buffer to copy a held frame of len bytes into, NULL if out of
+ * memory. Frames due before it are to be popped first. */
+uint8_t *reorder_store(struct reorder *reorder, uint32_t sequence,
+	size_t len, uint64_t now);
+/* Returns 1 and the next frame due at now, in order, 0 if there is none.
+ * It stays valid until the next call. */
+int reorder_pop(struct reorder *reorder, uint64_t now, uint8_t **frame,
+	size_t *len);
+/* When reorder_pop() will next have something to return if nothing else
+ * arrives, UINT64_MAX if nothing is held */
+uint64_t reorder_deadline(const struct reorder *reorder);
+
+#endif
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "route.h"
+#include "util.h"
+
+#define TBL24_LEN (1U << 24)
+#define TBL8_LEN 256
+#define TBL8_FLAG 0x8000
+
+struct route {
+	uint8_t family;
+	uint8_t len;
+	uint16_t hop;
+	unsigned line;
+	uint8_t prefix[16];
+};
+
+static int bit_at(const uint8_t *addr, unsigned i)
+{
+	return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* Clears the bits of an address of size bytes after the first len ones */
+static void mask_prefix(uint8_t *addr, unsigned len, unsigned size)
+{
+	if (len % 8 != 0)
+		addr[len / 8] &= 0xff << (8 - len % 8);
+	for (unsigned i = (len + 7) / 8; i < size; i++)
+		addr[i] = 0;
+}
+
+static int prefix_match(const uint8_t *addr, const uint8_t *prefix,
+	unsigned len)
+{
+	unsigned bytes = len / 8;
+	unsigned bits = len % 8;
+	if (memcmp(addr, prefix, bytes) != 0)
+		return 0;
+	if (bits == 0)
+		return 1;
+	uint8_t mask = 0xff << (8 - bits);
+	return (addr[bytes] & mask) == (prefix[bytes] & mask);
+}
+
+static int parse_prefix(char *token, struct route *route)
+{
+	char *slash = strchr(token, '/');
+	if (slash != NULL)
+		*slash = '\0';
+	unsigned long max = 0;
+	if (inet_pton(AF_INET, token, route->prefix) == 1) {
+		route->family = 4;
+		max = 32;
+	} else if (inet_pton(AF_INET6, token, route->prefix) == 1) {
+		route->family = 6;
+		max = 128;
+	} else {
+		return EINVAL;
+	}
+	unsigned long len = max;
+	if (slash != NULL) {
+		char *endptr = NULL;
+		len = strtoul(slash + 1, &endptr, 10);
+		if (slash[1] == '\0' || *endptr != '\0' || len > max)
+			return EINVAL;
+	}
+	route->len = len;
+	mask_prefix(route->prefix, len, max / 8);
+	return 0;
+}
+
+static int parse_target(const char *token, uint16_t *hop)
+{
+	uint16_t flag = ROUTE_DEVICE;
+	if (strncmp(token, "peer", 4) == 0) {
+		flag = ROUTE_PEER;
+		if (token[4] == '\0') {
+			*hop = flag;
+			return 0;
+		}
+		if (token[4] != ':')
+			return EINVAL;
+		token += 5;
+	}
+	char *endptr = NULL;
+	errno = 0;
+	unsigned long target = strtoul(token, &endptr, 10);
+	if (token[0] < '0' || token[0] > '9' || *endptr != '\0' || errno != 0 ||
+		target > ROUTE_TARGET_MASK)
+		return EINVAL;
+	*hop = flag | target;
+	return 0;
+}
+
+static int read_routes(const char *path, struct route **routes,
+	unsigned *count)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		int res = errno;
+		fprintf(stderr, "Error: unable to open routes %s: %s\n", path,
+			strerror(res));
+		return res;
+	}
+	char *line = NULL;
+	size_t line_cap = 0;
+	unsigned line_number = 0;
+	unsigned cap = 0;
+	int res = 0;
+	*routes = NULL;
+	*count = 0;
+	while (res == 0 && getline(&line, &line_cap, f) >= 0) {
+		line_number++;
+		char *p = line + strspn(line, " \t\r\n");
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (*count == cap) {
+			cap = (cap == 0 ? 64 : cap * 2);
+			struct route *grown = realloc(*routes, cap * sizeof(**routes));
+			if (grown == NULL) {
+				res = ENOMEM;
+				break;
+			}
+			*routes = grown;
+		}
+		struct route *route = &(*routes)[*count];
+		char prefix[64];
+		char target[16];
+		char extra = 0;
+		route->line = line_number;
+		if (sscanf(p, "%63s %15s %c", prefix, target, &extra) != 2 ||
+			parse_prefix(prefix, route) != 0 ||
+			parse_target(target, &route->hop) != 0) {
+			fprintf(stderr, "Error: %s:%u: invalid route\n", path,
+				line_number);
+			res = EINVAL;
+			break;
+		}
+		(*count)++;
+	}
+	free(line);
+	fclose(f);
+	if (res != 0) {
+		free(*routes);
+		*routes = NULL;
+	}
+	return res;
+}
+
+/* Shorter prefixes first, so that longer ones are written over them, and
+ * routes of the same length in the order of the file */
+static int compare_routes(const void *a, const void *b)
+{
+	const struct route *ra = a;
+	const struct route *rb = b;
+	if (ra->len != rb->len)
+		return (ra->len < rb->len ? -1 : 1);
+	return (ra->line < rb->line ? -1 : (ra->line > rb->line));
+}
+
+static int add_route4(struct route_table *table, const struct route *route)
+{
+	uint32_t addr = get_be32(route->prefix);
+	if (route->len <= 24) {
+		uint32_t first = addr >> 8;
+		uint32_t last = first + (1U << (24 - route->len));
+		for (uint32_t i = first; i < last; i++)
+			table->tbl24[i] = route->hop;
+		return 0;
+	}
+	uint16_t *entry = &table->tbl24[addr >> 8];
+	if (!(*entry & TBL8_FLAG)) {
+		if (table->tbl8_count == ROUTE_MAX_TBL8) {
+			fprintf(stderr, "Error: too many /24 with longer IPv4 routes\n");
+			return ENOSPC;
+		}
+		if (table->tbl8_count == table->tbl8_cap) {
+			unsigned cap = (table->tbl8_cap == 0 ? 16 : table->tbl8_cap * 2);
+			uint16_t *grown = realloc(table->tbl8,
+				(size_t)cap * TBL8_LEN * sizeof(*grown));
+			if (grown == NULL)
+				return ENOMEM;
+			table->tbl8 = grown;
+			table->tbl8_cap = cap;
+		}
+		/* Addresses of the group not covered by the longer routes keep
+		 * the route of the whole /24 */
+		uint16_t *group = table->tbl8 + (size_t)table->tbl8_count * TBL8_LEN;
+		for (unsigned i = 0; i < TBL8_LEN; i++)
+			group[i] = *entry;
+		*entry = TBL8_FLAG | table->tbl8_count++;
+	}
+	uint16_t *group = table->tbl8 + (size_t)(*entry & ~TBL8_FLAG) * TBL8_LEN;
+	uint32_t first = addr & 0xff;
+	uint32_t last = first + (1U << (32 - route->len));
+	for (uint32_t i = first; i < last; i++)
+		group[i] = route->hop;
+	return 0;
+}
+
+static struct route_node *new_node(const uint8_t *prefix, unsigned len,
+	uint16_t hop)
+{
+	struct route_node *node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		return NULL;
+	memcpy(node->prefix, prefix, sizeof(node->prefix));
+	mask_prefix(node->prefix, len, sizeof(node->prefix));
+	node->len = len;
+	node->hop = hop;
+	return node;
+}
+
+static int add_route6(struct route_table *table, const struct route *route)
+{
+	struct route_node **link = &table->root6;
+	for (;;) {
+		struct route_node *node = *link;
+		if (node == NULL) {
+			*link = new_node(route->prefix, route->len, route->hop);
+			return (*link == NULL ? ENOMEM : 0);
+		}
+		unsigned max = (node->len < route->len ? node->len : route->len);
+		unsigned common = 0;
+		while (common < max && bit_at(node->prefix, common) ==
+			bit_at(route->prefix, common))
+			common++;
+		if (common == node->len && common == route->len) {
+			node->hop = route->hop;
+			return 0;
+		}
+		if (common == node->len) {
+			link = &node->child[bit_at(route->prefix, node->len)];
+			continue;
+		}
+		/* The route, or the point where it branches off, goes between
+		 * the node and its parent */
+		struct route_node *parent = new_node(route->prefix, common,
+			(common == route->len ? route->hop : ROUTE_NONE));
+		if (parent == NULL)
+			return ENOMEM;
+		parent->child[bit_at(node->prefix, common)] = node;
+		if (common < route->len) {
+			struct route_node *leaf = new_node(route->prefix, route->len,
+				route->hop);
+			if (leaf == NULL) {
+				free(parent);
+				return ENOMEM;
+			}
+			parent->child[bit_at(route->prefix, common)] = leaf;
+		}
+		*link = parent;
+		return 0;
+	}
+}
+
+static void free_nodes(struct route_node *node)
+{
+	if (node == NULL)
+		return;
+	free_nodes(node->child[0]);
+	free_nodes(node->child[1]);
+	free(node);
+}
+
+static void free_tables(struct route_table *table)
+{
+	free(table->tbl24);
+	free(table->tbl8);
+	free_nodes(table->root6);
+	table->tbl24 = NULL;
+	table->tbl8 = NULL;
+	table->tbl8_count = 0;
+	table->tbl8_cap = 0;
+	table->root6 = NULL;
+}
+
+static int build_tables(struct route_table *table, struct route *routes,
+	unsigned count)
+{
+	table->tbl24 = calloc(TBL24_LEN, sizeof(*table->tbl24));
+	if (table->tbl24 == NULL)
+		return ENOMEM;
+	qsort(routes, count, sizeof(*routes), compare_routes);
+	int res = 0;
+	for (unsigned i = 0; res == 0 && i < count; i++) {
+		if (routes[i].family == 4)
+			res = add_route4(table, &routes[i]);
+		else
+			res = add_route6(table, &routes[i]);
+	}
+	table->count = count;
+	return res;
+}
+
+int route_table_reload(struct route_table *table)
+{
+	struct route *routes = NULL;
+	unsigned count = 0;
+	int res = read_routes(table->path, &routes, &count);
+	if (res != 0)
+		return res;
+	struct route_table fresh = {
+		.path = table->path,
+	};
+	res = build_tables(&fresh, routes, count);
+	free(routes);
+	if (res != 0) {
+		free_tables(&fresh);
+		return res;
+	}
+	free_tables(table);
+	*table = fresh;
+	return 0;
+}
+
+int route_table_open(struct route_table **table, const char *path)
+{
+	struct route_table *t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return ENOMEM;
+	t->path = path;
+	int res = route_table_reload(t);
+	if (res != 0) {
+		free(t);
+		return res;
+	}
+	*table = t;
+	return 0;
+}
+
+void route_table_close(struct route_table *table)
+{
+	if (table == NULL)
+		return;
+	free_tables(table);
+	free(table);
+}
+
+static uint16_t lookup6(const struct route_table *table, const uint8_t *addr)
+{
+	uint16_t hop = ROUTE_NONE;
+	const struct route_node *node = table->root6;
+	while (node != NULL && prefix_match(addr, node->prefix, node->len)) {
+		if (node->hop != ROUTE_NONE)
+			hop = node->hop;
+		if (node->len == 128)
+			break;
+		node = node->child[bit_at(addr, node->len)];
+	}
+	return hop;
+}
+
+uint16_t route_lookup(const struct route_table *table, uint8_t family,
+	const uint8_t *addr)
+{
+	if (family == 6)
+		return lookup6(table, addr);
+	if (family != 4)
+		return ROUTE_NONE;
+	uint32_t a = get_be32(addr);
+	uint16_t entry = table->tbl24[a >> 8];
+	if (entry & TBL8_FLAG)
+		entry = table->tbl8[(size_t)(entry & ~TBL8_FLAG) * TBL8_LEN + (a & 0xff)];
+	return entry;
+}
+
+void route_lookup_batch(const struct route_table *table,
+	const struct packet_info *infos, size_t count, uint16_t *hops)
+{
+	/* Entries of the first table are spread over 32 MiB, so that most
+	 * lookups miss the cache: they are all requested before the first
+	 * one is read, then those of the groups they point to */
+	for (size_t i = 0; i < count; i++) {
+		if (infos[i].family == 4)
+			__builtin_prefetch(&table->tbl24[get_be32(infos[i].dst) >> 8]);
+	}
+	for (size_t i = 0; i < count; i++) {
+		hops[i] = ROUTE_NONE;
+		if (infos[i].family != 4)
+			continue;
+		uint32_t a = get_be32(infos[i].dst);
+		hops[i] = table->tbl24[a >> 8];
+		if (hops[i] & TBL8_FLAG)
+			__builtin_prefetch(&table->tbl8[(size_t)(hops[i] & ~TBL8_FLAG) *
+				TBL8_LEN + (a & 0xff)]);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (infos[i].family == 4 && (hops[i] & TBL8_FLAG))
+			hops[i] = table->tbl8[(size_t)(hops[i] & ~TBL8_FLAG) *
+				TBL8_LEN + (get_be32(infos[i].dst) & 0xff)];
+		else if (infos[i].family == 6)
+			hops[i] = lookup6(table, infos[i].dst);
+	}
+}
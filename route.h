@@ -0,0 +1,67 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "packet.h"
+
+/* Longest prefix match of destination addresses, to route packets read
+ * from devices to other devices or to the peer. Routes are read from a
+ * file of lines:
+ *
+ *   prefix/len target
+ *
+ * target being a device, by its channel number (see --channels), or
+ * peer[:N] for the stream, on channel N (default 0). Empty lines and those
+ * starting with # are skipped, later routes replace earlier ones for the
+ * same prefix.
+ *
+ * IPv4 uses DIR-24-8 tables: an entry per /24, holding either the hop of
+ * the longest route of up to 24 bits covering it, or the index of a group
+ * of 256 entries for each of its addresses once a longer route falls in
+ * it, so that lookups take one or two memory accesses. IPv6 uses a binary
+ * trie with a node per route and per branching point only. Tables are
+ * built anew from the file, and replace the old ones once complete. */
+
+/* Hops: 0 if there is no route, or a flag and a device or channel number */
+#define ROUTE_NONE 0
+#define ROUTE_DEVICE 0x1000
+#define ROUTE_PEER 0x2000
+#define ROUTE_TARGET_MASK 0x0fff
+
+/* Groups of 256 entries, which entries of the first table point to with
+ * the top bit set */
+#define ROUTE_MAX_TBL8 0x8000
+
+struct route_node {
+	uint8_t prefix[16];
+	uint8_t len;
+	uint16_t hop;              /* ROUTE_NONE for branching points */
+	struct route_node *child[2];
+};
+
+struct route_table {
+	const char *path;
+	uint16_t *tbl24;
+	uint16_t *tbl8;
+	unsigned tbl8_count;
+	unsigned tbl8_cap;
+	struct route_node *root6;
+	unsigned count;
+};
+
+/* Loads the routes of a file */
+int route_table_open(struct route_table **table, const char *path);
+/* Loads the routes of the file again, keeping the current ones if it
+ * cannot be read */
+int route_table_reload(struct route_table *table);
+void route_table_close(struct route_table *table);
+/* Hop of a single IPv4/IPv6 address */
+uint16_t route_lookup(const struct route_table *table, uint8_t family,
+	const uint8_t *addr);
+/* Hops of the destinations of count packets, with the table entries of
+ * all of them fetched before any is needed */
+void route_lookup_batch(const struct route_table *table,
+	const struct packet_info *infos, size_t count, uint16_t *hops);
+
+#endif
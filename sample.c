@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "packet.h"
+#include "sample.h"
+#include "util.h"
+
+/* Fixed, so that taps on both ends of a tunnel sample the same flows */
+#define SAMPLE_FLOW_SEED 0x5a4d504c
+
+int sampler_parse(struct sampler *sampler, const char *spec, unsigned link)
+{
+	if (sampler == NULL || spec == NULL)
+		return EINVAL;
+
+	memset(sampler, 0, sizeof(*sampler));
+	sampler->mode = SAMPLE_COUNT;
+	sampler->link = link;
+	const char *colon = strchr(spec, ':');
+	if (colon != NULL) {
+		size_t len = colon - spec;
+		if (len == 5 && strncmp(spec, "count", len) == 0) {
+			sampler->mode = SAMPLE_COUNT;
+		} else if (len == 6 && strncmp(spec, "random", len) == 0) {
+			sampler->mode = SAMPLE_RANDOM;
+		} else if (len == 4 && strncmp(spec, "flow", len) == 0) {
+			sampler->mode = SAMPLE_FLOW;
+		} else {
+			fprintf(stderr, "Error: unknown sampling mode\n");
+			return EINVAL;
+		}
+		spec = colon + 1;
+	}
+
+	char *endptr = NULL;
+	errno = 0;
+	unsigned long rate = strtoul(spec, &endptr, 10);
+	if (*spec == '\0' || *endptr != '\0' || errno != 0 || rate == 0 ||
+		rate > UINT32_MAX) {
+		fprintf(stderr, "Error: invalid sampling rate\n");
+		return EINVAL;
+	}
+	sampler->rate = rate;
+	sampler->countdown = 1;
+	sampler->rng = now_ns(CLOCK_MONOTONIC) | 1;
+	if (rate == 1)
+		sampler->mode = SAMPLE_NONE;
+	return 0;
+}
+
+int sampler_keep(struct sampler *sampler, const uint8_t *data, size_t len)
+{
+	struct packet_info info;
+
+	switch (sampler->mode) {
+	case SAMPLE_NONE:
+		return 1;
+	case SAMPLE_COUNT:
+		if (--sampler->countdown != 0)
+			return 0;
+		sampler->countdown = sampler->rate;
+		return 1;
+	case SAMPLE_RANDOM:
+		/* xorshift64*, then scale to [0, rate) without a division */
+		sampler->rng ^= sampler->rng >> 12;
+		sampler->rng ^= sampler->rng << 25;
+		sampler->rng ^= sampler->rng >> 27;
+		return (((sampler->rng * 0x2545f4914f6cdd1dULL) >> 32) *
+			sampler->rate >> 32) == 0;
+	case SAMPLE_FLOW:
+		packet_parse(data, len, sampler->link, &info);
+		return packet_flow_hash(&info, SAMPLE_FLOW_SEED) % sampler->rate == 0;
+	}
+	return 1;
+}
@@ -0,0 +1,30 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packet sampling for monitoring outputs, applied right after packets are
+ * read so that skipped packets cost nothing more */
+
+enum sample_mode {
+	SAMPLE_NONE,
+	SAMPLE_COUNT,  /* every Nth packet */
+	SAMPLE_RANDOM, /* each packet with probability 1/N */
+	SAMPLE_FLOW,   /* all packets of 1/N of the flows */
+};
+
+struct sampler {
+	enum sample_mode mode;
+	uint32_t rate;
+	uint32_t countdown;
+	uint64_t rng;
+	unsigned link;
+};
+
+/* Parses "N", "count:N", "random:N" or "flow:N" */
+int sampler_parse(struct sampler *sampler, const char *spec, unsigned link);
+
+int sampler_keep(struct sampler *sampler, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "scan.h"
+#include "util.h"
+
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+
+struct scan_job {
+	struct capture_reader *reader;
+	size_t block;
+};
+
+struct scan_state {
+	const struct scan_options *options;
+	struct scan_job *jobs;
+	size_t job_count;
+	atomic_size_t next_job;
+	/* Outputs are written in job order: a worker which finished job i
+	 * waits until job i - 1 has been written */
+	size_t written;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct scan_worker {
+	pthread_t thread;
+	struct scan_state *state;
+	struct scan_counters counters;
+	uint8_t *block;
+	size_t block_cap;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_cap;
+};
+
+static unsigned packet_link(const struct capture_reader *reader)
+{
+	unsigned link = 0;
+	if (capture_reader_link_type(reader) == CAPTURE_LINK_ETHERNET)
+		link |= PACKET_LINK_ETHERNET;
+	if (capture_reader_flags(reader) & CAPTURE_FLAG_PI)
+		link |= PACKET_LINK_PI;
+	return link;
+}
+
+static int emit_pcap_record(struct scan_worker *worker, uint64_t ts,
+	const uint8_t *data, size_t len)
+{
+	size_t need = worker->out_len + PCAP_RECORD_LEN + len;
+	if (need > worker->out_cap) {
+		size_t cap = (worker->out_cap == 0 ? 65536 : worker->out_cap);
+		while (cap < need)
+			cap *= 2;
+		void *tmp = realloc(worker->out, cap);
+		if (tmp == NULL)
+			return ENOMEM;
+		worker->out = tmp;
+		worker->out_cap = cap;
+	}
+	uint8_t *record = worker->out + worker->out_len;
+	put_le32(record, ts / 1000000000ULL);
+	put_le32(record + 4, ts % 1000000000ULL);
+	put_le32(record + 8, len);
+	put_le32(record + 12, len);
+	memcpy(record + PCAP_RECORD_LEN, data, len);
+	worker->out_len = need;
+	return 0;
+}
+
+static int scan_block(struct scan_worker *worker, const struct scan_job *job)
+{
+	const struct scan_options *options = worker->state->options;
+	size_t len = 0;
+	size_t pos = 0;
+	unsigned link = packet_link(job->reader);
+	size_t skip = (link & PACKET_LINK_PI) ? 4 : 0;
+
+	int res = capture_reader_read_block(job->reader, job->block,
+		&worker->block, &worker->block_cap, &len);
+	worker->counters.blocks++;
+	while (res == 0) {
+		uint64_t ts = 0;
+		const uint8_t *data = NULL;
+		size_t data_len = 0;
+		struct packet_info info;
+		res = capture_block_next(worker->block, len, &pos, &ts, &data,
+			&data_len);
+		if (res != 0)
+			break;
+		if (ts < options->from_ns || ts >= options->to_ns)
+			continue;
+		worker->counters.packets++;
+		packet_parse(data, data_len, link, &info);
+		if (!filter_match(options->filter, &info))
+			continue;
+		worker->counters.matched++;
+		worker->counters.matched_bytes += data_len;
+		if (info.family != 0 && info.proto == 6)
+			worker->counters.tcp++;
+		else if (info.family != 0 && info.proto == 17)
+			worker->counters.udp++;
+		else if (info.family != 0 && (info.proto == 1 || info.proto == 58))
+			worker->counters.icmp++;
+		else
+			worker->counters.other++;
+		if (options->out_fd >= 0 && data_len >= skip)
+			res = emit_pcap_record(worker, ts, data + skip, data_len - skip);
+	}
+	return (res == ENODATA ? 0 : res);
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_worker *worker = arg;
+	struct scan_state *state = worker->state;
+
+	while (1) {
+		size_t i = atomic_fetch_add(&state->next_job, 1);
+		if (i >= state->job_count)
+			break;
+		worker->out_len = 0;
+		int res = scan_block(worker, &state->jobs[i]);
+
+		pthread_mutex_lock(&state->lock);
+		while (state->written != i)
+			pthread_cond_wait(&state->cond, &state->lock);
+		if (res != 0 && state->error == 0)
+			state->error = res;
+		if (state->error == 0 && worker->out_len > 0)
+			state->error = write_all(state->options->out_fd, worker->out,
+				worker->out_len);
+		state->written++;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+	return NULL;
+}
+
+static int build_jobs(struct scan_state *state, struct capture_reader **readers,
+	size_t reader_count)
+{
+	size_t cap = 0;
+	for (size_t r = 0; r < reader_count; r++)
+		cap += capture_reader_block_count(readers[r]);
+	state->jobs = calloc(cap + 1, sizeof(*state->jobs));
+	if (state->jobs == NULL)
+		return ENOMEM;
+
+	for (size_t r = 0; r < reader_count; r++) {
+		size_t count = capture_reader_block_count(readers[r]);
+		for (size_t b = 0; b < count; b++) {
+			uint64_t first = 0;
+			uint64_t last = 0;
+			capture_reader_block_range(readers[r], b, &first, &last);
+			if (last < state->options->from_ns ||
+				first >= state->options->to_ns)
+				continue;
+			state->jobs[state->job_count].reader = readers[r];
+			state->jobs[state->job_count].block = b;
+			state->job_count++;
+		}
+	}
+	return 0;
+}
+
+static int write_pcap_header(int fd, struct capture_reader **readers,
+	size_t reader_count)
+{
+	uint8_t header[PCAP_HEADER_LEN];
+	uint16_t link_type = capture_reader_link_type(readers[0]);
+	for (size_t r = 1; r < reader_count; r++) {
+		if (capture_reader_link_type(readers[r]) != link_type) {
+			fprintf(stderr, "Error: cannot export captures of different"
+				" link types together\n");
+			return EINVAL;
+		}
+	}
+	put_le32(header, 0xa1b23c4d); /* nanosecond resolution */
+	put_le16(header + 4, 2);
+	put_le16(header + 6, 4);
+	put_le32(header + 8, 0);
+	put_le32(header + 12, 0);
+	put_le32(header + 16, 65535);
+	put_le32(header + 20, link_type);
+	return write_all(fd, header, sizeof(header));
+}
+
+int scan_captures(struct capture_reader **readers, size_t reader_count,
+	const struct scan_options *options, struct scan_counters *counters)
+{
+	if (readers == NULL || reader_count == 0 || options == NULL ||
+		counters == NULL)
+		return EINVAL;
+
+	struct scan_state state;
+	memset(&state, 0, sizeof(state));
+	state.options = options;
+	atomic_init(&state.next_job, 0);
+	int res = build_jobs(&state, readers, reader_count);
+	if (res == 0 && options->out_fd >= 0)
+		res = write_pcap_header(options->out_fd, readers, reader_count);
+	if (res != 0) {
+		free(state.jobs);
+		return res;
+	}
+
+	unsigned threads = options->threads;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0 ? cpus : 1);
+	}
+	if (threads > state.job_count)
+		threads = (state.job_count > 0 ? state.job_count : 1);
+	struct scan_worker *workers = calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		free(state.jobs);
+		return ENOMEM;
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	unsigned started = 0;
+	for (; started < threads; started++) {
+		workers[started].state = &state;
+		if (pthread_create(&workers[started].thread, NULL, &scan_thread,
+			&workers[started]) != 0)
+			break;
+	}
+	if (started == 0)
+		res = EAGAIN;
+
+	memset(counters, 0, sizeof(*counters));
+	for (unsigned i = 0; i < started; i++) {
+		struct scan_counters *c = &workers[i].counters;
+		pthread_join(workers[i].thread, NULL);
+		counters->blocks += c->blocks;
+		counters->packets += c->packets;
+		counters->matched += c->matched;
+		counters->matched_bytes += c->matched_bytes;
+		counters->tcp += c->tcp;
+		counters->udp += c->udp;
+		counters->icmp += c->icmp;
+		counters->other += c->other;
+		free(workers[i].block);
+		free(workers[i].out);
+	}
+	if (res == 0)
+		res = state.error;
+
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+	free(workers);
+	free(state.jobs);
+	return res;
+}
@@ -0,0 +1,35 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "capture.h"
+#include "filter.h"
+
+struct scan_options {
+	const struct filter *filter; /* NULL to match everything */
+	uint64_t from_ns;
+	uint64_t to_ns;
+	unsigned threads;            /* 0 for one per online CPU */
+	int out_fd;                  /* matching packets are written there as
+	                              * pcap, or counted if -1 */
+};
+
+struct scan_counters {
+	unsigned long blocks;
+	unsigned long packets;
+	unsigned long matched;
+	unsigned long long matched_bytes;
+	unsigned long tcp;
+	unsigned long udp;
+	unsigned long icmp;
+	unsigned long other;
+};
+
+/* Scans captures block by block on several threads. Matching packets are
+ * written in file then block order, so that the output is the same as a
+ * sequential scan's. */
+int scan_captures(struct capture_reader **readers, size_t reader_count,
+	const struct scan_options *options, struct scan_counters *counters);
+
+#endif
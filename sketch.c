@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "sketch.h"
+
+#define SEED_SRC 0x736b7331
+#define SEED_SRC2 0x736b7332
+#define SEED_DST 0x736b7333
+#define SEED_FLOW 0x736b7334
+
+/* Hashes are computed on four packets at a time, with vector extensions
+ * which the compiler maps to SSE2/NEON */
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+static u32x4 rotl4(u32x4 v, int r)
+{
+	return (v << r) | (v >> (32 - r));
+}
+
+static u32x4 mix4(u32x4 h, u32x4 v)
+{
+	v *= 0xcc9e2d51U;
+	v = rotl4(v, 15);
+	v *= 0x1b873593U;
+	h ^= v;
+	h = rotl4(h, 13);
+	return h * 5U + 0xe6546b64U;
+}
+
+static u32x4 fmix4(u32x4 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static u32x4 load4(const uint32_t *p)
+{
+	u32x4 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static u32x4 hash_words4(uint32_t words[4][SKETCH_BATCH_LEN], size_t i,
+	uint32_t seed)
+{
+	u32x4 h = { seed, seed, seed, seed };
+	for (int w = 0; w < 4; w++)
+		h = mix4(h, load4(&words[w][i]));
+	return h;
+}
+
+int sketch_init(struct sketch *sketch, unsigned link, size_t top_len)
+{
+	if (sketch == NULL || top_len == 0 || top_len > SKETCH_TOP_MAX)
+		return EINVAL;
+	memset(sketch, 0, sizeof(*sketch));
+	sketch->link = link;
+	sketch->top_max = top_len;
+	return 0;
+}
+
+void sketch_add(struct sketch *sketch, const uint8_t *data, size_t len)
+{
+	struct packet_info info;
+	size_t i = sketch->pending;
+
+	if (packet_parse(data, len, sketch->link, &info) != 0)
+		return;
+	memcpy(&sketch->src_addr[i], info.src, 16);
+	sketch->src_family[i] = info.family;
+	for (int w = 0; w < 4; w++) {
+		memcpy(&sketch->src[w][i], info.src + 4 * w, 4);
+		memcpy(&sketch->dst[w][i], info.dst + 4 * w, 4);
+	}
+	/* Keep v4 and v6 addresses with the same bits apart */
+	sketch->src[3][i] ^= info.family;
+	sketch->dst[3][i] ^= info.family;
+	sketch->tuple[i] = ((uint32_t)info.sport << 16 | info.dport) ^
+		((uint32_t)info.proto << 8);
+	sketch->bytes[i] = len;
+	if (++sketch->pending == SKETCH_BATCH_LEN)
+		sketch_flush(sketch);
+}
+
+static void hll_add(uint8_t *registers, uint32_t hash)
+{
+	uint32_t index = hash >> (32 - SKETCH_HLL_BITS);
+	uint32_t rest = hash << SKETCH_HLL_BITS;
+	uint8_t rank = (rest == 0 ? 32 - SKETCH_HLL_BITS + 1 :
+		__builtin_clz(rest) + 1);
+	if (registers[index] < rank)
+		registers[index] = rank;
+}
+
+static double hll_estimate(const uint8_t *registers)
+{
+	const double m = 1 << SKETCH_HLL_BITS;
+	double sum = 0;
+	unsigned zeros = 0;
+	for (size_t i = 0; i < (1 << SKETCH_HLL_BITS); i++) {
+		sum += ldexp(1.0, -registers[i]);
+		zeros += (registers[i] == 0);
+	}
+	double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+	return estimate;
+}
+
+static void top_sift_down(struct sketch *sketch, size_t i)
+{
+	struct sketch_talker *top = sketch->top;
+	while (1) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		if (l < sketch->top_len && top[l].bytes < top[min].bytes)
+			min = l;
+		if (r < sketch->top_len && top[r].bytes < top[min].bytes)
+			min = r;
+		if (min == i)
+			return;
+		struct sketch_talker tmp = top[i];
+		top[i] = top[min];
+		top[min] = tmp;
+		i = min;
+	}
+}
+
+static void top_sift_up(struct sketch *sketch, size_t i)
+{
+	struct sketch_talker *top = sketch->top;
+	while (i > 0 && top[(i - 1) / 2].bytes > top[i].bytes) {
+		struct sketch_talker tmp = top[i];
+		top[i] = top[(i - 1) / 2];
+		top[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static void top_update(struct sketch *sketch, size_t i, uint32_t hash,
+	uint64_t estimate)
+{
+	for (size_t j = 0; j < sketch->top_len; j++) {
+		struct sketch_talker *t = &sketch->top[j];
+		if (t->hash == hash && t->family == sketch->src_family[i] &&
+			memcmp(t->addr, sketch->src_addr[i], 16) == 0) {
+			t->bytes = estimate;
+			top_sift_down(sketch, j);
+			return;
+		}
+	}
+	size_t j = sketch->top_len;
+	if (j == sketch->top_max) {
+		if (estimate <= sketch->top[0].bytes)
+			return;
+		j = 0;
+	} else {
+		sketch->top_len++;
+	}
+	sketch->top[j].family = sketch->src_family[i];
+	memcpy(sketch->top[j].addr, sketch->src_addr[i], 16);
+	sketch->top[j].hash = hash;
+	sketch->top[j].bytes = estimate;
+	if (j == 0)
+		top_sift_down(sketch, 0);
+	else
+		top_sift_up(sketch, j);
+}
+
+void sketch_flush(struct sketch *sketch)
+{
+	uint32_t h_src[SKETCH_BATCH_LEN];
+	uint32_t h_src2[SKETCH_BATCH_LEN];
+	uint32_t h_dst[SKETCH_BATCH_LEN];
+	uint32_t h_flow[SKETCH_BATCH_LEN];
+	size_t n = sketch->pending;
+	if (n == 0)
+		return;
+
+	/* Pad the last group of four with zeroes, their hashes are unused */
+	for (size_t i = n; i % 4 != 0; i++) {
+		for (int w = 0; w < 4; w++)
+			sketch->src[w][i] = sketch->dst[w][i] = 0;
+		sketch->tuple[i] = 0;
+	}
+	for (size_t i = 0; i < n; i += 4) {
+		u32x4 src = hash_words4(sketch->src, i, SEED_SRC);
+		u32x4 src2 = hash_words4(sketch->src, i, SEED_SRC2);
+		u32x4 dst = hash_words4(sketch->dst, i, SEED_DST);
+		u32x4 flow = mix4(mix4(mix4((u32x4){ SEED_FLOW, SEED_FLOW,
+			SEED_FLOW, SEED_FLOW }, src), dst), load4(&sketch->tuple[i]));
+		src = fmix4(src);
+		src2 = fmix4(src2) | 1U;
+		dst = fmix4(dst);
+		flow = fmix4(flow);
+		memcpy(&h_src[i], &src, sizeof(src));
+		memcpy(&h_src2[i], &src2, sizeof(src2));
+		memcpy(&h_dst[i], &dst, sizeof(dst));
+		memcpy(&h_flow[i], &flow, sizeof(flow));
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		hll_add(sketch->hll_src, h_src[i]);
+		hll_add(sketch->hll_dst, h_dst[i]);
+		hll_add(sketch->hll_flow, h_flow[i]);
+
+		uint64_t estimate = UINT64_MAX;
+		for (int d = 0; d < SKETCH_CM_DEPTH; d++) {
+			uint32_t col = (h_src[i] + d * h_src2[i]) % SKETCH_CM_WIDTH;
+			uint64_t *counter = &sketch->cm[d][col];
+			*counter += sketch->bytes[i];
+			if (*counter < estimate)
+				estimate = *counter;
+		}
+		top_update(sketch, i, h_src[i], estimate);
+	}
+	sketch->pending = 0;
+}
+
+double sketch_distinct_sources(const struct sketch *sketch)
+{
+	return hll_estimate(sketch->hll_src);
+}
+
+double sketch_distinct_destinations(const struct sketch *sketch)
+{
+	return hll_estimate(sketch->hll_dst);
+}
+
+double sketch_distinct_flows(const struct sketch *sketch)
+{
+	return hll_estimate(sketch->hll_flow);
+}
+
+static int compare_talkers(const void *a, const void *b)
+{
+	const struct sketch_talker *ta = a;
+	const struct sketch_talker *tb = b;
+	return (ta->bytes < tb->bytes) - (ta->bytes > tb->bytes);
+}
+
+void sketch_print(FILE *f, const struct sketch *sketch)
+{
+	struct sketch_talker top[SKETCH_TOP_MAX];
+	char addr[INET6_ADDRSTRLEN];
+
+	fprintf(f, "sketch: ~%.0f sources, ~%.0f destinations, ~%.0f flows\n",
+		sketch_distinct_sources(sketch),
+		sketch_distinct_destinations(sketch),
+		sketch_distinct_flows(sketch));
+	memcpy(top, sketch->top, sketch->top_len * sizeof(*top));
+	qsort(top, sketch->top_len, sizeof(*top), &compare_talkers);
+	for (size_t i = 0; i < sketch->top_len; i++) {
+		inet_ntop(top[i].family == 6 ? AF_INET6 : AF_INET, top[i].addr,
+			addr, sizeof(addr));
+		fprintf(f, "  top source %s: <= %llu bytes\n", addr,
+			(unsigned long long)top[i].bytes);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "packet.h"
+
+/* Constant-memory summaries of the traffic seen: a Count-Min sketch of
+ * bytes per source address feeding a top-k heap of talkers, and
+ * HyperLogLog counters of distinct sources, destinations and flows.
+ * Packets are queued with sketch_add() and hashed several at a time by
+ * sketch_flush(). */
+
+#ifndef SKETCH_BATCH_LEN
+#define SKETCH_BATCH_LEN 64
+#endif
+#define SKETCH_CM_DEPTH 4
+#define SKETCH_CM_WIDTH 4096
+#define SKETCH_HLL_BITS 12
+#ifndef SKETCH_TOP_MAX
+#define SKETCH_TOP_MAX 64
+#endif
+
+struct sketch_talker {
+	uint8_t family;
+	uint8_t addr[16];
+	uint32_t hash;
+	uint64_t bytes;
+};
+
+struct sketch {
+	unsigned link;
+	/* Packets waiting to be hashed, as columns of 32-bit words */
+	size_t pending;
+	uint32_t src[4][SKETCH_BATCH_LEN];
+	uint32_t dst[4][SKETCH_BATCH_LEN];
+	uint32_t tuple[SKETCH_BATCH_LEN];
+	uint32_t bytes[SKETCH_BATCH_LEN];
+	uint8_t src_family[SKETCH_BATCH_LEN];
+	uint8_t src_addr[SKETCH_BATCH_LEN][16];
+
+	uint64_t cm[SKETCH_CM_DEPTH][SKETCH_CM_WIDTH];
+	uint8_t hll_src[1 << SKETCH_HLL_BITS];
+	uint8_t hll_dst[1 << SKETCH_HLL_BITS];
+	uint8_t hll_flow[1 << SKETCH_HLL_BITS];
+	/* Min-heap on bytes */
+	struct sketch_talker top[SKETCH_TOP_MAX];
+	size_t top_len;
+	size_t top_max;
+};
+
+int sketch_init(struct sketch *sketch, unsigned link, size_t top_len);
+void sketch_add(struct sketch *sketch, const uint8_t *data, size_t len);
+void sketch_flush(struct sketch *sketch);
+double sketch_distinct_sources(const struct sketch *sketch);
+double sketch_distinct_destinations(const struct sketch *sketch);
+double sketch_distinct_flows(const struct sketch *sketch);
+void sketch_print(FILE *f, const struct sketch *sketch);
+
+#endif
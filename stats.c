@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include "stats.h"
+
+void stats_print(FILE *f, const struct stats *stats)
+{
+	fprintf(f, "tun: rx %llu packets (%llu bytes), tx %llu packets"
+		" (%llu bytes), %llu dropped\n", stats->tun_rx_packets,
+		stats->tun_rx_bytes, stats->tun_tx_packets, stats->tun_tx_bytes,
+		stats->tun_tx_dropped);
+	if (stats->channel_unknown > 0) {
+		fprintf(f, "channels: %llu packets dropped for lack of a device\n",
+			stats->channel_unknown);
+	}
+	if (stats->routed_devices > 0 || stats->routed_peer > 0 ||
+		stats->unroutable > 0) {
+		fprintf(f, "routes: %llu packets to devices, %llu to the peer,"
+			" %llu unroutable\n", stats->routed_devices, stats->routed_peer,
+			stats->unroutable);
+	}
+	if (stats->bridge != NULL) {
+		fprintf(f, "switch: %llu frames flooded, %llu filtered\n",
+			stats->switch_flooded, stats->switch_filtered);
+		bridge_print(f, stats->bridge);
+	}
+	fprintf(f, "stream: rx %llu bytes, tx %llu bytes\n",
+		stats->stream_rx_bytes, stats->stream_tx_bytes);
+	fprintf(f, "skipped: %llu unsampled, %llu filtered\n",
+		stats->unsampled, stats->filtered);
+	if (stats->compressed_batches > 0 || stats->uncompressed_batches > 0) {
+		fprintf(f, "compression: %llu batches, %llu to %llu bytes (%.1f%%),"
+			" %llu sent uncompressed\n", stats->compressed_batches,
+			stats->compressed_in_bytes, stats->compressed_out_bytes,
+			stats->compressed_in_bytes > 0 ? 100.0 *
+			stats->compressed_out_bytes / stats->compressed_in_bytes : 0.0,
+			stats->uncompressed_batches);
+	}
+	if (stats->header_compressed > 0 || stats->header_contexts_sent > 0 ||
+		stats->header_context_misses > 0) {
+		fprintf(f, "header compression: %llu packets, %llu contexts sent,"
+			" %llu bytes saved, %llu dropped without context\n",
+			stats->header_compressed, stats->header_contexts_sent,
+			stats->header_saved_bytes, stats->header_context_misses);
+	}
+	if (stats->sealed_batches > 0 || stats->sealed_opened > 0 ||
+		stats->sealed_rejected > 0) {
+		fprintf(f, "encryption: %llu batches sealed, %llu opened, %llu"
+			" rejected\n", stats->sealed_batches, stats->sealed_opened,
+			stats->sealed_rejected);
+	}
+	if (stats->fec_parity_sent > 0 || stats->fec_parity_received > 0) {
+		fprintf(f, "fec: %llu parity frames sent, %llu received, %llu frames"
+			" recovered, %llu unrecoverable\n", stats->fec_parity_sent,
+			stats->fec_parity_received, stats->fec_recovered,
+			stats->fec_unrecovered);
+	}
+	if (stats->stripe_rerouted > 0 || stats->reorder_held > 0 ||
+		stats->reorder_duplicates > 0) {
+		fprintf(f, "striping: %llu frames rerouted, %llu held to reorder,"
+			" %llu given up on, %llu duplicates dropped\n",
+			stats->stripe_rerouted, stats->reorder_held,
+			stats->reorder_skipped, stats->reorder_duplicates);
+	}
+	if (stats->frames_corrupted > 0) {
+		fprintf(f, "corrupted: %llu frames, %llu bytes skipped\n",
+			stats->frames_corrupted, stats->frames_skipped_bytes);
+	}
+	if (stats->sequence.received > 0) {
+		fprintf(f, "sequence: %llu frames, %llu lost, %llu duplicates,"
+			" %llu reordered\n", stats->sequence.received,
+			stats->sequence.lost, stats->sequence.duplicates,
+			stats->sequence.reordered);
+	}
+	if (stats->tee != NULL)
+		fanout_print(f, stats->tee);
+	if (stats->balance != NULL)
+		fanout_print(f, stats->balance);
+	if (stats->sketch != NULL)
+		sketch_print(f, stats->sketch);
+	if (stats->flows != NULL)
+		ipfix_meter_print(f, stats->flows);
+	if (stats->probes != NULL)
+		probe_print(f, stats->probes);
+}
@@ -0,0 +1,61 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "bridge.h"
+#include "fanout.h"
+#include "frame.h"
+#include "ipfix.h"
+#include "probe.h"
+#include "sketch.h"
+
+/* Counters printed on exit (-v) and on SIGUSR1 */
+struct stats {
+	unsigned long long tun_rx_packets;
+	unsigned long long tun_rx_bytes;
+	unsigned long long tun_tx_packets;
+	unsigned long long tun_tx_bytes;
+	unsigned long long tun_tx_dropped;
+	unsigned long long channel_unknown;       /* no device, dropped */
+	unsigned long long routed_devices;        /* from one device to another */
+	unsigned long long routed_peer;
+	unsigned long long unroutable;            /* no route, dropped */
+	unsigned long long switch_flooded;        /* to unknown or group address */
+	unsigned long long switch_filtered;       /* on the port of their address */
+	unsigned long long stream_rx_bytes;
+	unsigned long long stream_tx_bytes;
+	unsigned long long unsampled;
+	unsigned long long filtered;
+	struct frame_sequence sequence;   /* of frames received */
+	unsigned long long frames_corrupted;
+	unsigned long long frames_skipped_bytes;
+	unsigned long long compressed_batches;
+	unsigned long long compressed_in_bytes;
+	unsigned long long compressed_out_bytes;
+	unsigned long long uncompressed_batches;  /* incompressible, skipped */
+	unsigned long long header_compressed;
+	unsigned long long header_contexts_sent;
+	unsigned long long header_saved_bytes;
+	unsigned long long header_context_misses; /* received, dropped */
+	unsigned long long sealed_batches;
+	unsigned long long sealed_opened;
+	unsigned long long sealed_rejected;       /* forged, replayed, clear */
+	unsigned long long fec_parity_sent;
+	unsigned long long fec_parity_received;
+	unsigned long long fec_recovered;
+	unsigned long long fec_unrecovered;
+	unsigned long long stripe_rerouted;       /* their path was full */
+	unsigned long long reorder_held;
+	unsigned long long reorder_skipped;       /* given up on */
+	unsigned long long reorder_duplicates;    /* dropped */
+	const struct fanout *tee;
+	const struct fanout *balance;
+	const struct bridge *bridge;
+	const struct sketch *sketch;
+	const struct ipfix_meter *flows;
+	const struct probe_stats *probes;
+};
+
+void stats_print(FILE *f, const struct stats *stats);
+
+#endif
@@ -0,0 +1,116 @@
+/* Header compression with contexts taken over by other flows, whose new
+ * contexts are lost, as happens over UDP with more flows than contexts:
+ * the receiver must drop their packets until it gets the context again,
+ * not rebuild wrong headers nor fail. */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "frame.h"
+#include "header.h"
+#include "packet.h"
+#include "util.h"
+
+#define PAYLOAD_LEN 20
+
+struct result {
+	unsigned delivered;
+	unsigned wrong;
+	unsigned dropped;
+	unsigned failed;
+};
+
+/* IPv4 + UDP packet from port sport, with an RTP header if rtp */
+static size_t make_packet(uint8_t *p, uint16_t sport, uint16_t id, int rtp,
+	uint16_t sequence)
+{
+	size_t len = 20 + 8 + (rtp ? 12 : 0) + PAYLOAD_LEN;
+	memset(p, 0, len);
+	p[0] = 0x45;
+	put_be16(p + 2, len);
+	put_be16(p + 4, id);
+	p[8] = 64;
+	p[9] = 17;
+	put_be32(p + 12, 0x0a010001);
+	put_be32(p + 16, 0x0a010002);
+	uint32_t sum = packet_checksum_add(p, 10, 0);
+	put_be16(p + 10, packet_checksum_fold(packet_checksum_add(p + 12, 8,
+		sum)));
+	put_be16(p + 20, sport);
+	put_be16(p + 22, 6000);
+	put_be16(p + 24, len - 20);
+	uint8_t *payload = p + 28;
+	if (rtp) {
+		p[28] = 0x80;
+		p[29] = 0x80 | 96;             /* marker */
+		put_be16(p + 30, sequence);
+		put_be32(p + 32, sequence * 160u);
+		put_be32(p + 36, sport);
+		payload += 12;
+	}
+	memset(payload, 'x', PAYLOAD_LEN);
+	return len;
+}
+
+static void send_packet(struct header_compressor *compressor,
+	struct header_decompressor *decompressor, uint16_t sport, uint16_t id,
+	int rtp, uint16_t sequence, int lose_context, struct result *result)
+{
+	uint8_t buf[128 + HEADER_CONTEXT_PREFIX_LEN];
+	uint8_t orig[128];
+	size_t len = make_packet(buf, sport, id, rtp, sequence);
+	memcpy(orig, buf, len);
+	struct packet_info info;
+	if (packet_parse(buf, len, 0, &info) != 0) {
+		result->failed++;
+		return;
+	}
+	size_t out_len = 0;
+	uint8_t type = header_compress(compressor, buf, len, &info, id,
+		&out_len);
+	if (type == FRAME_TYPE_HEADER_CONTEXT && lose_context)
+		return;
+	const uint8_t *data = NULL;
+	size_t data_len = 0;
+	int res = header_decompress(decompressor, type, buf, out_len, &data,
+		&data_len);
+	if (res == ENOENT)
+		result->dropped++;
+	else if (res != 0)
+		result->failed++;
+	else if (data_len != len || memcmp(data, orig, len) != 0)
+		result->wrong++;
+	else
+		result->delivered++;
+}
+
+int main(void)
+{
+	static struct header_compressor compressor;
+	static struct header_decompressor decompressor;
+	if (header_compressor_init(&compressor, 0) != 0 ||
+		header_decompressor_init(&decompressor, 0, 2048) != 0)
+		return 1;
+
+	/* Plain UDP flows take all contexts, then RTP flows and other UDP
+	 * flows take some of them over with their contexts lost */
+	struct result result = { 0, 0, 0, 0 };
+	uint16_t id = 1;
+	for (unsigned round = 0; round < 3; round++) {
+		for (unsigned flow = 0; flow < HEADER_CONTEXTS; flow++, id++)
+			send_packet(&compressor, &decompressor, 10000 + flow, id, 0,
+				0, 0, &result);
+		for (unsigned flow = 0; flow < 32; flow++, id++)
+			for (unsigned i = 0; i < 3; i++)
+				send_packet(&compressor, &decompressor, 20000 + flow,
+					id, flow % 2, i, 1, &result);
+	}
+	int failed = (result.failed > 0 || result.wrong > 0 ||
+		result.dropped == 0);
+	printf("%s: %u delivered, %u wrong, %u dropped, %u failed\n",
+		failed ? "FAIL" : "ok", result.delivered, result.wrong,
+		result.dropped, result.failed);
+
+	header_decompressor_free(&decompressor);
+	header_compressor_free(&compressor);
+	return failed;
+}
@@ -0,0 +1,1450 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include "aead.h"
+#include "bridge.h"
+#include "fec.h"
+#include "frame.h"
+#include "header.h"
+#include "lz4.h"
+#include "packet.h"
+#include "reorder.h"
+#include "route.h"
+#include "tunnel.h"
+#include "util.h"
+
+struct tunnel {
+	const struct tunnel_options *options;
+	struct stats *stats;
+	/* Packets read from the device, framed and waiting to be written,
+	 * after room to seal them in place */
+	uint8_t *out;
+	size_t out_cap;
+	size_t out_headroom;
+	size_t out_start;
+	size_t out_end;
+	int out_open;
+	/* Earliest departure time of the next paced datagram, and when to
+	 * resume sending once too far ahead of it (CLOCK_MONOTONIC) */
+	uint64_t next_departure;
+	uint64_t pace_wake;
+	/* Path of the frames striped round-robin, for stripe_left more */
+	unsigned stripe_path;
+	unsigned stripe_left;
+	/* Frames striped round-robin put back in order, and whether they are
+	 * being delivered from it */
+	struct reorder *reorder;
+	int reordering;
+	/* Same size as out, which it is swapped with once compressed into */
+	uint8_t *compress_buf;
+	unsigned compress_skip;
+	unsigned compress_backoff;
+	/* Frames decompressed from the input */
+	uint8_t *decompress_buf;
+	int decompressing;
+	/* Header compression contexts of each direction */
+	struct header_compressor *headers_out;
+	struct header_decompressor *headers_in;
+	/* Forward error correction of each direction (datagrams) */
+	struct fec_encoder *fec_out;
+	struct fec_decoder *fec_in;
+	/* Keys of each direction, derived from the pre-shared key and random
+	 * bytes of both sides */
+	uint8_t seal_key[AEAD_KEY_LEN];
+	uint8_t open_key[AEAD_KEY_LEN];
+	/* Nonce of the next sealed frame, and of the last one opened */
+	uint8_t seal_nonce[AEAD_NONCE_LEN];
+	uint8_t open_nonce[AEAD_NONCE_LEN];
+	int opened;
+	/* Frames decrypted from the input */
+	uint8_t *open_buf;
+	int opening;
+	/* Frames generated by tuncat, output once the packets above are */
+	uint8_t control[TUNNEL_CONTROL_LEN];
+	size_t control_len;
+	struct frame_decoder in;
+	int in_open;
+	/* Wall clock time of the batch being processed */
+	uint64_t now;
+	uint64_t next_tick;
+	uint64_t next_probe;
+	uint32_t out_sequence;
+	/* First device to read from at the next wakeup, so that a busy one
+	 * cannot starve the others */
+	unsigned next_channel;
+	/* Batch of packets read from a device, being routed or switched */
+	uint8_t *forward_buf;
+};
+
+int inject_packet(int tun_fd, const uint8_t *data, size_t len)
+{
+	while (1) {
+		ssize_t res = write(tun_fd, data, len);
+		if (res >= 0)
+			return 0;
+		if (errno == EINVAL) {
+			/* Not a packet for this kind of device, skip it */
+			if (verbosity > 0)
+				fprintf(stderr, "Dropped invalid %zuB packet\n", len);
+			return 0;
+		}
+		if (errno == EIO)
+			return errno; /* interface is down */
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("write(tun)");
+			return errno;
+		}
+		if (interrupt_flag != 0)
+			return EINTR;
+		fd_set write_set;
+		FD_ZERO(&write_set);
+		FD_SET(tun_fd, &write_set);
+		select(tun_fd + 1, NULL, &write_set, NULL, NULL);
+	}
+}
+
+static int set_nonblocking(int fd, int *saved_flags)
+{
+	*saved_flags = fcntl(fd, F_GETFL);
+	if (*saved_flags < 0 ||
+		fcntl(fd, F_SETFL, *saved_flags | O_NONBLOCK) < 0) {
+		perror("fcntl(O_NONBLOCK)");
+		return errno;
+	}
+	return 0;
+}
+
+/* Processes one packet read from the device, which sits at t->out_end plus
+ * room for a frame header. Returns whether it has to be forwarded. The
+ * packet is parsed into info if something needs it. */
+static int keep_packet(struct tunnel *t, uint8_t *data, size_t len,
+	struct packet_info *info)
+{
+	const struct tunnel_options *options = t->options;
+	if (options->filter != NULL || options->metadata ||
+		options->header_compressed || options->balance != NULL ||
+		options->routes != NULL)
+		packet_parse(data, len, options->link, info);
+
+	if (options->sampler != NULL && !sampler_keep(options->sampler, data, len)) {
+		t->stats->unsampled++;
+		return 0;
+	}
+	if (options->filter != NULL) {
+		if (!filter_match(options->filter, info)) {
+			t->stats->filtered++;
+			return 0;
+		}
+	}
+	if (options->capture != NULL) {
+		int res = capture_writer_append(options->capture,
+			now_ns(CLOCK_REALTIME), data, len);
+		if (res != 0)
+			return -res;
+	}
+	if (options->tee != NULL)
+		fanout_tee(options->tee, data, len);
+	if (options->balance != NULL)
+		fanout_balance(options->balance, data, len,
+			packet_flow_hash(info, FRAME_FLOW_SEED));
+	if (options->sketch != NULL)
+		sketch_add(options->sketch, data, len);
+	if (options->flows != NULL)
+		ipfix_meter_add(options->flows, data, len, t->now);
+	return 1;
+}
+
+/* Appends the parity frames of the group of frames being sent */
+static void flush_parity(struct tunnel *t)
+{
+	unsigned count = 0;
+	t->out_end += fec_encoder_flush(t->fec_out, t->out + t->out_end,
+		(t->options->checksummed ? FRAME_FLAG_CRC : 0), &count);
+	t->stats->fec_parity_sent += count;
+}
+
+/* Frames the packet of len bytes which is header_len bytes past the end
+ * of the output, and appends it */
+static void put_packet(struct tunnel *t, struct frame *frame,
+	size_t header_len, size_t len, const struct packet_info *info)
+{
+	const struct tunnel_options *options = t->options;
+	uint8_t *data = t->out + t->out_end + header_len;
+	if (header_len > 0) {
+		if (options->metadata)
+			frame->metadata.flow_hash = packet_flow_hash(info,
+				FRAME_FLOW_SEED);
+		if (t->headers_out != NULL) {
+			size_t raw_len = len;
+			size_t out_len = 0;
+			frame->type = header_compress(t->headers_out, data, len, info,
+				t->now, &out_len);
+			len = out_len;
+			if (frame->type == FRAME_TYPE_HEADER_PACKET) {
+				t->stats->header_compressed++;
+				t->stats->header_saved_bytes += raw_len - len;
+			} else if (frame->type == FRAME_TYPE_HEADER_CONTEXT) {
+				t->stats->header_contexts_sent++;
+			}
+		}
+		frame->sequence = t->out_sequence++;
+		frame->len = len;
+		frame_put_header(t->out + t->out_end, frame);
+		if (options->checksummed)
+			len += frame_put_crc(data, data + len);
+	}
+	size_t frame_start = t->out_end;
+	t->out_end += header_len + len;
+	if (t->fec_out != NULL && fec_encoder_add(t->fec_out, frame->sequence,
+		t->out + frame_start, t->out_end - frame_start))
+		flush_parity(t);
+}
+
+static int read_tun(struct tunnel *t, unsigned channel)
+{
+	const struct tunnel_options *options = t->options;
+	struct frame frame = {
+		.type = FRAME_TYPE_PACKET,
+		.channel = channel,
+		.flags = (options->sequenced ? FRAME_FLAG_SEQUENCE : 0) |
+			(options->metadata ? FRAME_FLAG_METADATA : 0) |
+			(options->checksummed ? FRAME_FLAG_CRC : 0),
+	};
+	size_t header_len = (options->framed ? frame_header_len(frame.flags) : 0);
+	/* Batch frames get room for the largest header in front of the
+	 * packets, and their actual header is written against the packets
+	 * once their count is known */
+	size_t batch_start = t->out_end;
+	uint32_t batch_ends[READ_BATCH_LEN];
+	size_t batch_count = 0;
+	if (options->batched) {
+		header_len = 0;
+		t->out_end += frame_batch_header_len(frame.flags, READ_BATCH_LEN);
+	}
+	size_t data_start = t->out_end;
+
+	t->now = now_ns(CLOCK_REALTIME);
+	/* Packets from a single queue device, without a virtio-net header
+	 * which would hold GSO information */
+	frame.metadata.timestamp_ns = t->now;
+	frame.metadata.direction = FRAME_DIRECTION_FROM_DEVICE;
+	for (int i = 0; i < READ_BATCH_LEN; i++) {
+		/* Read straight to where the packet will be framed */
+		uint8_t *data = t->out + t->out_end + header_len;
+		ssize_t len = read(options->tun_fds[channel], data,
+			options->buffer_len);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			perror("read(tun)");
+			return errno;
+		}
+		t->stats->tun_rx_packets++;
+		t->stats->tun_rx_bytes += len;
+
+		struct packet_info info;
+		int keep = keep_packet(t, data, len, &info);
+		if (keep < 0)
+			return -keep;
+		if (keep == 0 || !t->out_open)
+			continue;
+		put_packet(t, &frame, header_len, len, &info);
+		if (options->batched)
+			batch_ends[batch_count++] = t->out_end - data_start;
+	}
+	if (t->fec_out != NULL)
+		flush_parity(t);
+	if (options->batched) {
+		if (batch_count == 0) {
+			t->out_end = batch_start;
+		} else {
+			t->out_start = frame_put_batch_header(t->out + data_start,
+				frame.flags, channel, t->out_sequence++, batch_ends,
+				batch_count) - t->out;
+			if (options->checksummed)
+				t->out_end += frame_put_crc(t->out + t->out_start +
+					frame_header_len(frame.flags), t->out + t->out_end);
+		}
+	}
+	if (options->sketch != NULL)
+		sketch_flush(options->sketch);
+	return 0;
+}
+
+/* Writes a packet to a device, dropping it if the device is down */
+static int inject_device(struct tunnel *t, unsigned device,
+	const uint8_t *data, size_t len)
+{
+	int res = inject_packet(t->options->tun_fds[device], data, len);
+	if (res == 0) {
+		t->stats->tun_tx_packets++;
+		t->stats->tun_tx_bytes += len;
+	} else if (res == EIO) {
+		t->stats->tun_tx_dropped++;
+		res = 0;
+	}
+	return res;
+}
+
+/* Reads a batch of packets from a device to forward_buf, to be forwarded
+ * once all of them are looked up */
+static int read_forward_batch(struct tunnel *t, unsigned channel,
+	struct packet_info *infos, size_t *lens, size_t *count)
+{
+	const struct tunnel_options *options = t->options;
+	t->now = now_ns(CLOCK_REALTIME);
+	*count = 0;
+	for (int i = 0; i < READ_BATCH_LEN; i++) {
+		uint8_t *data = t->forward_buf + *count * options->buffer_len;
+		ssize_t len = read(options->tun_fds[channel], data,
+			options->buffer_len);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			perror("read(tun)");
+			return errno;
+		}
+		t->stats->tun_rx_packets++;
+		t->stats->tun_rx_bytes += len;
+		int keep = keep_packet(t, data, len, &infos[*count]);
+		if (keep < 0)
+			return -keep;
+		if (keep > 0)
+			lens[(*count)++] = len;
+	}
+	return 0;
+}
+
+/* Appends a packet of forward_buf to the output, as a frame */
+static void forward_to_peer(struct tunnel *t, unsigned channel,
+	const uint8_t *data, size_t len, const struct packet_info *info)
+{
+	const struct tunnel_options *options = t->options;
+	struct frame frame = {
+		.type = FRAME_TYPE_PACKET,
+		.channel = channel,
+		.flags = (options->sequenced ? FRAME_FLAG_SEQUENCE : 0) |
+			(options->metadata ? FRAME_FLAG_METADATA : 0) |
+			(options->checksummed ? FRAME_FLAG_CRC : 0),
+	};
+	size_t header_len = (options->framed ? frame_header_len(frame.flags) : 0);
+	frame.metadata.timestamp_ns = t->now;
+	frame.metadata.direction = FRAME_DIRECTION_FROM_DEVICE;
+	memcpy(t->out + t->out_end + header_len, data, len);
+	put_packet(t, &frame, header_len, len, info);
+}
+
+/* Reads a batch of packets from a device, and sends each of them to the
+ * device or peer channel its destination is routed to */
+static int route_tun(struct tunnel *t, unsigned channel)
+{
+	const struct tunnel_options *options = t->options;
+	struct packet_info infos[READ_BATCH_LEN];
+	size_t lens[READ_BATCH_LEN];
+	uint16_t hops[READ_BATCH_LEN];
+	size_t count = 0;
+	int res = read_forward_batch(t, channel, infos, lens, &count);
+	if (res != 0 || count == 0)
+		return res;
+
+	/* Looked up together, for the table to be fetched in parallel */
+	route_lookup_batch(options->routes, infos, count, hops);
+	for (size_t i = 0; res == 0 && i < count; i++) {
+		uint8_t *data = t->forward_buf + i * options->buffer_len;
+		unsigned target = hops[i] & ROUTE_TARGET_MASK;
+		/* Packets are not sent back where they come from, which would
+		 * loop them through the kernel */
+		if ((hops[i] & ROUTE_DEVICE) && target < options->channels &&
+			target != channel) {
+			res = inject_device(t, target, data, lens[i]);
+			t->stats->routed_devices++;
+		} else if ((hops[i] & ROUTE_PEER) && t->out_open) {
+			forward_to_peer(t, target, data, lens[i], &infos[i]);
+			t->stats->routed_peer++;
+		} else {
+			t->stats->unroutable++;
+		}
+	}
+	if (t->fec_out != NULL)
+		flush_parity(t);
+	if (options->sketch != NULL)
+		sketch_flush(options->sketch);
+	return res;
+}
+
+/* Offset of the ethernet header of packets from tap devices */
+static size_t ethernet_offset(const struct tunnel_options *options)
+{
+	return (options->link & PACKET_LINK_PI ? 4 : 0); /* struct tun_pi */
+}
+
+/* Reads a batch of frames from a tap device, and sends each of them to
+ * the port its destination was learned on, or to all other ports */
+static int switch_tun(struct tunnel *t, unsigned channel)
+{
+	const struct tunnel_options *options = t->options;
+	struct packet_info infos[READ_BATCH_LEN];
+	size_t lens[READ_BATCH_LEN];
+	const uint8_t *dsts[READ_BATCH_LEN];
+	uint16_t ports[READ_BATCH_LEN];
+	size_t count = 0;
+	int res = read_forward_batch(t, channel, infos, lens, &count);
+	if (res != 0 || count == 0)
+		return res;
+
+	size_t eth = ethernet_offset(options);
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	for (size_t i = 0; i < count; i++) {
+		static const uint8_t broadcast[BRIDGE_ADDR_LEN] = {
+			0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		};
+		uint8_t *data = t->forward_buf + i * options->buffer_len;
+		if (lens[i] < eth + BRIDGE_HEADER_LEN) {
+			lens[i] = 0;
+			dsts[i] = broadcast;
+			continue;
+		}
+		bridge_learn(options->bridge, data + eth + BRIDGE_ADDR_LEN, channel,
+			now);
+		dsts[i] = data + eth;
+	}
+	bridge_lookup_batch(options->bridge, dsts, count, ports, now);
+	for (size_t i = 0; res == 0 && i < count; i++) {
+		uint8_t *data = t->forward_buf + i * options->buffer_len;
+		if (lens[i] == 0) {
+			t->stats->switch_filtered++;
+		} else if (ports[i] == channel) {
+			/* Between stations on the same port, which got it already */
+			t->stats->switch_filtered++;
+		} else if (ports[i] == BRIDGE_PORT_PEER) {
+			if (t->out_open)
+				forward_to_peer(t, 0, data, lens[i], &infos[i]);
+		} else if (ports[i] != BRIDGE_PORT_NONE) {
+			if (ports[i] < options->channels)
+				res = inject_device(t, ports[i], data, lens[i]);
+		} else {
+			/* Written to each port from the same buffer, which the
+			 * device writes do not keep */
+			for (unsigned d = 0; res == 0 && d < options->channels; d++) {
+				if (d != channel)
+					res = inject_device(t, d, data, lens[i]);
+			}
+			if (t->out_open)
+				forward_to_peer(t, 0, data, lens[i], &infos[i]);
+			t->stats->switch_flooded++;
+		}
+	}
+	if (t->fec_out != NULL)
+		flush_parity(t);
+	if (options->sketch != NULL)
+		sketch_flush(options->sketch);
+	return res;
+}
+
+/* Sets the departure time of a paced datagram, spaced from the previous
+ * one by its duration at the configured rate. Returns 0 once it is more
+ * than TUNNEL_PACING_HORIZON_NS ahead, to send it later. */
+static int pace_datagram(struct tunnel *t, struct msghdr *msg, uint8_t *cmsg_buf,
+	size_t cmsg_len, uint64_t now)
+{
+	if (t->next_departure < now)
+		t->next_departure = now;
+	if (t->next_departure > now + TUNNEL_PACING_HORIZON_NS) {
+		t->pace_wake = t->next_departure - TUNNEL_PACING_HORIZON_NS;
+		return 0;
+	}
+	msg->msg_control = cmsg_buf;
+	msg->msg_controllen = cmsg_len;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+	memcpy(CMSG_DATA(cmsg), &t->next_departure, sizeof(uint64_t));
+	t->next_departure += msg->msg_iov[0].iov_len * 8000000000ULL /
+		t->options->pace_bps;
+	return 1;
+}
+
+/* Path to send a frame on, out of those not in the full mask */
+static unsigned stripe_path(struct tunnel *t, const uint8_t *frame,
+	unsigned full)
+{
+	const struct tunnel_options *options = t->options;
+	const uint8_t *header = frame;
+	if (memcmp(frame, FRAME_SYNC, FRAME_SYNC_LEN) == 0)
+		header += FRAME_SYNC_LEN;
+	const uint8_t *payload = frame + frame_header_len(header[1]);
+	size_t len = get_le32(header + 4);
+	int parity = (header[0] == FRAME_TYPE_FEC);
+	unsigned path = t->stripe_path;
+	if (options->stripe_flows) {
+		/* Packets of a flow all go the same way, so that they stay in
+		 * order without being numbered. Other frames take the first path. */
+		path = 0;
+		if (header[0] == FRAME_TYPE_PACKET) {
+			struct packet_info info;
+			packet_parse(payload, len, options->link, &info);
+			path = packet_flow_hash(&info, FRAME_FLOW_SEED) %
+				options->path_count;
+		} else if ((header[0] == FRAME_TYPE_HEADER_CONTEXT ||
+			header[0] == FRAME_TYPE_HEADER_PACKET) && len > 0) {
+			path = payload[0] % options->path_count; /* context id */
+		}
+	} else if (t->stripe_left == 0 && !parity) {
+		path = (path + 1) % options->path_count;
+		t->stripe_left = TUNNEL_STRIPE_RUN;
+	}
+	if (full & (1U << path)) {
+		do {
+			path = (path + 1) % options->path_count;
+		} while (full & (1U << path));
+		t->stats->stripe_rerouted++;
+		t->stripe_left = TUNNEL_STRIPE_RUN;
+	}
+	if (!options->stripe_flows) {
+		/* With FEC, runs are groups followed by their parity, so that the
+		 * receiver has the group by the time it gets the parity */
+		t->stripe_path = path;
+		if (parity)
+			t->stripe_left = 0;
+		else if (t->fec_out == NULL)
+			t->stripe_left--;
+	}
+	return path;
+}
+
+/* Sends each frame waiting to be written in its own datagram, on one of
+ * the paths. Those consecutive frames which share a path are sent
+ * together, and those of a full path are sent on the others. */
+static int flush_datagrams(struct tunnel *t)
+{
+	const struct tunnel_options *options = t->options;
+	struct mmsghdr msgs[TUNNEL_DATAGRAM_BATCH];
+	struct iovec iovs[TUNNEL_DATAGRAM_BATCH];
+	uint64_t departures[TUNNEL_DATAGRAM_BATCH];
+	unsigned paths[TUNNEL_DATAGRAM_BATCH];
+	_Alignas(struct cmsghdr)
+		uint8_t cmsgs[TUNNEL_DATAGRAM_BATCH][CMSG_SPACE(sizeof(uint64_t))];
+	int paced = (options->pace_bps > 0);
+	uint64_t now = (paced ? now_ns(CLOCK_MONOTONIC) : 0);
+	unsigned all_paths = (1U << options->path_count) - 1;
+	unsigned full = 0;
+	t->pace_wake = 0;
+	while (t->out_start < t->out_end) {
+		unsigned count = 0;
+		for (size_t off = t->out_start; off < t->out_end &&
+			count < TUNNEL_DATAGRAM_BATCH; count++) {
+			iovs[count].iov_base = t->out + off;
+			iovs[count].iov_len = frame_len(t->out + off);
+			memset(&msgs[count], 0, sizeof(msgs[count]));
+			msgs[count].msg_hdr.msg_iov = &iovs[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+			departures[count] = t->next_departure;
+			if (paced && !pace_datagram(t, &msgs[count].msg_hdr,
+				cmsgs[count], sizeof(cmsgs[count]), now))
+				break;
+			paths[count] = (options->path_count > 1 ?
+				stripe_path(t, t->out + off, full) : 0);
+			off += iovs[count].iov_len;
+		}
+		if (count == 0)
+			return 0;
+		unsigned sent = 0;
+		while (sent < count) {
+			unsigned run = 1;
+			while (sent + run < count && paths[sent + run] == paths[sent])
+				run++;
+			int res = sendmmsg(options->path_fds[paths[sent]], msgs + sent,
+				run, 0);
+			/* ECONNREFUSED reports an earlier datagram the peer was not
+			 * there for yet */
+			if (res < 0 && (errno == EINTR || errno == ECONNREFUSED))
+				continue;
+			if (res < 0 && errno != EAGAIN) {
+				perror("sendmmsg(out)");
+				return errno;
+			}
+			for (int i = 0; i < res; i++) {
+				t->out_start += iovs[sent + i].iov_len;
+				t->stats->stream_tx_bytes += iovs[sent + i].iov_len;
+			}
+			if (res < 0 || (unsigned)res < run) {
+				full |= 1U << paths[sent];
+				sent += (res < 0 ? 0 : res);
+				break;
+			}
+			sent += run;
+		}
+		/* Datagrams not sent keep their departure times, and are sent
+		 * again on a path which is not full */
+		if (sent < count) {
+			if (paced) {
+				t->next_departure = departures[sent];
+				t->pace_wake = 0;
+			}
+			if (full == all_paths)
+				return 0;
+		}
+	}
+	t->out_start = t->out_end = t->out_headroom;
+	return 0;
+}
+
+static int flush_output(struct tunnel *t)
+{
+	if (t->options->datagrams)
+		return flush_datagrams(t);
+	while (t->out_start < t->out_end) {
+		ssize_t res = write(t->options->out_fd, t->out + t->out_start,
+			t->out_end - t->out_start);
+		if (res < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE) {
+				fprintf(stderr, "Output stream closed\n");
+				t->out_open = 0;
+				break;
+			}
+			perror("write(out)");
+			return errno;
+		}
+		t->out_start += res;
+		t->stats->stream_tx_bytes += res;
+	}
+	t->out_start = t->out_end = t->out_headroom;
+	return 0;
+}
+
+/* Sends a frame from the peer to the device its destination was learned
+ * on, or to all of them */
+static int switch_from_peer(struct tunnel *t, const uint8_t *data,
+	size_t len)
+{
+	const struct tunnel_options *options = t->options;
+	size_t eth = ethernet_offset(options);
+	if (len < eth + BRIDGE_HEADER_LEN) {
+		t->stats->switch_filtered++;
+		return 0;
+	}
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	bridge_learn(options->bridge, data + eth + BRIDGE_ADDR_LEN,
+		BRIDGE_PORT_PEER, now);
+	const uint8_t *dst = data + eth;
+	uint16_t port = BRIDGE_PORT_NONE;
+	bridge_lookup_batch(options->bridge, &dst, 1, &port, now);
+	if (port == BRIDGE_PORT_PEER) {
+		t->stats->switch_filtered++;
+		return 0;
+	}
+	if (port != BRIDGE_PORT_NONE)
+		return (port < options->channels ? inject_device(t, port, data, len) :
+			0);
+	int res = 0;
+	for (unsigned d = 0; res == 0 && d < options->channels; d++)
+		res = inject_device(t, d, data, len);
+	t->stats->switch_flooded++;
+	return res;
+}
+
+static int write_tun(struct tunnel *t, unsigned channel, const uint8_t *data,
+	size_t len)
+{
+	if (channel >= t->options->channels) {
+		t->stats->channel_unknown++;
+		return 0;
+	}
+	if (t->options->sketch != NULL)
+		sketch_add(t->options->sketch, data, len);
+	if (t->options->flows != NULL)
+		ipfix_meter_add(t->options->flows, data, len, t->now);
+	if (t->options->bridge != NULL)
+		return switch_from_peer(t, data, len);
+	return inject_device(t, channel, data, len);
+}
+
+static void queue_control(struct tunnel *t, uint8_t type,
+	const uint8_t *payload, size_t len)
+{
+	if (!t->out_open ||
+		t->control_len + FRAME_MAX_HEADER_LEN + len + FRAME_CRC_LEN >
+		sizeof(t->control))
+		return;
+	/* Not numbered, since they are sent out of order with packets */
+	struct frame frame = {
+		.type = type,
+		.flags = (t->options->checksummed ? FRAME_FLAG_CRC : 0),
+		.len = len,
+	};
+	uint8_t *start = t->control + t->control_len;
+	size_t header_len = frame_put_header(start, &frame);
+	memcpy(start + header_len, payload, len);
+	t->control_len += header_len + len;
+	if (t->options->checksummed)
+		t->control_len += frame_put_crc(start + header_len,
+			start + header_len + len);
+}
+
+/* Replaces the frames waiting to be written with a single compressed
+ * frame, unless they are incompressible */
+static void compress_output(struct tunnel *t)
+{
+	size_t raw_len = t->out_end - t->out_start;
+	if (raw_len < TUNNEL_COMPRESS_MIN)
+		return;
+	if (t->compress_skip > 0) {
+		t->compress_skip--;
+		t->stats->uncompressed_batches++;
+		return;
+	}
+
+	struct frame frame = {
+		.type = FRAME_TYPE_LZ4,
+		.flags = (t->options->checksummed ? FRAME_FLAG_CRC : 0),
+	};
+	size_t header_len = frame_header_len(frame.flags);
+	uint8_t *start = t->compress_buf + t->out_headroom;
+	uint8_t *payload = start + header_len;
+	size_t room = t->out_cap - t->out_headroom - AEAD_TAG_LEN - FRAME_CRC_LEN -
+		header_len - 4 - FRAME_CRC_LEN;
+	size_t max_len = raw_len - raw_len / 8;
+	if (max_len > room)
+		max_len = room;
+	size_t len = lz4_compress_block(t->out + t->out_start, raw_len,
+		payload + 4, max_len);
+	if (len == 0) {
+		/* Probably encrypted or already compressed, try again later */
+		t->compress_skip = t->compress_backoff;
+		if (t->compress_backoff < TUNNEL_COMPRESS_BACKOFF_MAX)
+			t->compress_backoff = 2 * t->compress_backoff + 1;
+		t->stats->uncompressed_batches++;
+		return;
+	}
+	t->compress_backoff = 0;
+	put_le32(payload, raw_len);
+	frame.len = 4 + len;
+	frame_put_header(start, &frame);
+	size_t total = header_len + frame.len;
+	if (t->options->checksummed)
+		total += frame_put_crc(payload, payload + frame.len);
+	t->stats->compressed_batches++;
+	t->stats->compressed_in_bytes += raw_len;
+	t->stats->compressed_out_bytes += total;
+
+	uint8_t *tmp = t->out;
+	t->out = t->compress_buf;
+	t->compress_buf = tmp;
+	t->out_start = t->out_headroom;
+	t->out_end = t->out_headroom + total;
+}
+
+/* Replaces the frames waiting to be written with a single encrypted frame.
+ * They are encrypted in place, its header goes in the headroom and its
+ * tag after them. */
+static int seal_output(struct tunnel *t)
+{
+	struct frame frame = {
+		.type = FRAME_TYPE_SEALED,
+		.flags = (t->options->checksummed ? FRAME_FLAG_CRC : 0),
+	};
+	uint8_t *data = t->out + t->out_start;
+	size_t len = t->out_end - t->out_start;
+	uint8_t *nonce = data - AEAD_NONCE_LEN;
+	uint8_t *start = nonce - frame_header_len(frame.flags);
+	if (len == 0)
+		return 0;
+	memcpy(nonce, t->seal_nonce, AEAD_NONCE_LEN);
+	aead_seal(t->seal_key, nonce, NULL, 0, data, data, len, data + len);
+	frame.len = AEAD_NONCE_LEN + len + AEAD_TAG_LEN;
+	frame_put_header(start, &frame);
+	t->out_start = start - t->out;
+	t->out_end += AEAD_TAG_LEN;
+	if (t->options->checksummed)
+		t->out_end += frame_put_crc(nonce, t->out + t->out_end);
+	t->stats->sealed_batches++;
+
+	/* A nonce must never be used twice with the same key, nor go back
+	 * for the peer to accept it: past 2^32 frames, the first part goes up */
+	uint32_t counter = get_le32(t->seal_nonce + 8) + 1;
+	put_le32(t->seal_nonce + 8, counter);
+	if (counter == 0)
+		put_le64(t->seal_nonce, get_le64(t->seal_nonce) + 1);
+	return 0;
+}
+
+static int read_frame(struct tunnel *t, const struct frame *frame);
+
+/* Decodes the frames of a buffer, which was the payload of a frame */
+static int read_inner_frames(struct tunnel *t, uint8_t *buf, size_t len,
+	const char *what)
+{
+	/* The frames inside are decoded in place */
+	struct frame_decoder decoder = {
+		.buf = buf,
+		.cap = len,
+		.end = len,
+		.max_payload = t->in.max_payload,
+	};
+	struct frame inner;
+	int res = 0;
+	while (res == 0 && (res = frame_decoder_next(&decoder, &inner)) == 0)
+		res = read_frame(t, &inner);
+	if (res == EAGAIN && decoder.start != decoder.end) {
+		fprintf(stderr, "Error: truncated frame in %s frame\n", what);
+		return EINVAL;
+	}
+	return (res == EAGAIN ? 0 : res);
+}
+
+static int read_header_compressed(struct tunnel *t, const struct frame *frame)
+{
+	if (t->headers_in == NULL) {
+		t->headers_in = malloc(sizeof(*t->headers_in));
+		if (t->headers_in == NULL)
+			return ENOMEM;
+		int res = header_decompressor_init(t->headers_in, t->options->link,
+			t->in.max_payload);
+		if (res != 0) {
+			free(t->headers_in);
+			t->headers_in = NULL;
+			return res;
+		}
+	}
+	const uint8_t *data = NULL;
+	size_t len = 0;
+	int res = header_decompress(t->headers_in, frame->type, frame->payload,
+		frame->len, &data, &len);
+	if (res == ENOENT) {
+		/* Its context was lost or is wrong, until it is sent again */
+		t->stats->header_context_misses++;
+		return 0;
+	}
+	if (res != 0) {
+		fprintf(stderr, "Error: invalid header compressed frame in input"
+			" stream\n");
+		return EINVAL;
+	}
+	return write_tun(t, frame->channel, data, len);
+}
+
+static int read_compressed(struct tunnel *t, const struct frame *frame)
+{
+	size_t len = 0;
+	if (t->decompress_buf == NULL) {
+		t->decompress_buf = malloc(t->out_cap);
+		if (t->decompress_buf == NULL)
+			return ENOMEM;
+	}
+	if (t->decompressing || frame->len < 4 ||
+		get_le32(frame->payload) > t->out_cap ||
+		lz4_decompress_block(frame->payload + 4, frame->len - 4,
+		t->decompress_buf, t->out_cap, &len) != 0 ||
+		len != get_le32(frame->payload)) {
+		fprintf(stderr, "Error: invalid compressed frame in input stream\n");
+		return EINVAL;
+	}
+	t->decompressing = 1;
+	int res = read_inner_frames(t, t->decompress_buf, len, "compressed");
+	t->decompressing = 0;
+	return res;
+}
+
+/* Whether a nonce comes after the last one opened */
+static int nonce_after(const uint8_t *nonce, const uint8_t *last)
+{
+	uint64_t high = get_le64(nonce);
+	uint64_t last_high = get_le64(last);
+	return (high > last_high || (high == last_high &&
+		get_le32(nonce + 8) > get_le32(last + 8)));
+}
+
+static int read_sealed(struct tunnel *t, const struct frame *frame)
+{
+	if (t->options->key == NULL) {
+		fprintf(stderr, "Error: encrypted frame in input stream, but no key"
+			" (--encrypt)\n");
+		return EINVAL;
+	}
+	if (t->open_buf == NULL) {
+		t->open_buf = malloc(t->out_cap);
+		if (t->open_buf == NULL)
+			return ENOMEM;
+	}
+	/* Frames which are not authentic, which includes ours reflected and
+	 * those of other sessions, or replayed within the session, are dropped:
+	 * they can only be an attack or corruption */
+	const uint8_t *nonce = frame->payload;
+	size_t len = frame->len - AEAD_NONCE_LEN - AEAD_TAG_LEN;
+	if (t->opening || frame->len < AEAD_NONCE_LEN + AEAD_TAG_LEN ||
+		len > t->out_cap || (t->opened && !nonce_after(nonce, t->open_nonce)) ||
+		aead_open(t->open_key, nonce, NULL, 0, nonce + AEAD_NONCE_LEN,
+		t->open_buf, len, nonce + AEAD_NONCE_LEN + len) != 0) {
+		t->stats->sealed_rejected++;
+		return 0;
+	}
+	memcpy(t->open_nonce, nonce, AEAD_NONCE_LEN);
+	t->opened = 1;
+	t->stats->sealed_opened++;
+	t->opening = 1;
+	int res = read_inner_frames(t, t->open_buf, len, "encrypted");
+	t->opening = 0;
+	return res;
+}
+
+static int read_parity(struct tunnel *t, const struct frame *frame)
+{
+	if (t->fec_in == NULL) {
+		t->fec_in = malloc(sizeof(*t->fec_in));
+		if (t->fec_in == NULL)
+			return ENOMEM;
+		fec_decoder_init(t->fec_in, t->in.max_payload);
+	}
+	t->stats->fec_parity_received++;
+	int res = fec_decoder_parity(t->fec_in, frame->payload, frame->len);
+	if (res == EINVAL)
+		fprintf(stderr, "Error: invalid FEC frame in input stream\n");
+	for (unsigned i = 0; res == 0 && i < t->fec_in->recovered_count; i++) {
+		uint8_t *data = NULL;
+		size_t len = 0;
+		fec_decoder_get(t->fec_in, i, &data, &len);
+		t->stats->fec_recovered++;
+		res = read_inner_frames(t, data, len, "recovered");
+	}
+	t->stats->fec_unrecovered = t->fec_in->unrecovered;
+
+	uint8_t report[FEC_LOSS_LEN];
+	size_t report_len = fec_decoder_report(t->fec_in, report);
+	if (res == 0 && report_len > 0)
+		queue_control(t, FRAME_TYPE_FEC_LOSS, report, report_len);
+	return res;
+}
+
+static int dispatch_frame(struct tunnel *t, const struct frame *frame)
+{
+	if (frame->flags & FRAME_FLAG_SEQUENCE)
+		frame_sequence_check(&t->stats->sequence, frame->sequence);
+	switch (frame->type) {
+	case FRAME_TYPE_PACKET:
+		return write_tun(t, frame->channel, frame->payload, frame->len);
+	case FRAME_TYPE_BATCH: {
+		struct frame_batch batch;
+		if (frame_batch_open(frame, &batch) != 0) {
+			fprintf(stderr, "Error: invalid batch in input stream\n");
+			return EINVAL;
+		}
+		int res = 0;
+		for (uint32_t i = 0; res == 0 && i < batch.count; i++) {
+			const uint8_t *data = NULL;
+			size_t len = 0;
+			frame_batch_get(&batch, i, &data, &len);
+			res = write_tun(t, frame->channel, data, len);
+		}
+		return res;
+	}
+	case FRAME_TYPE_LZ4:
+		return read_compressed(t, frame);
+	case FRAME_TYPE_SEALED:
+		return read_sealed(t, frame);
+	case FRAME_TYPE_HEADER_CONTEXT:
+	case FRAME_TYPE_HEADER_PACKET:
+		return read_header_compressed(t, frame);
+	case FRAME_TYPE_FEC:
+		return read_parity(t, frame);
+	case FRAME_TYPE_FEC_LOSS:
+		if (t->fec_out != NULL)
+			fec_encoder_report(t->fec_out, frame->payload, frame->len);
+		return 0;
+	case FRAME_TYPE_PROBE:
+		queue_control(t, FRAME_TYPE_PROBE_REPLY, frame->payload, frame->len);
+		return 0;
+	case FRAME_TYPE_PROBE_REPLY:
+		if (t->options->probes != NULL)
+			probe_reply(t->options->probes, frame->payload, frame->len,
+				now_ns(CLOCK_MONOTONIC));
+		return 0;
+	default:
+		/* Unknown types are skipped, for compatibility */
+		return 0;
+	}
+}
+
+/* Delivers the frames held for reordering which are due */
+static int release_reordered(struct tunnel *t, uint64_t now)
+{
+	uint8_t *data = NULL;
+	size_t len = 0;
+	int res = 0;
+	while (res == 0 && reorder_pop(t->reorder, now, &data, &len)) {
+		t->reordering = 1;
+		res = read_inner_frames(t, data, len, "reordered");
+		t->reordering = 0;
+	}
+	t->stats->reorder_skipped = t->reorder->skipped;
+	return res;
+}
+
+/* Holds a numbered frame until those before it are delivered */
+static int reorder_frame(struct tunnel *t, const struct frame *frame)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	int res = 0;
+	int action = reorder_hold(t->reorder, frame->sequence);
+	if (action == REORDER_DROP) {
+		t->stats->reorder_duplicates = t->reorder->duplicates;
+		return 0;
+	} else if (action == REORDER_DELIVER) {
+		res = dispatch_frame(t, frame);
+	} else {
+		/* Which may make room for it */
+		res = release_reordered(t, now);
+		/* Kept without its CRC, which was checked */
+		struct frame copy = *frame;
+		copy.flags &= ~FRAME_FLAG_CRC;
+		size_t header_len = frame_header_len(copy.flags);
+		uint8_t *data = (res != 0 ? NULL : reorder_store(t->reorder,
+			frame->sequence, header_len + frame->len, now));
+		if (res == 0 && data == NULL)
+			res = ENOMEM;
+		if (res != 0)
+			return res;
+		frame_put_header(data, &copy);
+		memcpy(data + header_len, frame->payload, frame->len);
+		t->stats->reorder_held++;
+	}
+	if (res == 0)
+		res = release_reordered(t, now);
+	return res;
+}
+
+static int read_frame(struct tunnel *t, const struct frame *frame)
+{
+	/* With a key, everything has to come from its holder */
+	if (t->options->key != NULL && !t->opening &&
+		frame->type != FRAME_TYPE_SEALED) {
+		t->stats->sealed_rejected++;
+		return 0;
+	}
+	if (t->reorder != NULL && !t->reordering &&
+		(frame->flags & FRAME_FLAG_SEQUENCE))
+		return reorder_frame(t, frame);
+	return dispatch_frame(t, frame);
+}
+
+/* Returns EAGAIN once there is nothing left to read from fd */
+static int read_input_once(struct tunnel *t, int fd)
+{
+	const struct tunnel_options *options = t->options;
+	size_t len = 0;
+	int res = 0;
+
+	if (options->framed) {
+		res = frame_decoder_fill(&t->in, fd, &len);
+	} else {
+		/* Without framing, each read is assumed to be one packet */
+		ssize_t read_len = read(fd, t->in.buf,
+			options->buffer_len);
+		res = (read_len < 0 ? (errno == EINTR ? EAGAIN : errno) :
+			read_len == 0 ? ENODATA : 0);
+		len = (read_len > 0 ? read_len : 0);
+	}
+	/* ECONNREFUSED reports an earlier datagram the peer was not there for */
+	if (res == EAGAIN || (res == ECONNREFUSED && options->datagrams))
+		return EAGAIN;
+	if (res == ENODATA && options->datagrams)
+		return 0; /* an empty datagram */
+	if (res == ENODATA) {
+		if (verbosity > 0)
+			fprintf(stderr, "Input stream closed\n");
+		t->in_open = 0;
+		return EAGAIN;
+	}
+	if (res != 0) {
+		perror("read(in)");
+		return res;
+	}
+	t->stats->stream_rx_bytes += len;
+	t->now = now_ns(CLOCK_REALTIME);
+
+	if (!options->framed) {
+		res = write_tun(t, 0, t->in.buf, len);
+	} else {
+		while (res == 0) {
+			struct frame frame;
+			size_t start = t->in.start;
+			unsigned long long corrupted = t->in.corrupted;
+			res = frame_decoder_next(&t->in, &frame);
+			/* Numbered frames are kept as they were received, in case
+			 * parity frames need them to rebuild the missing ones */
+			if (res == 0 && t->fec_in != NULL &&
+				(frame.flags & FRAME_FLAG_SEQUENCE) &&
+				t->in.corrupted == corrupted)
+				res = fec_decoder_add(t->fec_in, frame.sequence,
+					t->in.buf + start, t->in.start - start);
+			if (res == 0)
+				res = read_frame(t, &frame);
+		}
+		/* Datagrams hold whole frames, what is left is a truncated one */
+		if (res == EAGAIN && options->datagrams &&
+			t->in.start != t->in.end) {
+			t->in.corrupted++;
+			t->in.skipped += t->in.end - t->in.start;
+			t->in.start = t->in.end;
+		}
+		t->stats->frames_corrupted = t->in.corrupted;
+		t->stats->frames_skipped_bytes = t->in.skipped;
+	}
+	if (options->sketch != NULL)
+		sketch_flush(options->sketch);
+	return (res == EAGAIN ? 0 : res);
+}
+
+static int read_input(struct tunnel *t, int fd)
+{
+	/* A datagram is read at a time, take a batch of them per wakeup */
+	int reads = (t->options->datagrams ? READ_BATCH_LEN : 1);
+	int res = 0;
+	for (int i = 0; res == 0 && i < reads && t->in_open; i++)
+		res = read_input_once(t, fd);
+	return (res == EAGAIN ? 0 : res);
+}
+
+/* Reads a batch of packets from a device, and sends them */
+static int read_device(struct tunnel *t, unsigned channel)
+{
+	const struct tunnel_options *options = t->options;
+	int res = 0;
+	if (options->bridge != NULL)
+		res = switch_tun(t, channel);
+	else if (options->routes != NULL)
+		res = route_tun(t, channel);
+	else
+		res = read_tun(t, channel);
+	if (res == 0 && options->tee != NULL)
+		fanout_flush(options->tee, NULL);
+	if (res == 0 && options->balance != NULL)
+		fanout_flush(options->balance, NULL);
+	if (res == 0 && t->out_open && options->compressed)
+		compress_output(t);
+	if (res == 0 && t->out_open && options->key != NULL)
+		res = seal_output(t);
+	if (res == 0 && t->out_open)
+		res = flush_output(t);
+	return res;
+}
+
+static int needs_tick(const struct tunnel_options *options)
+{
+	return options->flows != NULL;
+}
+
+static int tick(struct tunnel *t)
+{
+	if (t->options->flows != NULL)
+		return ipfix_meter_expire(t->options->flows, now_ns(CLOCK_REALTIME));
+	return 0;
+}
+
+/* Sends random bytes to the peer and reads its own, to derive the key of
+ * each direction from both and the pre-shared key. Frames are then only
+ * accepted in the session and direction they were sealed for. */
+static int exchange_keys(struct tunnel *t)
+{
+	const struct tunnel_options *options = t->options;
+	uint8_t local[AEAD_NONCE_LEN];
+	uint8_t remote[AEAD_NONCE_LEN];
+	if (!t->in_open || !t->out_open) {
+		fprintf(stderr, "Error: --encrypt requires both an input and an"
+			" output stream\n");
+		return EINVAL;
+	}
+	if (getrandom(local, sizeof(local), 0) != sizeof(local)) {
+		perror("getrandom()");
+		return EIO;
+	}
+	int res = write_all(options->out_fd, local, sizeof(local));
+	if (res == 0)
+		res = read_exact(options->in_fd, remote, sizeof(remote),
+			&interrupt_flag);
+	if (res != 0) {
+		if (interrupt_flag == 0)
+			fprintf(stderr, "Error: unable to exchange keys with the peer:"
+				" %s\n", strerror(res));
+		return res;
+	}
+	if (memcmp(local, remote, sizeof(local)) == 0) {
+		fprintf(stderr, "Error: the encrypted stream loops back to us\n");
+		return EINVAL;
+	}
+	uint8_t half[AEAD_KEY_LEN];
+	aead_derive(options->key, local, half, sizeof(half));
+	aead_derive(half, remote, t->seal_key, sizeof(t->seal_key));
+	aead_derive(options->key, remote, half, sizeof(half));
+	aead_derive(half, local, t->open_key, sizeof(t->open_key));
+	memset(half, 0, sizeof(half));
+	t->stats->stream_tx_bytes += sizeof(local);
+	t->stats->stream_rx_bytes += sizeof(remote);
+	return 0;
+}
+
+int infinite_loop(const struct tunnel_options *options, struct stats *stats)
+{
+	struct tunnel t;
+	int saved_in_flags = -1;
+	int saved_out_flags = -1;
+	int saved_path_flags[TUNNEL_MAX_PATHS];
+	memset(&t, 0, sizeof(t));
+	t.options = options;
+	t.stats = stats;
+	t.in_open = (options->in_fd >= 0);
+	t.out_open = (options->out_fd >= 0);
+
+	if (options->key != NULL)
+		t.out_headroom = frame_header_len(FRAME_FLAG_CRC) + AEAD_NONCE_LEN;
+	size_t max_frame = FRAME_MAX_HEADER_LEN + options->buffer_len +
+		FRAME_CRC_LEN + HEADER_CONTEXT_PREFIX_LEN;
+	t.out_cap = t.out_headroom + READ_BATCH_LEN * max_frame +
+		frame_batch_header_len(FRAME_FLAGS_KNOWN, READ_BATCH_LEN) +
+		FRAME_CRC_LEN + AEAD_TAG_LEN + FRAME_CRC_LEN;
+	int res = 0;
+	if (options->fec_group > 0) {
+		t.fec_out = malloc(sizeof(*t.fec_out));
+		res = (t.fec_out == NULL ? ENOMEM : fec_encoder_init(t.fec_out,
+			options->fec_group, options->fec_parity, max_frame));
+		if (res != 0) {
+			free(t.fec_out);
+			t.fec_out = NULL;
+		} else {
+			/* Groups end with batches, so there are never more parity
+			 * frames than packets in a batch */
+			t.out_cap += fec_encoder_room(t.fec_out, READ_BATCH_LEN);
+		}
+	}
+	t.out_start = t.out_end = t.out_headroom;
+	if (res == 0) {
+		t.out = malloc(t.out_cap);
+		res = (t.out == NULL ? ENOMEM : 0);
+	}
+	/* Before the streams are made non-blocking */
+	if (res == 0 && options->key != NULL) {
+		res = exchange_keys(&t);
+		if (res == EINTR && interrupt_flag != 0)
+			res = 0;
+	}
+	if (res == 0 && (options->routes != NULL || options->bridge != NULL)) {
+		t.forward_buf = malloc(READ_BATCH_LEN * options->buffer_len);
+		res = (t.forward_buf == NULL ? ENOMEM : 0);
+	}
+	if (res == 0 && options->compressed) {
+		t.compress_buf = malloc(t.out_cap);
+		res = (t.compress_buf == NULL ? ENOMEM : 0);
+	}
+	if (res == 0 && options->header_compressed) {
+		t.headers_out = malloc(sizeof(*t.headers_out));
+		res = (t.headers_out == NULL ? ENOMEM :
+			header_compressor_init(t.headers_out, options->link));
+	}
+	/* Frames from a peer with the same buffer size are at most a whole
+	 * output buffer, as a batch or compressed */
+	if (res == 0)
+		res = frame_decoder_init(&t.in, t.out_cap, options->buffer_len);
+	if (res == 0 && t.in_open)
+		res = set_nonblocking(options->in_fd, &saved_in_flags);
+	if (res == 0 && t.out_open)
+		res = set_nonblocking(options->out_fd, &saved_out_flags);
+	/* The first path is in_fd and out_fd */
+	for (unsigned i = 0; i < options->path_count; i++)
+		saved_path_flags[i] = -1;
+	for (unsigned i = 1; res == 0 && i < options->path_count; i++)
+		res = set_nonblocking(options->path_fds[i], &saved_path_flags[i]);
+	if (res == 0 && options->path_count > 1 && !options->stripe_flows) {
+		t.reorder = malloc(sizeof(*t.reorder));
+		if (t.reorder == NULL)
+			res = ENOMEM;
+		else
+			reorder_init(t.reorder, TUNNEL_REORDER_NS);
+	}
+
+	t.next_tick = now_ns(CLOCK_MONOTONIC) + TUNNEL_TICK_NS;
+	t.next_probe = now_ns(CLOCK_MONOTONIC);
+	while (res == 0 && interrupt_flag == 0) {
+		uint64_t now = now_ns(CLOCK_MONOTONIC);
+		uint64_t deadline = UINT64_MAX;
+		if (needs_tick(options)) {
+			if (now >= t.next_tick) {
+				res = tick(&t);
+				if (res != 0)
+					break;
+				t.next_tick = now + TUNNEL_TICK_NS;
+			}
+			deadline = t.next_tick;
+		}
+		if (options->probes != NULL && options->framed && t.out_open) {
+			if (now >= t.next_probe) {
+				uint8_t probe[PROBE_PAYLOAD_LEN];
+				probe_build(options->probes, probe, now);
+				queue_control(&t, FRAME_TYPE_PROBE, probe, sizeof(probe));
+				t.next_probe = now + options->probes->interval_ns;
+			}
+			if (t.next_probe < deadline)
+				deadline = t.next_probe;
+		}
+		if (t.reorder != NULL) {
+			res = release_reordered(&t, now);
+			if (res != 0)
+				break;
+			if (reorder_deadline(t.reorder) < deadline)
+				deadline = reorder_deadline(t.reorder);
+		}
+		/* Control frames go out between two batches of packets */
+		if (t.control_len > 0 && t.out_start == t.out_end) {
+			memcpy(t.out + t.out_headroom, t.control, t.control_len);
+			t.out_end = t.out_headroom + t.control_len;
+			t.control_len = 0;
+			if (options->key != NULL)
+				res = seal_output(&t);
+			if (res == 0)
+				res = flush_output(&t);
+			if (res != 0)
+				break;
+		}
+
+		fd_set read_set;
+		fd_set write_set;
+		struct timeval timeout;
+		struct timeval *timeout_ptr = NULL;
+		int nfds = 0;
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		/* Only read from the devices once the previous batch is out */
+		if (t.out_start == t.out_end) {
+			for (unsigned i = 0; i < options->channels; i++) {
+				FD_SET(options->tun_fds[i], &read_set);
+				if (options->tun_fds[i] >= nfds)
+					nfds = options->tun_fds[i] + 1;
+			}
+		} else if (t.pace_wake == 0)
+			FD_SET(options->out_fd, &write_set);
+		else if (t.pace_wake < deadline)
+			deadline = (t.pace_wake > now ? t.pace_wake : now);
+		if (t.in_open)
+			FD_SET(options->in_fd, &read_set);
+		if (options->in_fd >= nfds)
+			nfds = options->in_fd + 1;
+		if (options->out_fd >= nfds)
+			nfds = options->out_fd + 1;
+		if (options->tee != NULL)
+			nfds = fanout_select(options->tee, &write_set, nfds);
+		if (options->balance != NULL)
+			nfds = fanout_select(options->balance, &write_set, nfds);
+		/* Any path with room lets the output make progress */
+		for (unsigned i = 1; i < options->path_count; i++) {
+			int fd = options->path_fds[i];
+			if (t.in_open)
+				FD_SET(fd, &read_set);
+			if (t.out_open && FD_ISSET(options->out_fd, &write_set))
+				FD_SET(fd, &write_set);
+			if (fd >= nfds)
+				nfds = fd + 1;
+		}
+
+		if (deadline != UINT64_MAX) {
+			timeout.tv_sec = (deadline - now) / 1000000000ULL;
+			timeout.tv_usec = (deadline - now) % 1000000000ULL / 1000;
+			timeout_ptr = &timeout;
+		}
+
+		res = select(nfds, &read_set, &write_set, NULL, timeout_ptr);
+		if (res < 0) {
+			res = 0;
+			if (errno != EINTR) {
+				perror("select()");
+				res = errno;
+			}
+		} else {
+			res = 0;
+			int writable = (t.out_open &&
+				FD_ISSET(options->out_fd, &write_set));
+			for (unsigned i = 1; i < options->path_count; i++)
+				writable |= FD_ISSET(options->path_fds[i], &write_set);
+			if (t.out_open && (writable ||
+				(t.pace_wake != 0 && now_ns(CLOCK_MONOTONIC) >= t.pace_wake)))
+				res = flush_output(&t);
+			if (options->tee != NULL)
+				fanout_flush(options->tee, &write_set);
+			if (options->balance != NULL)
+				fanout_flush(options->balance, &write_set);
+			/* A batch from each device which is ready, for as long as
+			 * the output takes them */
+			for (unsigned i = 0; res == 0 && i < options->channels &&
+				t.out_start == t.out_end; i++) {
+				unsigned channel = (t.next_channel + i) % options->channels;
+				if (!FD_ISSET(options->tun_fds[channel], &read_set))
+					continue;
+				t.next_channel = (channel + 1) % options->channels;
+				res = read_device(&t, channel);
+			}
+			if (res == 0 && t.in_open && FD_ISSET(options->in_fd, &read_set))
+				res = read_input(&t, options->in_fd);
+			for (unsigned i = 1; res == 0 && t.in_open &&
+				i < options->path_count; i++) {
+				if (FD_ISSET(options->path_fds[i], &read_set))
+					res = read_input(&t, options->path_fds[i]);
+			}
+		}
+		if (stats_flag != 0) {
+			stats_flag = 0;
+			stats_print(stderr, stats);
+		}
+		/* Routes which cannot be loaded leave the current ones in place */
+		if (reload_flag != 0) {
+			reload_flag = 0;
+			if (options->routes != NULL &&
+				route_table_reload(options->routes) == 0)
+				fprintf(stderr, "Loaded %u routes from %s\n",
+					options->routes->count, options->routes->path);
+		}
+	}
+	if (interrupt_flag != 0)
+		fprintf(stderr, "Received interrupt, exiting\n");
+
+	if (saved_in_flags >= 0)
+		fcntl(options->in_fd, F_SETFL, saved_in_flags);
+	if (saved_out_flags >= 0)
+		fcntl(options->out_fd, F_SETFL, saved_out_flags);
+	for (unsigned i = 1; i < options->path_count; i++) {
+		if (saved_path_flags[i] >= 0)
+			fcntl(options->path_fds[i], F_SETFL, saved_path_flags[i]);
+	}
+	frame_decoder_free(&t.in);
+	free(t.out);
+	free(t.compress_buf);
+	memset(t.seal_key, 0, sizeof(t.seal_key));
+	memset(t.open_key, 0, sizeof(t.open_key));
+	free(t.forward_buf);
+	free(t.decompress_buf);
+	free(t.open_buf);
+	if (t.headers_out != NULL)
+		header_compressor_free(t.headers_out);
+	free(t.headers_out);
+	if (t.headers_in != NULL)
+		header_decompressor_free(t.headers_in);
+	free(t.headers_in);
+	if (t.fec_out != NULL)
+		fec_encoder_free(t.fec_out);
+	free(t.fec_out);
+	if (t.fec_in != NULL)
+		fec_decoder_free(t.fec_in);
+	free(t.fec_in);
+	if (t.reorder != NULL)
+		reorder_free(t.reorder);
+	free(t.reorder);
+	return res;
+}
@@ -0,0 +1,124 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bridge.h"
+#include "capture.h"
+#include "fanout.h"
+#include "filter.h"
+#include "ipfix.h"
+#include "probe.h"
+#include "route.h"
+#include "sample.h"
+#include "sketch.h"
+#include "stats.h"
+
+/* Maximum number of packets read from the device per wakeup, so that one
+ * direction cannot starve the other */
+#ifndef READ_BATCH_LEN
+#define READ_BATCH_LEN 64
+#endif
+
+extern volatile sig_atomic_t interrupt_flag;
+extern volatile sig_atomic_t stats_flag;
+extern volatile sig_atomic_t reload_flag;
+extern int verbosity;
+
+/* Period of housekeeping (flow expiry...) while relaying packets */
+#define TUNNEL_TICK_NS 1000000000ULL
+
+/* Batches smaller than this are not worth compressing */
+#ifndef TUNNEL_COMPRESS_MIN
+#define TUNNEL_COMPRESS_MIN 256
+#endif
+
+/* Batches which do not compress to less than 7/8 of their size are sent
+ * as they are, and up to this many of the next ones are not compressed */
+#ifndef TUNNEL_COMPRESS_BACKOFF_MAX
+#define TUNNEL_COMPRESS_BACKOFF_MAX 64
+#endif
+
+/* Room for frames generated by tuncat itself (probes and replies) while
+ * the output is busy; more are dropped */
+#ifndef TUNNEL_CONTROL_LEN
+#define TUNNEL_CONTROL_LEN 4096
+#endif
+
+/* Datagrams sent per system call */
+#ifndef TUNNEL_DATAGRAM_BATCH
+#define TUNNEL_DATAGRAM_BATCH 64
+#endif
+
+/* How far ahead of their departure time paced datagrams are handed to the
+ * kernel, the longest burst without an fq qdisc to space them out */
+#ifndef TUNNEL_PACING_HORIZON_NS
+#define TUNNEL_PACING_HORIZON_NS 10000000ULL
+#endif
+
+/* Devices multiplexed over the stream, which are all watched with
+ * select() */
+#define TUNNEL_MAX_CHANNELS 256
+
+/* Datagram sockets frames can be striped over */
+#define TUNNEL_MAX_PATHS 8
+
+/* Consecutive frames sent over the same path when striping round-robin,
+ * so that they still go out in batches */
+#ifndef TUNNEL_STRIPE_RUN
+#define TUNNEL_STRIPE_RUN 8
+#endif
+
+/* How long frames striped round-robin wait for earlier ones */
+#ifndef TUNNEL_REORDER_NS
+#define TUNNEL_REORDER_NS 10000000ULL
+#endif
+
+struct tunnel_options {
+	/* Device of each channel */
+	int tun_fds[TUNNEL_MAX_CHANNELS];
+	unsigned channels;
+	size_t buffer_len;
+	unsigned link;
+	int in_fd;                        /* -1 to not read from a stream */
+	int out_fd;                       /* -1 to not write to a stream */
+	int datagrams;                    /* one frame per read and write */
+	/* Sockets frames are striped over, the first one being in_fd and
+	 * out_fd (datagrams) */
+	int path_fds[TUNNEL_MAX_PATHS];
+	unsigned path_count;
+	int stripe_flows;                 /* by flow, not round-robin */
+	uint64_t pace_bps;                /* 0 to not pace (datagrams) */
+	int framed;
+	int sequenced;                    /* number packet frames */
+	int batched;                      /* one frame per batch of packets */
+	int metadata;                     /* metadata in packet frames */
+	int checksummed;                  /* CRC trailer on frames */
+	int compressed;                   /* LZ4 on batches of frames */
+	int header_compressed;            /* IP/UDP/RTP header compression */
+	const uint8_t *key;               /* NULL to not encrypt (framed) */
+	unsigned fec_group;               /* 0 for no FEC (datagrams) */
+	unsigned fec_parity;              /* 0 to adapt to losses */
+	const struct filter *filter;
+	struct sampler *sampler;          /* NULL to keep every packet */
+	struct capture_writer *capture;   /* NULL to not capture */
+	struct fanout *tee;               /* NULL to not mirror packets */
+	struct fanout *balance;           /* NULL to not spread flows */
+	struct sketch *sketch;            /* NULL to not summarize traffic */
+	struct ipfix_meter *flows;        /* NULL to not export flows */
+	struct probe_stats *probes;       /* NULL to not send probes (framed) */
+	/* NULL to send packets to the peer on the channel of their device,
+	 * reloaded on reload_flag */
+	struct route_table *routes;
+	/* NULL unless switching frames between taps and the peer */
+	struct bridge *bridge;
+};
+
+/* Relays packets between the device and streams until interrupted */
+int infinite_loop(const struct tunnel_options *options, struct stats *stats);
+
+/* Writes a packet to the device, waiting for it to be writable */
+int inject_packet(int tun_fd, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include "udp.h"
+
+#ifndef UDP_SOCKET_BUFFER
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+#endif
+
+static int parse_spec(const char *spec, char *local_port, char *host,
+	char *remote_port)
+{
+	const char *first = strchr(spec, ':');
+	const char *last = strrchr(spec, ':');
+	if (first == NULL || first == last || first - spec >= NI_MAXSERV ||
+		strlen(last + 1) >= NI_MAXSERV || last - first - 1 >= NI_MAXHOST)
+		return EINVAL;
+	memcpy(local_port, spec, first - spec);
+	local_port[first - spec] = '\0';
+	strcpy(remote_port, last + 1);
+	const char *start = first + 1;
+	size_t len = last - start;
+	if (len >= 2 && start[0] == '[' && start[len - 1] == ']') {
+		start++;
+		len -= 2;
+	}
+	memcpy(host, start, len);
+	host[len] = '\0';
+	return (len == 0 || local_port[0] == '\0' || remote_port[0] == '\0' ?
+		EINVAL : 0);
+}
+
+int udp_open(const char *spec, int *fd)
+{
+	char local_port[NI_MAXSERV];
+	char host[NI_MAXHOST];
+	char remote_port[NI_MAXSERV];
+	if (parse_spec(spec, local_port, host, remote_port) != 0) {
+		fprintf(stderr, "Error: invalid UDP transport, expected"
+			" PORT:HOST:PORT\n");
+		return EINVAL;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *remote = NULL;
+	struct addrinfo *local = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	int err = getaddrinfo(host, remote_port, &hints, &remote);
+	if (err == 0) {
+		/* The wildcard address of the family of the peer */
+		hints.ai_family = remote->ai_family;
+		hints.ai_flags = AI_PASSIVE;
+		err = getaddrinfo(NULL, local_port, &hints, &local);
+		if (err != 0)
+			freeaddrinfo(remote);
+	}
+	if (err != 0) {
+		fprintf(stderr, "Error: unable to resolve UDP transport: %s\n",
+			gai_strerror(err));
+		return EINVAL;
+	}
+
+	int res = 0;
+	int buffer = UDP_SOCKET_BUFFER;
+	*fd = socket(remote->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (*fd < 0) {
+		res = errno;
+		perror("socket(udp)");
+	} else if (bind(*fd, local->ai_addr, local->ai_addrlen) != 0) {
+		res = errno;
+		perror("bind(udp)");
+	} else if (connect(*fd, remote->ai_addr, remote->ai_addrlen) != 0) {
+		res = errno;
+		perror("connect(udp)");
+	} else {
+		/* Bursts of a whole batch of packets are common, best effort */
+		setsockopt(*fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+		setsockopt(*fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	}
+	if (res != 0 && *fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+	freeaddrinfo(local);
+	freeaddrinfo(remote);
+	return res;
+}
+
+int udp_enable_txtime(int fd)
+{
+	struct sock_txtime txtime = {
+		.clockid = CLOCK_MONOTONIC,
+		.flags = 0,
+	};
+	if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) != 0) {
+		int res = errno;
+		perror("setsockopt(SO_TXTIME)");
+		return res;
+	}
+	return 0;
+}
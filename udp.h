@@ -0,0 +1,18 @@
+#ifndef UDP_H
+#define UDP_H
+
+/* UDP transport between two tuncats, in place of stdin/stdout: each frame
+ * is sent in its own datagram, so that losing one only loses the packet it
+ * carries. */
+
+/* Opens a socket bound to the local port of a "PORT:HOST:PORT" spec and
+ * connected to the remote host and port, HOST being a name or an address
+ * (IPv6 ones in brackets) */
+int udp_open(const char *spec, int *fd);
+
+/* Lets datagrams sent on fd carry their earliest departure time, an
+ * SCM_TXTIME of CLOCK_MONOTONIC nanoseconds, which the fq qdisc holds
+ * them until */
+int udp_enable_txtime(int fd);
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+/* Helpers shared by the on-disk and on-the-wire formats, which are all
+ * little-endian regardless of the host. */
+
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v & 0xffff);
+	put_le16(p + 2, v >> 16);
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v & 0xffffffff);
+	put_le32(p + 4, v >> 32);
+}
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Network byte order, for packet headers and IPFIX */
+static inline void put_be16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v & 0xffff);
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v & 0xffffffff);
+}
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)get_be16(p) << 16) | get_be16(p + 2);
+}
+
+static inline uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns 0 once all of buf is written to a blocking fd, or an errno */
+static inline int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t res = write(fd, buf, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/* Returns 0 once exactly len bytes are read, and not one more as what
+ * follows is for someone else, or an errno. Waits on a non-blocking fd,
+ * and gives up with EINTR once *interrupted is set, if given. */
+static inline int read_exact(int fd, uint8_t *buf, size_t len,
+	volatile sig_atomic_t *interrupted)
+{
+	while (len > 0) {
+		ssize_t res = read(fd, buf, len);
+		if (res < 0 && errno == EAGAIN) {
+			fd_set read_set;
+			FD_ZERO(&read_set);
+			FD_SET(fd, &read_set);
+			select(fd + 1, &read_set, NULL, NULL, NULL);
+			continue;
+		}
+		if (res < 0 && errno == EINTR &&
+			(interrupted == NULL || *interrupted == 0))
+			continue;
+		if (res < 0)
+			return errno;
+		if (res == 0)
+			return ECONNRESET;
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+#endif